@@ -0,0 +1,420 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <string.h>
+
+#include "ax.h"
+
+/*
+ * GDB agent expressions (AX)
+ *
+ * GDB sends the breakpoint conditions as agent expressions
+ * (see 'Agent Expressions' in the GDB manual): a bytecode for
+ * a stack machine with 64-bit values and big-endian operands
+ * of several sizes. Evaluating it as-is on the target would
+ * require a lot of code, so here it is compiled into the
+ * (smaller) condition bytecode that dbg.asm understands:
+ *
+ * - values are 32-bit, and all the constants become a 32-bit
+ *   little-endian immediate.
+ * - some operations are lowered into simpler ones, e.g.,
+ *   'log_not' becomes 'const 0, equal'.
+ * - jumps are absolute offsets in the compiled program, and
+ *   'end' jumps to the next condition if the result is 0.
+ *
+ * The program is also validated here (known opcodes and
+ * registers, stack bounds and forward jumps only), so the
+ * target can run it without any check.
+ */
+
+/* AX opcodes. */
+#define AX_ADD         0x02
+#define AX_SUB         0x03
+#define AX_MUL         0x04
+#define AX_DIV_SIGNED  0x05
+#define AX_DIV_UNSIGN  0x06
+#define AX_REM_SIGNED  0x07
+#define AX_REM_UNSIGN  0x08
+#define AX_LSH         0x09
+#define AX_RSH_SIGNED  0x0A
+#define AX_RSH_UNSIGN  0x0B
+#define AX_LOG_NOT     0x0E
+#define AX_BIT_AND     0x0F
+#define AX_BIT_OR      0x10
+#define AX_BIT_XOR     0x11
+#define AX_BIT_NOT     0x12
+#define AX_EQUAL       0x13
+#define AX_LESS_SIGNED 0x14
+#define AX_LESS_UNSIGN 0x15
+#define AX_EXT         0x16
+#define AX_REF8        0x17
+#define AX_REF16       0x18
+#define AX_REF32       0x19
+#define AX_IF_GOTO     0x20
+#define AX_GOTO        0x21
+#define AX_CONST8      0x22
+#define AX_CONST16     0x23
+#define AX_CONST32     0x24
+#define AX_CONST64     0x25
+#define AX_REG         0x26
+#define AX_END         0x27
+#define AX_DUP         0x28
+#define AX_POP         0x29
+#define AX_ZERO_EXT    0x2A
+#define AX_SWAP        0x2B
+#define AX_PICK        0x32
+#define AX_ROT         0x33
+
+/* Longest expression accepted. */
+#define AX_MAX_EXPR 512
+
+/* Registers known by the target (GDB i386 numbering). */
+#define AX_MAX_REG 16
+
+/* Compiler state. */
+struct ax_ctx
+{
+	uint8_t *out;
+	size_t   pos;
+	size_t   size;
+	int      depth;
+};
+
+/**
+ * @brief Amount of operand bytes that follows the AX
+ * opcode @p op.
+ *
+ * @param op AX opcode.
+ *
+ * @return Returns the operand size, or -1 if the opcode
+ * is not supported.
+ */
+static int ax_operands(uint8_t op)
+{
+	switch (op) {
+	case AX_ADD:        case AX_SUB:        case AX_MUL:
+	case AX_DIV_SIGNED: case AX_DIV_UNSIGN: case AX_REM_SIGNED:
+	case AX_REM_UNSIGN: case AX_LSH:        case AX_RSH_SIGNED:
+	case AX_RSH_UNSIGN: case AX_LOG_NOT:    case AX_BIT_AND:
+	case AX_BIT_OR:     case AX_BIT_XOR:    case AX_BIT_NOT:
+	case AX_EQUAL:      case AX_LESS_SIGNED:case AX_LESS_UNSIGN:
+	case AX_REF8:       case AX_REF16:      case AX_REF32:
+	case AX_END:        case AX_DUP:        case AX_POP:
+	case AX_SWAP:       case AX_ROT:
+		return (0);
+	case AX_EXT:
+	case AX_ZERO_EXT:
+	case AX_PICK:
+	case AX_CONST8:
+		return (1);
+	case AX_IF_GOTO:
+	case AX_GOTO:
+	case AX_CONST16:
+	case AX_REG:
+		return (2);
+	case AX_CONST32:
+		return (4);
+	case AX_CONST64:
+		return (8);
+	default:
+		return (-1);
+	}
+}
+
+/**
+ * @brief Emits the target instruction @p op, that pops
+ * @p in values and pushes @p out values, followed by
+ * @p n bytes of the immediate @p imm (little-endian).
+ *
+ * @param c Compiler state.
+ * @param op Target opcode.
+ * @param in Values popped.
+ * @param out Values pushed.
+ * @param imm Immediate.
+ * @param n Immediate size.
+ *
+ * @return Returns 0 if success, -1 if the stack or the
+ * output buffer would overflow/underflow.
+ */
+static int emit(struct ax_ctx *c, uint8_t op, int in, int out,
+	uint32_t imm, size_t n)
+{
+	size_t i;
+
+	if (c->depth < in || c->depth - in + out > COND_MAX_STACK)
+		return (-1);
+	if (c->pos + 1 + n > c->size)
+		return (-1);
+
+	c->depth += out - in;
+	c->out[c->pos++] = op;
+	for (i = 0; i < n; i++, imm >>= 8)
+		c->out[c->pos++] = imm & 0xFF;
+
+	return (0);
+}
+
+/**
+ * @brief Lowers the AX operation @p op, with operand
+ * @p v, into target instructions.
+ *
+ * @param c Compiler state.
+ * @param op AX opcode (not a jump).
+ * @param v Operand, if any.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int ax_lower(struct ax_ctx *c, uint8_t op, uint32_t v)
+{
+	static const uint8_t binary[] = {
+		[AX_ADD]         = COND_OP_ADD,
+		[AX_SUB]         = COND_OP_SUB,
+		[AX_MUL]         = COND_OP_MUL,
+		[AX_DIV_SIGNED]  = COND_OP_DIVS,
+		[AX_DIV_UNSIGN]  = COND_OP_DIVU,
+		[AX_REM_SIGNED]  = COND_OP_REMS,
+		[AX_REM_UNSIGN]  = COND_OP_REMU,
+		[AX_LSH]         = COND_OP_LSH,
+		[AX_RSH_SIGNED]  = COND_OP_RSHS,
+		[AX_RSH_UNSIGN]  = COND_OP_RSHU,
+		[AX_BIT_AND]     = COND_OP_AND,
+		[AX_BIT_OR]      = COND_OP_OR,
+		[AX_BIT_XOR]     = COND_OP_XOR,
+		[AX_EQUAL]       = COND_OP_EQ,
+		[AX_LESS_SIGNED] = COND_OP_LTS,
+		[AX_LESS_UNSIGN] = COND_OP_LTU,
+	};
+
+	switch (op) {
+	case AX_ADD:        case AX_SUB:        case AX_MUL:
+	case AX_DIV_SIGNED: case AX_DIV_UNSIGN: case AX_REM_SIGNED:
+	case AX_REM_UNSIGN: case AX_LSH:        case AX_RSH_SIGNED:
+	case AX_RSH_UNSIGN: case AX_BIT_AND:    case AX_BIT_OR:
+	case AX_BIT_XOR:    case AX_EQUAL:      case AX_LESS_SIGNED:
+	case AX_LESS_UNSIGN:
+		return (emit(c, binary[op], 2, 1, 0, 0));
+
+	/* !x: x == 0. */
+	case AX_LOG_NOT:
+		if (emit(c, COND_OP_CONST, 0, 1, 0, 4) < 0)
+			return (-1);
+		return (emit(c, COND_OP_EQ, 2, 1, 0, 0));
+
+	/* ~x: x ^ 0xFFFFFFFF. */
+	case AX_BIT_NOT:
+		if (emit(c, COND_OP_CONST, 0, 1, 0xFFFFFFFF, 4) < 0)
+			return (-1);
+		return (emit(c, COND_OP_XOR, 2, 1, 0, 0));
+
+	/* Sign extension: (x << (32-n)) >> (32-n), signed. */
+	case AX_EXT:
+		if (v >= 32)
+			return (0);
+		if (!v ||
+			emit(c, COND_OP_CONST, 0, 1, 32 - v, 4) < 0 ||
+			emit(c, COND_OP_LSH,   2, 1, 0, 0)      < 0 ||
+			emit(c, COND_OP_CONST, 0, 1, 32 - v, 4) < 0)
+		{
+			return (-1);
+		}
+		return (emit(c, COND_OP_RSHS, 2, 1, 0, 0));
+
+	/* Zero extension: x & mask. */
+	case AX_ZERO_EXT:
+		if (v >= 32)
+			return (0);
+		if (emit(c, COND_OP_CONST, 0, 1, (1U << v) - 1, 4) < 0)
+			return (-1);
+		return (emit(c, COND_OP_AND, 2, 1, 0, 0));
+
+	case AX_REF8:
+		return (emit(c, COND_OP_REF8, 1, 1, 0, 0));
+	case AX_REF16:
+		return (emit(c, COND_OP_REF16, 1, 1, 0, 0));
+	case AX_REF32:
+		return (emit(c, COND_OP_REF32, 1, 1, 0, 0));
+
+	/* 64-bit constants are truncated, as everything else. */
+	case AX_CONST8:
+	case AX_CONST16:
+	case AX_CONST32:
+	case AX_CONST64:
+		return (emit(c, COND_OP_CONST, 0, 1, v, 4));
+
+	case AX_REG:
+		if (v >= AX_MAX_REG)
+			return (-1);
+		return (emit(c, COND_OP_REG, 0, 1, v, 1));
+
+	case AX_DUP:
+		return (emit(c, COND_OP_PICK, 1, 2, 0, 1));
+	case AX_PICK:
+		if ((int)v >= c->depth)
+			return (-1);
+		return (emit(c, COND_OP_PICK, 0, 1, v, 1));
+	case AX_POP:
+		return (emit(c, COND_OP_POP, 1, 0, 0, 0));
+	case AX_SWAP:
+		return (emit(c, COND_OP_SWAP, 2, 2, 0, 0));
+	case AX_ROT:
+		return (emit(c, COND_OP_ROT, 3, 3, 0, 0));
+	}
+
+	return (-1);
+}
+
+/**
+ * @brief Compiles the agent expression @p ax into target
+ * condition bytecode, appended to @p out.
+ *
+ * Several conditions may be compiled into the same buffer,
+ * one after another, which the target evaluates in order
+ * until one of them holds. The caller must terminate the
+ * program with COND_OP_DONE.
+ *
+ * @param ax Agent expression.
+ * @param len Agent expression length.
+ * @param out Output buffer.
+ * @param out_len Current output length, updated on success.
+ * @param out_size Output buffer size.
+ *
+ * @return Returns 0 if success, -1 if the expression could
+ * not be compiled (unsupported operations or too big).
+ */
+int ax_compile(const uint8_t *ax, size_t len, uint8_t *out,
+	size_t *out_len, size_t out_size)
+{
+	int16_t  depth_at[AX_MAX_EXPR];
+	uint16_t map[AX_MAX_EXPR + 1];
+	uint8_t  is_insn[AX_MAX_EXPR + 1];
+	size_t   fix_at[AX_MAX_EXPR];
+	uint16_t fix_to[AX_MAX_EXPR];
+	struct ax_ctx c;
+	size_t nfix;
+	size_t off;
+	uint32_t v;
+	int fall;
+	int n, i;
+
+	if (!len || len > AX_MAX_EXPR)
+		return (-1);
+
+	memset(depth_at, 0xFF, sizeof(depth_at));
+	memset(is_insn, 0, sizeof(is_insn));
+
+	c.out   = out;
+	c.pos   = *out_len;
+	c.size  = out_size;
+	c.depth = 0;
+	nfix    = 0;
+	fall    = 1;
+
+	for (off = 0; off < len; off += 1 + n)
+	{
+		if ((n = ax_operands(ax[off])) < 0 || off + 1 + n > len)
+			return (-1);
+
+		is_insn[off] = 1;
+		map[off]     = c.pos;
+
+		/*
+		 * Stack depth here: the same for every path that
+		 * reaches this instruction. Dead code (nothing
+		 * reaches) starts with an empty stack.
+		 */
+		if (depth_at[off] >= 0)
+		{
+			if (fall && c.depth != depth_at[off])
+				return (-1);
+			c.depth = depth_at[off];
+		}
+		else if (!fall)
+			c.depth = 0;
+
+		/* Big-endian operand. */
+		for (v = 0, i = 1; i <= n; i++)
+			v = (v << 8) | ax[off + i];
+
+		fall = (ax[off] != AX_GOTO && ax[off] != AX_END);
+
+		/*
+		 * The result is the top of the stack, if zero, the
+		 * next condition (right after this one) is tried.
+		 */
+		if (ax[off] == AX_END)
+		{
+			if (emit(&c, COND_OP_END, 1, 0, 0, 2) < 0)
+				return (-1);
+			c.depth        = 0;
+			fix_at[nfix]   = c.pos - 2;
+			fix_to[nfix++] = len;
+			continue;
+		}
+
+		if (ax[off] != AX_IF_GOTO && ax[off] != AX_GOTO)
+		{
+			if (ax_lower(&c, ax[off], v) < 0)
+				return (-1);
+			continue;
+		}
+
+		/* Forward jumps only, so we always terminate. */
+		if (v <= off || v >= len)
+			return (-1);
+
+		if (ax[off] == AX_IF_GOTO)
+		{
+			if (emit(&c, COND_OP_IFGOTO, 1, 0, 0, 2) < 0)
+				return (-1);
+		}
+		else if (emit(&c, COND_OP_GOTO, 0, 0, 0, 2) < 0)
+			return (-1);
+
+		if (depth_at[v] >= 0 && depth_at[v] != c.depth)
+			return (-1);
+
+		depth_at[v]    = c.depth;
+		fix_at[nfix]   = c.pos - 2;
+		fix_to[nfix++] = v;
+	}
+
+	/* The expression must not fall off its end. */
+	if (fall)
+		return (-1);
+
+	is_insn[len] = 1;
+	map[len]     = c.pos;
+
+	for (i = 0; i < (int)nfix; i++)
+	{
+		if (!is_insn[fix_to[i]])
+			return (-1);
+		out[fix_at[i]]     = map[fix_to[i]] & 0xFF;
+		out[fix_at[i] + 1] = map[fix_to[i]] >> 8;
+	}
+
+	*out_len = c.pos;
+	return (0);
+}
@@ -0,0 +1,77 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef AX_H
+#define AX_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/*
+	 * Target condition bytecode (see 'Conditional breakpoints'
+	 * in constants.inc).
+	 *
+	 * A program is a list of conditions followed by COND_OP_DONE.
+	 * Values are 32-bit, immediates are little-endian and jump
+	 * targets are absolute offsets within the program.
+	 */
+	#define COND_OP_DONE   0x00 /* No condition holds. */
+	#define COND_OP_END    0x01 /* Pop, if != 0, holds, else imm16. */
+	#define COND_OP_CONST  0x02 /* imm32 */
+	#define COND_OP_REG    0x03 /* GDB register number (1-byte) */
+	#define COND_OP_REF8   0x04
+	#define COND_OP_REF16  0x05
+	#define COND_OP_REF32  0x06
+	#define COND_OP_ADD    0x07
+	#define COND_OP_SUB    0x08
+	#define COND_OP_MUL    0x09
+	#define COND_OP_DIVS   0x0A
+	#define COND_OP_DIVU   0x0B
+	#define COND_OP_REMS   0x0C
+	#define COND_OP_REMU   0x0D
+	#define COND_OP_LSH    0x0E
+	#define COND_OP_RSHS   0x0F
+	#define COND_OP_RSHU   0x10
+	#define COND_OP_AND    0x11
+	#define COND_OP_OR     0x12
+	#define COND_OP_XOR    0x13
+	#define COND_OP_EQ     0x14
+	#define COND_OP_LTS    0x15
+	#define COND_OP_LTU    0x16
+	#define COND_OP_IFGOTO 0x17 /* imm16 target */
+	#define COND_OP_GOTO   0x18 /* imm16 target */
+	#define COND_OP_PICK   0x19 /* 1-byte depth */
+	#define COND_OP_POP    0x1A
+	#define COND_OP_SWAP   0x1B
+	#define COND_OP_ROT    0x1C
+
+	/* Target limits. */
+	#define COND_MAX_CODE  128
+	#define COND_MAX_STACK 16
+
+	extern int ax_compile(const uint8_t *ax, size_t len, uint8_t *out,
+		size_t *out_len, size_t out_size);
+
+#endif /* AX_H */
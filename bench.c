@@ -0,0 +1,642 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for the bridge hot paths: the hex codecs,
+ * and the GDB and serial state machines, fed with synthetic
+ * streams through socket pairs, as if from GDB and from the
+ * target.
+ *
+ * Each result is a single line of 'key=value' fields, e.g.:
+ *   bench=encode_hex/4096 ops=... bytes=... ns_op=... ns_byte=...
+ *
+ * so that they can be compared across commits with any
+ * text tool.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "net.h"
+#include "gdb.h"
+#include "protocol.h"
+
+/* Stop: registers (48 bytes), reason (1) and address (4). */
+#ifdef UART_POLLING
+#define STOP_SIZE 53
+#else
+#define STOP_SIZE 57
+#endif
+
+/* Socket buffers, big enough for a stream chunk and its replies. */
+#define SOCK_BUFF   (1 << 20)
+#define CHUNK_SIZE  4096
+#define MEM_READ    1024
+#define MEM_START   0x10000
+#define MEM_END     0x90000
+
+/* Socket pairs: bridge side (0) and our side (1). */
+static int gdb_sp[2];
+static int serial_sp[2];
+
+/* How long each benchmark runs, in ns. */
+static uint64_t bench_time = 250000000;
+
+/*
+ * Results output: the original stdout, as the bridge
+ * prints its own messages there (see main()).
+ */
+static FILE *out;
+
+/* Result of a benchmark. */
+struct result
+{
+	const char *name;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t ns;
+	uint64_t *lat;
+	size_t lat_count;
+	size_t lat_size;
+};
+
+/**
+ * @brief Current time, in ns.
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/**
+ * @brief Saves the latency of a single operation.
+ *
+ * @param r Benchmark result.
+ * @param ns Operation latency, in ns.
+ */
+static void lat_add(struct result *r, uint64_t ns)
+{
+	uint64_t *tmp;
+
+	if (r->lat_count == r->lat_size)
+	{
+		r->lat_size = r->lat_size ? r->lat_size * 2 : 1024;
+		tmp = realloc(r->lat, r->lat_size * sizeof(*tmp));
+		if (!tmp)
+			errx("Unable to allocate latencies!\n");
+		r->lat = tmp;
+	}
+	r->lat[r->lat_count++] = ns;
+}
+
+/* qsort() comparator for latencies. */
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return ((x > y) - (x < y));
+}
+
+/**
+ * @brief Prints the benchmark result, and frees it.
+ *
+ * @param r Benchmark result.
+ */
+static void result_print(struct result *r)
+{
+	double secs = r->ns / 1e9;
+
+	fprintf(out, "bench=%s ops=%llu bytes=%llu ns_op=%.1f ns_byte=%.3f "
+		"mb_s=%.2f ops_s=%.0f", r->name,
+		(unsigned long long)r->ops, (unsigned long long)r->bytes,
+		(double)r->ns / r->ops,
+		r->bytes ? (double)r->ns / r->bytes : 0.0,
+		r->bytes / secs / 1e6, r->ops / secs);
+
+	if (r->lat_count)
+	{
+		qsort(r->lat, r->lat_count, sizeof(*r->lat), cmp_u64);
+		fprintf(out, " p50_ns=%llu p99_ns=%llu",
+			(unsigned long long)r->lat[r->lat_count / 2],
+			(unsigned long long)r->lat[r->lat_count * 99 / 100]);
+	}
+
+	fprintf(out, "\n");
+	fflush(out);
+	free(r->lat);
+}
+
+/* ------------------------------------------------------------------*
+ * Fake GDB and target                                               *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Writes @p len bytes to @p fd, or aborts.
+ */
+static void write_all(int fd, const void *buf, size_t len)
+{
+	if (send_all(fd, buf, len) < 0)
+		errx("Unable to write: %s\n", strerror(errno));
+}
+
+/**
+ * @brief Checks if @p fd has something to be read.
+ */
+static int readable(int fd)
+{
+	struct pollfd p = {.fd = fd, .events = POLLIN};
+	return (poll(&p, 1, 0) > 0);
+}
+
+/**
+ * @brief Lets the bridge handle everything pending from
+ * GDB and from the target, as its event loop would.
+ */
+static void bridge_run(void)
+{
+	struct handler_fd gdb    = {.fd = gdb_sp[0]};
+	struct handler_fd serial = {.fd = serial_sp[0]};
+	int busy;
+
+	do
+	{
+		busy = 0;
+		if (readable(gdb_sp[0]))
+		{
+			handle_gdb_msg(&gdb);
+			busy = 1;
+		}
+		if (readable(serial_sp[0]))
+		{
+			handle_serial_msg(&serial);
+			busy = 1;
+		}
+		flush_fds();
+	} while (busy);
+}
+
+/**
+ * @brief Reads what the bridge sent to GDB.
+ *
+ * @return Returns the amount of packets, i.e., of '#'.
+ */
+static size_t gdb_drain(void)
+{
+	char buf[CHUNK_SIZE];
+	size_t packets = 0;
+	ssize_t ret, i;
+
+	while ((ret = recv(gdb_sp[1], buf, sizeof buf, MSG_DONTWAIT)) > 0)
+		for (i = 0; i < ret; i++)
+			packets += (buf[i] == '#');
+	return (packets);
+}
+
+/**
+ * @brief Sends a GDB packet with @p data to the bridge.
+ */
+static void gdb_send(const char *data)
+{
+	char pkt[256];
+	uint8_t csum = 0;
+	size_t i;
+
+	for (i = 0; data[i]; i++)
+		csum += data[i];
+
+	i = snprintf(pkt, sizeof pkt, "$%s#%02x", data, csum);
+	write_all(gdb_sp[1], pkt, i);
+}
+
+/**
+ * @brief Builds a stop message in @p buf.
+ *
+ * @return Returns the message size.
+ */
+static size_t target_stop(uint8_t *buf)
+{
+	uint16_t segs[8] = {
+		0,      /* GS.     */
+		0,      /* FS.     */
+		0,      /* ES.     */
+		0,      /* DS.     */
+		0,      /* SS.     */
+		0x7c00, /* IP.     */
+		0,      /* CS.     */
+		0x0202  /* FLAGS.  */
+	};
+	uint32_t gprs[8] = {0, 0, 0, 0x7000, 0, 0, 0, 0};
+
+	memset(buf, 0, STOP_SIZE + 1);
+	buf[0] = MSG_SINGLE_STEP;
+	memcpy(buf + 1, gprs, sizeof gprs);
+	memcpy(buf + 1 + sizeof gprs, segs, sizeof segs);
+	buf[1 + sizeof gprs + sizeof segs] = STOP_REASON_NORMAL;
+	return (STOP_SIZE + 1);
+}
+
+/**
+ * @brief Answers what the bridge asked the target: hello
+ * and memory reads, with the memory being its address low
+ * byte.
+ */
+static void target_reply(void)
+{
+	static uint8_t cmds[CHUNK_SIZE];
+	static size_t  cmds_len;
+	static uint8_t reply[1 + 0x10000];
+	uint32_t addr;
+	uint16_t amnt;
+	ssize_t ret;
+	size_t i;
+
+	while ((ret = recv(serial_sp[1], cmds + cmds_len,
+		sizeof cmds - cmds_len, MSG_DONTWAIT)) > 0)
+	{
+		cmds_len += ret;
+	}
+
+	for (i = 0; i < cmds_len; )
+	{
+		if (cmds[i] == MSG_HELLO)
+		{
+			if (cmds_len - i < 3)
+				break;
+			reply[0] = MSG_HELLO;
+			reply[1] = reply[2] = 0;
+			write_all(serial_sp[1], reply, 3);
+			i += 3;
+		}
+		else if (cmds[i] == MSG_READ_MEM)
+		{
+			if (cmds_len - i < 7)
+				break;
+			memcpy(&addr, cmds + i + 1, 4);
+			memcpy(&amnt, cmds + i + 5, 2);
+			reply[0] = MSG_READ_MEM;
+			memset(reply + 1, addr & 0xFF, amnt);
+			write_all(serial_sp[1], reply, amnt + 1);
+			i += 7;
+		}
+		else
+			errx("Unexpected command from bridge: %02x\n", cmds[i]);
+	}
+
+	memmove(cmds, cmds + i, cmds_len - i);
+	cmds_len -= i;
+}
+
+/**
+ * @brief Brings the bridge to where GDB is connected to
+ * a stopped target, without acks.
+ */
+static void setup_bridge(void)
+{
+	uint8_t stop[STOP_SIZE + 1];
+	int size = SOCK_BUFF;
+	int i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, gdb_sp) < 0 ||
+		socketpair(AF_UNIX, SOCK_STREAM, 0, serial_sp) < 0)
+	{
+		errx("Unable to create socket pairs!\n");
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		setsockopt(gdb_sp[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+		setsockopt(gdb_sp[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+		setsockopt(serial_sp[i], SOL_SOCKET, SO_SNDBUF, &size,
+			sizeof size);
+		setsockopt(serial_sp[i], SOL_SOCKET, SO_RCVBUF, &size,
+			sizeof size);
+	}
+
+	/* GDB first, so that the stop goes to it. */
+	gdb_send("QStartNoAckMode");
+	bridge_run();
+	gdb_drain();
+
+	write_all(serial_sp[1], stop, target_stop(stop));
+	bridge_run();
+	target_reply();
+	bridge_run();
+	gdb_drain();
+}
+
+/* ------------------------------------------------------------------*
+ * Benchmarks                                                        *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief encode_hex() and decode_hex() of @p len bytes.
+ */
+static void bench_hex(size_t len)
+{
+	struct result enc = {0}, dec = {0};
+	static char name[2][32];
+	char *data, *hex;
+	uint64_t start;
+	size_t i;
+
+	data = malloc(len);
+	hex  = malloc(len * 2);
+	if (!data || !hex)
+		errx("Unable to allocate %zu bytes!\n", len);
+
+	for (i = 0; i < len; i++)
+		data[i] = rand();
+
+	snprintf(name[0], sizeof name[0], "encode_hex/%zu", len);
+	enc.name = name[0];
+	start = now_ns();
+	do
+	{
+		for (i = 0; i < 64; i++)
+			encode_hex(data, len);
+		enc.ops += 64;
+	} while ((enc.ns = now_ns() - start) < bench_time);
+	enc.bytes = enc.ops * len;
+	result_print(&enc);
+
+	memcpy(hex, encode_hex(data, len), len * 2);
+
+	snprintf(name[1], sizeof name[1], "decode_hex/%zu", len);
+	dec.name = name[1];
+	start = now_ns();
+	do
+	{
+		for (i = 0; i < 64; i++)
+			if (!decode_hex(hex, len))
+				errx("decode_hex() failed!\n");
+		dec.ops += 64;
+	} while ((dec.ns = now_ns() - start) < bench_time);
+	dec.bytes = dec.ops * len;
+	result_print(&dec);
+
+	free(data);
+	free(hex);
+}
+
+/**
+ * @brief read_int() of addresses, as in 'm' packets.
+ */
+static void bench_read_int(void)
+{
+	struct result r = {.name = "read_int"};
+	static const char str[] = "7c00,200";
+	const char *end;
+	uint64_t start;
+	volatile uint32_t v;
+	size_t len, i;
+
+	start = now_ns();
+	do
+	{
+		for (i = 0; i < 1024; i++)
+		{
+			len = sizeof(str) - 1;
+			v = read_int(str, &len, &end, 16);
+		}
+		r.ops += 1024;
+	} while ((r.ns = now_ns() - start) < bench_time);
+	(void)v;
+
+	r.bytes = r.ops * 4;
+	result_print(&r);
+}
+
+/**
+ * @brief The GDB state machine, fed with a stream of the
+ * packet @p data, all of them answered without the target.
+ */
+static void bench_gdb_stream(const char *name, const char *data)
+{
+	struct result r = {.name = name};
+	char pkt[256], *chunk;
+	size_t pkt_len, per_chunk, replies;
+	uint8_t csum = 0;
+	uint64_t start;
+	size_t i;
+
+	for (i = 0; data[i]; i++)
+		csum += data[i];
+	pkt_len = snprintf(pkt, sizeof pkt, "$%s#%02x", data, csum);
+
+	/* Chunk of whole packets. */
+	per_chunk = CHUNK_SIZE / pkt_len;
+	chunk = malloc(per_chunk * pkt_len);
+	if (!chunk)
+		errx("Unable to allocate the packet stream!\n");
+	for (i = 0; i < per_chunk; i++)
+		memcpy(chunk + i * pkt_len, pkt, pkt_len);
+
+	replies = 0;
+	start   = now_ns();
+	do
+	{
+		write_all(gdb_sp[1], chunk, per_chunk * pkt_len);
+		bridge_run();
+		target_reply();
+		replies += gdb_drain();
+		r.ops   += per_chunk;
+	} while ((r.ns = now_ns() - start) < bench_time);
+
+	if (replies != r.ops)
+		errx("%s: %zu packets, %zu replies!\n", name, (size_t)r.ops,
+			replies);
+
+	r.bytes = r.ops * pkt_len;
+	result_print(&r);
+	free(chunk);
+}
+
+/**
+ * @brief The serial state machine, fed with a stream of
+ * stops, each one reported to GDB.
+ */
+static void bench_serial_stops(void)
+{
+	struct result r = {.name = "serial_stop"};
+	uint8_t chunk[CHUNK_SIZE];
+	size_t stop_len, per_chunk, replies;
+	uint64_t start;
+	size_t i;
+
+	stop_len  = target_stop(chunk);
+	per_chunk = CHUNK_SIZE / stop_len;
+	for (i = 1; i < per_chunk; i++)
+		memcpy(chunk + i * stop_len, chunk, stop_len);
+
+	replies = 0;
+	start   = now_ns();
+	do
+	{
+		write_all(serial_sp[1], chunk, per_chunk * stop_len);
+		bridge_run();
+		replies += gdb_drain();
+		r.ops   += per_chunk;
+	} while ((r.ns = now_ns() - start) < bench_time);
+
+	if (replies != r.ops)
+		errx("serial_stop: %zu stops, %zu replies!\n", (size_t)r.ops,
+			replies);
+
+	r.bytes = r.ops * stop_len;
+	result_print(&r);
+}
+
+/**
+ * @brief Memory reads from GDB, answered by the target: the
+ * whole round trip, from the 'm' packet to its reply, with
+ * the serial memory replies going through the serial state
+ * machine.
+ *
+ * The reads are sequential, so the read-ahead also plays
+ * its part, and a stop empties the cache each time the
+ * end is reached.
+ */
+static void bench_serial_memory(void)
+{
+	struct result r = {0};
+	uint8_t stop[STOP_SIZE + 1];
+	uint64_t start, op;
+	static char name[32];
+	uint32_t addr;
+	char cmd[32];
+
+	snprintf(name, sizeof name, "serial_memory/%d", MEM_READ);
+	r.name = name;
+
+	addr  = MEM_START;
+	start = now_ns();
+	do
+	{
+		op = now_ns();
+		snprintf(cmd, sizeof cmd, "m%x,%x", addr, MEM_READ);
+		gdb_send(cmd);
+
+		/* Until GDB gets its reply. */
+		do
+		{
+			bridge_run();
+			target_reply();
+		} while (!gdb_drain());
+
+		lat_add(&r, now_ns() - op);
+		r.ops++;
+
+		addr += MEM_READ;
+		if (addr >= MEM_END)
+		{
+			addr = MEM_START;
+			write_all(serial_sp[1], stop, target_stop(stop));
+			bridge_run();
+			gdb_drain();
+		}
+	} while ((r.ns = now_ns() - start) < bench_time);
+
+	r.bytes = r.ops * MEM_READ;
+	result_print(&r);
+}
+
+/**
+ * @brief Prints how many sends the bridge made, and how
+ * many write(2) calls they took (see send_buffered()).
+ */
+static void print_net_stats(void)
+{
+	struct net_stats st;
+	get_net_stats(&st);
+	fprintf(out, "bench=net sends=%llu writes=%llu sends_write=%.2f\n",
+		(unsigned long long)st.sends, (unsigned long long)st.writes,
+		st.writes ? (double)st.sends / st.writes : 0.0);
+}
+
+/**
+ * @brief Show program usage.
+ *
+ * @param prgname Program name.
+ */
+static void usage(const char *prgname)
+{
+	fprintf(stderr, "Usage: %s [-t ms] [-h]\n", prgname);
+	fprintf(stderr,
+		"Options:\n"
+		"  -t <ms> Time per benchmark, default: 250\n"
+		"  -h This help\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "ht:")) != -1)
+	{
+		switch (c) {
+		case 't':
+			bench_time = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* Keep the bridge messages out of the results. */
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		errx("Unable to redirect stdout!\n");
+
+	bench_hex(16);
+	bench_hex(4096);
+	bench_read_int();
+
+	setup_bridge();
+
+	/* Warm the cache, so the 'm' below is answered from it. */
+	gdb_send("m7c00,100");
+	do
+	{
+		bridge_run();
+		target_reply();
+	} while (!gdb_drain());
+
+	bench_gdb_stream("gdb_g", "g");
+	bench_gdb_stream("gdb_m/256", "m7c00,100");
+	bench_gdb_stream("gdb_halt", "?");
+	bench_serial_stops();
+	bench_serial_memory();
+	print_net_stats();
+	return (0);
+}
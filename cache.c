@@ -0,0 +1,317 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "cache.h"
+#include "util.h"
+
+/*
+ * Target memory cache
+ *
+ * Every memory read requested by GDB costs a full round trip
+ * over the serial line, even if the very same bytes were read
+ * a few milliseconds ago. Since the target memory cannot change
+ * while the target is stopped (except by our own writes), all
+ * memory received from the serial device is kept here, in pages
+ * of CACHE_PAGE_SIZE bytes, until the target resumes execution.
+ *
+ * Pages are kept in a sparse two-level table, indexed by the
+ * physical address, and each byte has its own 'valid' bit, so
+ * partial pages can be cached too.
+ *
+ * Pages also remember if any of their bytes came from our
+ * own writes, instead of the target.
+ *
+ * The invalidation is done in O(1) by increasing the cache
+ * generation: pages with an older generation are considered
+ * empty and are reused as soon as they are filled again.
+ */
+
+/* Two-level table sizes. */
+#define CACHE_L1_SHIFT 20
+#define CACHE_L1_SIZE  (1 << (32 - CACHE_L1_SHIFT))
+#define CACHE_L2_SIZE  (1 << (CACHE_L1_SHIFT - CACHE_PAGE_SHIFT))
+
+/* Cache page. */
+struct cache_page
+{
+	uint32_t gen;
+	int      written;
+	uint8_t  valid[CACHE_PAGE_SIZE / 8];
+	uint8_t  data[CACHE_PAGE_SIZE];
+};
+
+static struct cache_page **cache_dir[CACHE_L1_SIZE];
+static uint32_t cache_gen = 1;
+
+/**
+ * @brief Get the cache page for the given address @p addr.
+ *
+ * @param addr Physical address.
+ * @param create If 1, allocates (or resets) the page if
+ *               it does not exist or is outdated.
+ *
+ * @return Returns the page, or NULL if not exist/outdated
+ * and @p create is 0.
+ */
+static struct cache_page *get_page(uint32_t addr, int create)
+{
+	struct cache_page **l2, *page;
+	uint32_t l1_idx, l2_idx;
+
+	l1_idx = addr >> CACHE_L1_SHIFT;
+	l2_idx = (addr >> CACHE_PAGE_SHIFT) & (CACHE_L2_SIZE - 1);
+
+	l2 = cache_dir[l1_idx];
+	if (!l2)
+	{
+		if (!create)
+			return (NULL);
+
+		l2 = calloc(CACHE_L2_SIZE, sizeof(struct cache_page *));
+		if (!l2)
+			errx("Unable to allocate cache directory!\n");
+		cache_dir[l1_idx] = l2;
+	}
+
+	page = l2[l2_idx];
+	if (!page)
+	{
+		if (!create)
+			return (NULL);
+
+		page = malloc(sizeof(struct cache_page));
+		if (!page)
+			errx("Unable to allocate cache page!\n");
+		page->gen = 0;
+		l2[l2_idx] = page;
+	}
+
+	if (page->gen != cache_gen)
+	{
+		if (!create)
+			return (NULL);
+
+		memset(page->valid, 0, sizeof page->valid);
+		page->written = 0;
+		page->gen     = cache_gen;
+	}
+
+	return (page);
+}
+
+/**
+ * @brief Invalidates the whole cache.
+ *
+ * This should be called whenever the target memory
+ * might have changed without our knowledge, i.e:
+ * the target resumed its execution.
+ */
+void cache_invalidate(void) {
+	cache_gen++;
+}
+
+/**
+ * @brief Fill the cache with @p len bytes from @p data,
+ * starting at the physical address @p addr.
+ *
+ * @param addr Physical address.
+ * @param data Memory contents.
+ * @param len Data length.
+ */
+void cache_fill(uint32_t addr, const uint8_t *data, size_t len)
+{
+	struct cache_page *page;
+	uint32_t off;
+	size_t amnt;
+
+	while (len)
+	{
+		page = get_page(addr, 1);
+		off  = addr & CACHE_PAGE_MASK;
+		amnt = MIN(len, (size_t)(CACHE_PAGE_SIZE - off));
+
+		memcpy(page->data + off, data, amnt);
+		for (len -= amnt, data += amnt, addr += amnt; amnt; amnt--, off++)
+			page->valid[off >> 3] |= 1 << (off & 7);
+	}
+}
+
+/**
+ * @brief Like cache_fill(), but only fills the bytes
+ * that are not in the cache yet.
+ *
+ * This is useful for data that was requested before the
+ * cache was updated by other means, i.e: memory writes.
+ *
+ * @param addr Physical address.
+ * @param data Memory contents.
+ * @param len Data length.
+ */
+void cache_merge(uint32_t addr, const uint8_t *data, size_t len)
+{
+	struct cache_page *page;
+	uint32_t off;
+
+	for (; len; len--, data++, addr++)
+	{
+		page = get_page(addr, 1);
+		off  = addr & CACHE_PAGE_MASK;
+
+		if (page->valid[off >> 3] & (1 << (off & 7)))
+			continue;
+
+		page->data[off] = *data;
+		page->valid[off >> 3] |= 1 << (off & 7);
+	}
+}
+
+/**
+ * @brief Like cache_fill(), but for data written by us,
+ * that the target did not send, see cache_written().
+ *
+ * @param addr Physical address.
+ * @param data Data written.
+ * @param len Data length.
+ */
+void cache_fill_written(uint32_t addr, const uint8_t *data, size_t len)
+{
+	uint32_t end;
+
+	cache_fill(addr, data, len);
+	for (end = addr + len; addr < end;
+		addr = CACHE_PAGE_DOWN(addr) + CACHE_PAGE_SIZE)
+	{
+		get_page(addr, 0)->written = 1;
+	}
+}
+
+/**
+ * @brief Checks if any of the @p len bytes starting at
+ * @p addr might have come from our writes.
+ *
+ * @param addr Physical address.
+ * @param len Amount of bytes.
+ *
+ * @return Returns 1 if so, 0 otherwise.
+ */
+int cache_written(uint32_t addr, size_t len)
+{
+	struct cache_page *page;
+	uint32_t end;
+
+	for (end = addr + len; addr < end;
+		addr = CACHE_PAGE_DOWN(addr) + CACHE_PAGE_SIZE)
+	{
+		page = get_page(addr, 0);
+		if (page && page->written)
+			return (1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Drops the @p len bytes starting at the physical
+ * address @p addr from the cache, so that they are read
+ * again from the target.
+ *
+ * @param addr Physical address.
+ * @param len Amount of bytes.
+ */
+void cache_drop(uint32_t addr, size_t len)
+{
+	struct cache_page *page;
+	uint32_t off;
+
+	for (; len; len--, addr++)
+	{
+		page = get_page(addr, 0);
+		if (!page)
+			continue;
+
+		off = addr & CACHE_PAGE_MASK;
+		page->valid[off >> 3] &= ~(1 << (off & 7));
+	}
+}
+
+/**
+ * @brief Returns the amount of contiguous bytes, starting
+ * at @p addr and limited to @p len, that are in the cache.
+ *
+ * @param addr Physical address.
+ * @param len Maximum amount of bytes to be checked.
+ *
+ * @return Returns the amount of cached bytes.
+ */
+size_t cache_span(uint32_t addr, size_t len)
+{
+	struct cache_page *page;
+	uint32_t off;
+	size_t span;
+
+	for (span = 0; span < len; )
+	{
+		page = get_page(addr, 0);
+		if (!page)
+			break;
+
+		for (off = addr & CACHE_PAGE_MASK;
+			off < CACHE_PAGE_SIZE && span < len; off++, addr++, span++)
+		{
+			if (!(page->valid[off >> 3] & (1 << (off & 7))))
+				return (span);
+		}
+	}
+	return (span);
+}
+
+/**
+ * @brief Copy up to @p len cached bytes, starting at @p addr
+ * to @p out.
+ *
+ * The copy stops at the first non-cached byte.
+ *
+ * @param addr Physical address.
+ * @param out Output buffer.
+ * @param len Amount of bytes to be read.
+ *
+ * @return Returns the amount of bytes copied.
+ */
+size_t cache_read(uint32_t addr, uint8_t *out, size_t len)
+{
+	struct cache_page *page;
+	size_t span, amnt, off;
+
+	span = cache_span(addr, len);
+
+	for (len = span; len; len -= amnt, addr += amnt, out += amnt)
+	{
+		page = get_page(addr, 0);
+		off  = addr & CACHE_PAGE_MASK;
+		amnt = MIN(len, CACHE_PAGE_SIZE - off);
+		memcpy(out, page->data + off, amnt);
+	}
+	return (span);
+}
@@ -0,0 +1,52 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/* Cache page size, must be a power of 2. */
+	#define CACHE_PAGE_SHIFT 8
+	#define CACHE_PAGE_SIZE  (1 << CACHE_PAGE_SHIFT)
+	#define CACHE_PAGE_MASK  (CACHE_PAGE_SIZE - 1)
+
+	/* Round a given address down/up to a page boundary. */
+	#define CACHE_PAGE_DOWN(a) ((a) & ~((uint32_t)CACHE_PAGE_MASK))
+	#define CACHE_PAGE_UP(a)   CACHE_PAGE_DOWN((a) + CACHE_PAGE_MASK)
+
+	extern void cache_invalidate(void);
+	extern void cache_fill(uint32_t addr, const uint8_t *data,
+		size_t len);
+	extern void cache_merge(uint32_t addr, const uint8_t *data,
+		size_t len);
+	extern void cache_fill_written(uint32_t addr, const uint8_t *data,
+		size_t len);
+	extern int cache_written(uint32_t addr, size_t len);
+	extern void cache_drop(uint32_t addr, size_t len);
+	extern size_t cache_span(uint32_t addr, size_t len);
+	extern size_t cache_read(uint32_t addr, uint8_t *out, size_t len);
+
+#endif /* CACHE_H */
@@ -0,0 +1,572 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "capture.h"
+#include "util.h"
+
+/*
+ * Traffic capture
+ *
+ * Everything the bridge reads from and writes to the serial
+ * and GDB fds can be saved, with timestamps, to be looked at
+ * later or replayed (see replay_start()).
+ *
+ * The capture is a binary file, with a header:
+ *   "BREADCAP" <version-1-byte> <flags-1-byte> <baud-4-bytes-LE>
+ *
+ * flags bit 0 is set if the framed mode was enabled, and baud
+ * is the max serial speed negotiated (0 if none), so that a
+ * replay sends the same commands the capture had.
+ *
+ * Followed by one record per read(2)/write(2):
+ *   <type-1-byte> <delta-ns-varint> <len-varint> <data>
+ *
+ * where type is (channel << 1 | direction), delta-ns is the
+ * time elapsed since the previous record (or since the capture
+ * started) and the varints are LEB128, 7 bits per byte, least
+ * significant first.
+ */
+#define CAPTURE_MAGIC      "BREADCAP"
+#define CAPTURE_MAGIC_LEN  8
+#define CAPTURE_VERSION    1
+#define CAPTURE_FRAMED     1
+#define CAPTURE_HDR_LEN    (CAPTURE_MAGIC_LEN + 6)
+#define CAPTURE_BUFF_SIZE  0x10000
+
+static int      cap_fd = -1;
+static int      cap_fds[2] = {-1, -1};
+static uint64_t cap_last;
+static size_t   cap_len;
+static uint8_t  cap_buff[CAPTURE_BUFF_SIZE];
+
+/*
+ * Replay
+ *
+ * The bridge runs as usual, but in a child process, with its
+ * serial and GDB fds connected to this one, that sends to it
+ * everything captured as read by the bridge, and discards what
+ * the bridge writes.
+ *
+ * Before sending anything, it waits for the bridge to write at
+ * least as much as it had written before in the capture, so the
+ * replies do not arrive before the commands, even at the max
+ * speed. If that does not happen in REPLAY_STALL_MS, the replay
+ * goes on anyway, and the stall is reported at the end.
+ */
+#define REPLAY_STALL_MS 1000
+
+static struct replay
+{
+	int      fds[2];      /* Our side of the serial/GDB channels. */
+	uint64_t expected[2]; /* Bridge output, as in the capture.    */
+	uint64_t got[2];      /* Bridge output, as received.          */
+	uint64_t records;
+	uint64_t stalls;
+	uint64_t captured_ns; /* Capture duration.                    */
+	uint64_t elapsed_ns;  /* Replay duration.                     */
+} replay;
+
+/**
+ * @brief Gets the current monotonic time.
+ *
+ * @return Returns the time, in nanoseconds.
+ */
+static uint64_t capture_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* ------------------------------------------------------------------*
+ * Capture                                                           *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Writes everything buffered to the capture file.
+ */
+static void capture_flush(void)
+{
+	const uint8_t *p;
+	ssize_t ret;
+
+	for (p = cap_buff; cap_len; p += ret, cap_len -= ret)
+	{
+		ret = write(cap_fd, p, cap_len);
+		if (ret <= 0)
+		{
+			cap_len = 0;
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Buffers @p len bytes from @p buf to be written
+ * to the capture file.
+ *
+ * @param buf Data to be written.
+ * @param len Data length.
+ */
+static void capture_put(const void *buf, size_t len)
+{
+	const uint8_t *p;
+	size_t amnt;
+
+	for (p = buf; len; len -= amnt, p += amnt)
+	{
+		if (cap_len == CAPTURE_BUFF_SIZE)
+			capture_flush();
+
+		amnt = MIN(len, CAPTURE_BUFF_SIZE - cap_len);
+		memcpy(cap_buff + cap_len, p, amnt);
+		cap_len += amnt;
+	}
+}
+
+/**
+ * @brief Buffers @p v as a varint.
+ *
+ * @param v Value to be written.
+ */
+static void capture_put_varint(uint64_t v)
+{
+	uint8_t buf[10];
+	size_t len;
+
+	for (len = 0; v >= 0x80; v >>= 7)
+		buf[len++] = (v & 0x7F) | 0x80;
+
+	buf[len++] = v;
+	capture_put(buf, len);
+}
+
+/* Flush the capture while exiting. */
+static void capture_close(void) {
+	capture_flush();
+}
+
+/*
+ * Flush the capture if killed (like by Ctrl+C), and
+ * then die as usual.
+ */
+static void capture_signal(int sig)
+{
+	capture_flush();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/**
+ * @brief Starts capturing the serial and GDB traffic
+ * into @p path, see capture_set_fd().
+ *
+ * @param path Capture file path.
+ * @param cfg Bridge settings, saved in the header.
+ */
+void capture_open(const char *path, const struct capture_config *cfg)
+{
+	uint8_t hdr[CAPTURE_HDR_LEN];
+
+	cap_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cap_fd < 0)
+		errx("Unable to open capture file: %s (%s)\n", path,
+			strerror(errno));
+
+	memcpy(hdr, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+	hdr[8]  = CAPTURE_VERSION;
+	hdr[9]  = cfg->framed ? CAPTURE_FRAMED : 0;
+	hdr[10] = cfg->baud;
+	hdr[11] = cfg->baud >> 8;
+	hdr[12] = cfg->baud >> 16;
+	hdr[13] = cfg->baud >> 24;
+	capture_put(hdr, sizeof hdr);
+
+	cap_last = capture_now();
+	atexit(capture_close);
+	signal(SIGINT,  capture_signal);
+	signal(SIGTERM, capture_signal);
+}
+
+/**
+ * @brief Sets the fd of the serial or GDB @p channel, whose
+ * traffic is going to be captured.
+ *
+ * @param channel CAPTURE_SERIAL or CAPTURE_GDB.
+ * @param fd Channel fd.
+ */
+void capture_set_fd(int channel, int fd)
+{
+	cap_fds[channel] = fd;
+}
+
+/**
+ * @brief Saves @p len bytes, read from or written to @p fd,
+ * if @p fd is being captured.
+ *
+ * @param fd File descriptor.
+ * @param dir CAPTURE_IN if read, CAPTURE_OUT if written.
+ * @param buf Data.
+ * @param len Data length.
+ */
+void capture_data(int fd, int dir, const void *buf, size_t len)
+{
+	uint64_t now;
+	uint8_t type;
+
+	if (cap_fd < 0 || fd < 0 || !len)
+		return;
+
+	if (fd == cap_fds[CAPTURE_SERIAL])
+		type = CAPTURE_SERIAL << 1;
+	else if (fd == cap_fds[CAPTURE_GDB])
+		type = CAPTURE_GDB << 1;
+	else
+		return;
+
+	now      = capture_now();
+	type    |= dir;
+	capture_put(&type, 1);
+	capture_put_varint(now - cap_last);
+	capture_put_varint(len);
+	capture_put(buf, len);
+	cap_last = now;
+}
+
+/* ------------------------------------------------------------------*
+ * Replay                                                            *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Reads a varint from @p f.
+ *
+ * @param f Capture file.
+ * @param v Returned value.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int replay_get_varint(FILE *f, uint64_t *v)
+{
+	int shift, c;
+
+	*v = 0;
+	for (shift = 0; shift < 64; shift += 7)
+	{
+		if ((c = getc(f)) == EOF)
+			return (-1);
+
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return (0);
+	}
+	return (-1);
+}
+
+/**
+ * @brief Waits at most @p timeout_ms milliseconds for the
+ * bridge, discarding what it writes and, if @p ch is not
+ * -1, for channel @p ch to be writable.
+ *
+ * @param ch Channel to be written, or -1.
+ * @param timeout_ms Timeout, in milliseconds, -1 for none.
+ *
+ * @return Returns 1 if @p ch is writable, 0 otherwise.
+ */
+static int replay_poll(int ch, int timeout_ms)
+{
+	struct pollfd p[3];
+	char buf[4096];
+	ssize_t ret;
+	int i, n;
+
+	for (i = 0; i < 2; i++)
+	{
+		p[i].fd     = replay.fds[i];
+		p[i].events = POLLIN;
+	}
+
+	n = 2;
+	if (ch >= 0)
+	{
+		p[2].fd     = replay.fds[ch];
+		p[2].events = POLLOUT;
+		n = 3;
+	}
+
+	if (poll(p, n, timeout_ms) < 0)
+	{
+		if (errno == EINTR)
+			return (0);
+		errx("Replay: poll failed (%s)\n", strerror(errno));
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (!p[i].revents)
+			continue;
+
+		ret = read(replay.fds[i], buf, sizeof buf);
+		if (ret <= 0)
+			errx("Replay: bridge exited after %" PRIu64 " records!\n",
+				replay.records);
+
+		replay.got[i] += ret;
+	}
+	return (n == 3 && (p[2].revents & POLLOUT));
+}
+
+/**
+ * @brief Waits for the bridge to write everything it had
+ * written so far in the capture, for at most
+ * REPLAY_STALL_MS.
+ */
+static void replay_sync(void)
+{
+	uint64_t deadline, now;
+
+	deadline = capture_now() + REPLAY_STALL_MS * 1000000ULL;
+	while (replay.got[0] < replay.expected[0] ||
+		replay.got[1] < replay.expected[1])
+	{
+		now = capture_now();
+		if (now >= deadline)
+		{
+			replay.stalls++;
+			break;
+		}
+		replay_poll(-1, (deadline - now + 999999) / 1000000);
+	}
+}
+
+/**
+ * @brief Waits until @p deadline, meanwhile discarding
+ * what the bridge writes.
+ *
+ * @param deadline Monotonic time, in nanoseconds.
+ */
+static void replay_wait(uint64_t deadline)
+{
+	uint64_t now;
+	while ((now = capture_now()) < deadline)
+		replay_poll(-1, (deadline - now + 999999) / 1000000);
+}
+
+/**
+ * @brief Sends @p len bytes from @p buf to the bridge, on
+ * channel @p ch.
+ *
+ * @param ch Channel.
+ * @param buf Data.
+ * @param len Data length.
+ */
+static void replay_send(int ch, const uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len)
+	{
+		if (!replay_poll(ch, -1))
+			continue;
+
+		ret = send(replay.fds[ch], buf, len,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EINTR)
+				continue;
+			errx("Replay: bridge exited after %" PRIu64 " records!\n",
+				replay.records);
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/**
+ * @brief Sends everything read by the bridge in the capture
+ * @p f to the bridge again.
+ *
+ * @param f Capture file, after the header.
+ * @param max_speed 1 to not wait between the records, 0 to
+ *                  keep the original timing.
+ */
+static void replay_run(FILE *f, int max_speed)
+{
+	uint64_t start, t, delta, len;
+	uint8_t *buf;
+	size_t size;
+	int type, ch;
+
+	buf   = NULL;
+	size  = 0;
+	t     = 0;
+	start = capture_now();
+
+	while ((type = getc(f)) != EOF)
+	{
+		if (replay_get_varint(f, &delta) < 0 ||
+			replay_get_varint(f, &len) < 0)
+		{
+			errx("Replay: truncated capture!\n");
+		}
+
+		if (len > size)
+		{
+			size = len;
+			if (!(buf = realloc(buf, size)))
+				errx("Replay: out of memory!\n");
+		}
+		if (fread(buf, 1, len, f) != len)
+			errx("Replay: truncated capture!\n");
+
+		t  += delta;
+		ch  = (type >> 1) & 1;
+		replay.records++;
+
+		if ((type & 1) == CAPTURE_OUT)
+		{
+			replay.expected[ch] += len;
+			continue;
+		}
+
+		replay_sync();
+		if (!max_speed)
+			replay_wait(start + t);
+
+		replay_send(ch, buf, len);
+	}
+
+	replay_sync();
+	replay.elapsed_ns  = capture_now() - start;
+	replay.captured_ns = t;
+	free(buf);
+}
+
+/**
+ * @brief Reports how the replay went.
+ *
+ * @return Returns 0 if the bridge wrote the same amount of
+ * data as in the capture, without stalls, 1 otherwise.
+ */
+static int replay_report(void)
+{
+	printf("Replay: %" PRIu64 " records in %.3f s (captured: %.3f s), "
+		"%" PRIu64 " stalls\n"
+		"  serial out: %" PRIu64 " bytes (captured: %" PRIu64 ")\n"
+		"  gdb out:    %" PRIu64 " bytes (captured: %" PRIu64 ")\n",
+		replay.records, replay.elapsed_ns / 1e9,
+		replay.captured_ns / 1e9, replay.stalls,
+		replay.got[CAPTURE_SERIAL], replay.expected[CAPTURE_SERIAL],
+		replay.got[CAPTURE_GDB], replay.expected[CAPTURE_GDB]);
+
+	return (replay.stalls ||
+		replay.got[0] != replay.expected[0] ||
+		replay.got[1] != replay.expected[1]);
+}
+
+/**
+ * @brief Replays the capture @p path: the calling process
+ * forks, and only the child returns, to run the bridge with
+ * @p fds as its serial and GDB fds. The parent sends the
+ * captured data and exits when done.
+ *
+ * @param path Capture file path.
+ * @param max_speed 1 to not wait between the records, 0 to
+ *                  keep the original timing.
+ * @param cfg Returned bridge settings, as in the capture.
+ * @param fds Returned serial and GDB fds, for the bridge.
+ */
+void replay_start(const char *path, int max_speed,
+	struct capture_config *cfg, int fds[2])
+{
+	uint8_t hdr[CAPTURE_HDR_LEN];
+	int ser[2], gdb[2];
+	int status;
+	pid_t pid;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		errx("Unable to open capture file: %s (%s)\n", path,
+			strerror(errno));
+
+	if (fread(hdr, 1, sizeof hdr, f) != sizeof hdr ||
+		memcmp(hdr, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) ||
+		hdr[8] != CAPTURE_VERSION)
+	{
+		errx("Invalid capture file: %s\n", path);
+	}
+
+	cfg->framed = !!(hdr[9] & CAPTURE_FRAMED);
+	cfg->baud   = hdr[10] | hdr[11] << 8 | hdr[12] << 16 |
+		(uint32_t)hdr[13] << 24;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ser) < 0 ||
+		socketpair(AF_UNIX, SOCK_STREAM, 0, gdb) < 0)
+	{
+		errx("Unable to create socket pairs (%s)\n", strerror(errno));
+	}
+
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		errx("Unable to fork (%s)\n", strerror(errno));
+
+	/* Bridge. */
+	if (!pid)
+	{
+		fclose(f);
+		close(ser[1]);
+		close(gdb[1]);
+		fds[CAPTURE_SERIAL] = ser[0];
+		fds[CAPTURE_GDB]    = gdb[0];
+		return;
+	}
+
+	/* Replay. */
+	close(ser[0]);
+	close(gdb[0]);
+	replay.fds[CAPTURE_SERIAL] = ser[1];
+	replay.fds[CAPTURE_GDB]    = gdb[1];
+
+	replay_run(f, max_speed);
+	fclose(f);
+
+	/* The bridge exits as soon as its fds are closed. */
+	close(ser[1]);
+	close(gdb[1]);
+	waitpid(pid, &status, 0);
+	exit(replay_report() ? EXIT_FAILURE : EXIT_SUCCESS);
+}
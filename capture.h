@@ -0,0 +1,54 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/* Channels. */
+	#define CAPTURE_SERIAL 0
+	#define CAPTURE_GDB    1
+
+	/* Directions, as seen by the bridge. */
+	#define CAPTURE_IN  0
+	#define CAPTURE_OUT 1
+
+	/* Bridge settings that change what goes through the serial. */
+	struct capture_config
+	{
+		int baud;   /* Max serial speed negotiated, 0 if none. */
+		int framed; /* Framed mode wanted.                     */
+	};
+
+	extern void capture_open(const char *path,
+		const struct capture_config *cfg);
+	extern void capture_set_fd(int channel, int fd);
+	extern void capture_data(int fd, int dir, const void *buf,
+		size_t len);
+	extern void replay_start(const char *path, int max_speed,
+		struct capture_config *cfg, int fds[2]);
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,277 @@
+#!/usr/bin/env python
+
+# MIT License
+#
+# Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+#
+# End-to-end checks: runs the bridge against the mock target
+# (see mock_target.c) and talks to it as GDB would, one
+# fresh session per check.
+#
+# Usage: make check
+#
+
+import os
+import pty
+import random
+import select
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+TIMEOUT = 5
+
+class Session:
+	"""Bridge + mock target, with GDB connected in no-ack mode."""
+
+	def __init__(self, bridge_args=[], mock_args=[]):
+		port = random.randint(20000, 40000)
+		self.out, slave = pty.openpty()
+		self.trace_path = tempfile.mktemp(suffix=".txt")
+		self.mock = None
+		self.sock = None
+		self.buff = b""
+
+		# The pty keeps the bridge output line buffered.
+		self.bridge = subprocess.Popen(["./bridge", "-s", "-p", str(port),
+			"-g", str(port + 1), "-t", self.trace_path] + bridge_args,
+			stdout=slave,
+			stderr=subprocess.STDOUT)
+		os.close(slave)
+
+		try:
+			self.wait_output(b"conect your serial")
+			self.mock = subprocess.Popen(["./mock_target", "-p", str(port)]
+				+ mock_args, stdout=subprocess.DEVNULL)
+			self.wait_output(b"you can now connect GDB")
+
+			self.sock = socket.create_connection(("127.0.0.1", port + 1))
+			self.sock.settimeout(TIMEOUT)
+			self.pkt("QStartNoAckMode", ack=True)
+		except Exception:
+			self.close()
+			raise
+
+	def wait_output(self, text):
+		data = b""
+		while text not in data:
+			if not select.select([self.out], [], [], TIMEOUT)[0]:
+				raise Exception("bridge did not say: " + text.decode())
+			data += os.read(self.out, 4096)
+
+	def pkt(self, data, ack=False):
+		"""Sends a packet and returns its reply."""
+		csum = sum(data.encode("latin1")) & 0xFF
+		self.sock.sendall(("$%s#%02x" % (data, csum)).encode("latin1"))
+		return self.reply(ack)
+
+	def reply(self, ack=False):
+		"""Returns the next packet from the bridge."""
+		while True:
+			self.buff = self.buff.lstrip(b"+")
+			end = self.buff.find(b"#")
+			if self.buff[:1] == b"$" and end > 0 and \
+				len(self.buff) >= end + 3:
+				reply = self.buff[1:end].decode("latin1")
+				self.buff = self.buff[end + 3:]
+				if ack:
+					self.sock.sendall(b"+")
+				return reply
+			chunk = self.sock.recv(65536)
+			if not chunk:
+				raise Exception("bridge closed the connection")
+			self.buff += chunk
+
+	def close(self):
+		if self.sock:
+			self.sock.close()
+		for p in (self.bridge, self.mock):
+			if p:
+				p.kill()
+				p.wait()
+		os.close(self.out)
+		if os.path.exists(self.trace_path):
+			os.remove(self.trace_path)
+
+def expect(what, got, wanted):
+	if got != wanted:
+		raise Exception("%s: got '%s', expected '%s'" % (what, got, wanted))
+
+# ------------------------------------------------------------------
+# Checks
+# ------------------------------------------------------------------
+
+def check_read_zero(s):
+	"""A zero-length read is an error, not an empty reply."""
+	expect("m7c00,0", s.pkt("m7c00,0"), "E00")
+	expect("m7c00,4", s.pkt("m7c00,4"), "90909090")
+
+def check_read_range(s):
+	"""Reads outside the addressable memory are errors."""
+	expect("mfffffffe,4", s.pkt("mfffffffe,4"), "E01")
+	expect("m10fff0,20", s.pkt("m10fff0,20"), "E01")
+	expect("m7c00,4", s.pkt("m7c00,4"), "90909090")
+
+def check_rom_write(s):
+	"""Writes to ROM are not cached, writes to RAM are."""
+	rom = s.pkt("mf0000,4")
+	expect("M rom", s.pkt("Mf0000,4:11223344"), "OK")
+	expect("m rom", s.pkt("mf0000,4"), rom)
+	expect("M ram", s.pkt("M7c00,4:11223344"), "OK")
+	expect("m ram", s.pkt("m7c00,4"), "11223344")
+
+def monitor(s, cmd):
+	return s.pkt("qRcmd," + cmd.encode().hex())
+
+def monitor_output(s, cmd):
+	"""Runs a monitor command, returns its console output and reply."""
+	out = ""
+	reply = monitor(s, cmd)
+	while reply[:1] == "O" and reply != "OK":
+		out += bytes.fromhex(reply[1:]).decode()
+		reply = s.reply()
+	return out, reply
+
+def check_crc_after_write(s):
+	"""qCRC checks what the target stored, not what we wrote."""
+	rom = bytes.fromhex(s.pkt("mf0000,4"))
+	expect("M rom", s.pkt("Mf0000,4:11223344"), "OK")
+	expect("qCRC rom", s.pkt("qCRC:f0000,4"), "C%08x" % crc32(rom))
+	expect("M ram", s.pkt("M7c00,4:11223344"), "OK")
+	expect("qCRC ram", s.pkt("qCRC:7c00,4"),
+		"C%08x" % crc32(bytes.fromhex("11223344")))
+
+def check_trace_first(s):
+	"""The trace starts at the instruction we were stopped at."""
+	expect("trace on", monitor(s, "trace on 90000 8"), "OK")
+	for i in range(3):
+		s.pkt("s")
+	expect("trace off", monitor(s, "trace off"), "OK")
+	with open(s.trace_path) as f:
+		trace = f.read().split()
+	expect("trace", trace, ["0000:7c00", "0000:7c01", "0000:7c02",
+		"0000:7c03"])
+
+def crc32(data):
+	"""CRC32 as in GDB's qCRC."""
+	crc = 0xFFFFFFFF
+	for b in data:
+		crc ^= b << 24
+		for i in range(8):
+			crc = (crc << 1) ^ (0x04C11DB7 if crc & 0x80000000 else 0)
+			crc &= 0xFFFFFFFF
+	return crc
+
+def cond_x(code):
+	return "X%x,%s" % (len(code), bytes(code).hex())
+
+# Never true: just a 0.
+COND_FALSE = cond_x([0x22, 0, 0x27])
+
+def check_sw_bp_crc_search(s):
+	"""qCRC and qSearch do not see our int3s, which stay in place."""
+	expect("Z0", s.pkt("Z0,7c30,1"), "OK")
+	crc = s.pkt("qCRC:7c20,20")
+	search = s.pkt("qSearch:memory:7c2e;10;\x90\x90\x90\x90")
+	int3 = s.pkt("qSearch:memory:7c20;20;\xcc")
+	mem = bytes.fromhex(s.pkt("m7c20,20"))
+	expect("m", mem, b"\x90" * 0x20)
+	expect("qCRC", crc, "C%08x" % crc32(mem))
+	expect("qSearch", search, "1,7c2e")
+	expect("qSearch int3", int3, "0")
+	expect("c", s.pkt("c")[:15], "T0508:307c0000;")
+
+def check_long_search(s):
+	"""Patterns longer than the target supports are searched here."""
+	pat = "".join(chr(0x41 + i) for i in range(40))
+	expect("M", s.pkt("M8100,28:" + pat.encode().hex()), "OK")
+	expect("qSearch", s.pkt("qSearch:memory:8000;400;" + pat), "1,8100")
+	expect("qSearch none", s.pkt("qSearch:memory:8101;400;" + pat), "0")
+
+def check_bp_switch(s):
+	"""Adding or removing conditions switches between int3 and DR0."""
+	# int3 -> conditional: only the other breakpoint stops.
+	expect("Z0", s.pkt("Z0,7c10,1"), "OK")
+	expect("Z0 cond", s.pkt("Z0,7c10,1;" + COND_FALSE), "OK")
+	expect("Z0 7c20", s.pkt("Z0,7c20,1"), "OK")
+	expect("c", s.pkt("c")[:15], "T0508:207c0000;")
+	expect("qCRC", s.pkt("qCRC:7c10,1"), "C%08x" % crc32(b"\x90"))
+
+	# Conditional -> int3: stops, and DR0 is free again.
+	expect("z0 7c20", s.pkt("z0,7c20,1"), "OK")
+	expect("Z0", s.pkt("Z0,7c10,1"), "OK")
+	expect("c", s.pkt("c")[:15], "T0508:107c0000;")
+	for i in range(4):
+		expect("Z1 %d" % i, s.pkt("Z1,%x,1" % (0x7c31 + i)), "OK")
+
+def check_stats(s):
+	"""The percentiles never go above the max."""
+	for i in range(50):
+		s.pkt("m%x,40" % (0x7c00 + i * 0x40))
+	out, reply = monitor_output(s, "stats")
+	expect("stats", reply, "OK")
+	line = [l for l in out.splitlines() if l.startswith("m ")][0].split()
+	count, avg, p50, p99, mx = [int(x) for x in line[1:6]]
+	expect("m count", count, 50)
+	if p50 > mx or p99 > mx:
+		raise Exception("p50 %d, p99 %d above max %d" % (p50, p99, mx))
+
+def check_framed_read(s):
+	"""Pipelined reads are not held up by frames waiting for a resend."""
+	start = time.time()
+	mem = s.pkt("m20000,8000")
+	took = time.time() - start
+	expect("m len", len(mem), 0x8000 * 2)
+	if took > 1:
+		raise Exception("m took %.2f s" % took)
+check_framed_read.bridge_args = ["-f"]
+
+checks = [
+	check_read_zero,
+	check_read_range,
+	check_rom_write,
+	check_crc_after_write,
+	check_trace_first,
+	check_sw_bp_crc_search,
+	check_long_search,
+	check_bp_switch,
+	check_stats,
+	check_framed_read,
+]
+
+failed = 0
+for check in checks:
+	s = None
+	try:
+		s = Session(getattr(check, "bridge_args", []))
+		check(s)
+		print("PASS %s" % check.__name__)
+	except Exception as e:
+		print("FAIL %s: %s" % (check.__name__, e))
+		failed += 1
+	finally:
+		if s:
+			s.close()
+
+sys.exit(1 if failed else 0)
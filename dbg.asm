@@ -85,6 +85,10 @@ _start:
 	mov word [bx+(1*4)+0], handler_int1
 	mov word [bx+(1*4)+2], cs
 
+	; Set int3 handler
+	mov word [bx+(3*4)+0], handler_int3
+	mov word [bx+(3*4)+2], cs
+
 %ifndef UART_POLLING
 	; Serial/COM1 handler
 	mov word [bx+(36*4)+0], handler_int4_com1
@@ -204,10 +208,128 @@ handler_int1:
 	jne exit_int1_iret
 %endif
 
+	; Stepped over a breakpoint whose condition was false:
+	; enable it again and, if continuing, keep going
+	cmp byte [cs:cond_skip], 1
+	jne .no_cond_skip
+	mov byte [cs:cond_skip], 0
+
+	push bp
+	push eax
+	mov  bp, sp ; FLAGS at bp+10
+
+	mov  eax, DR7
+	or   eax, DR7_L0
+	mov  DR7, eax
+
+	; Watchpoint hit on the way?
+	mov  eax, DR6
+	test al, 0x0F
+	jnz  .cond_skip_done
+
+	cmp  byte [cs:cond_tf], 1
+	je   .cond_skip_done
+
+	and  word [ss:bp+10], ~EFLAGS_TF
+	pop  eax
+	pop  bp
+	iret
+
+.cond_skip_done:
+	pop eax
+	pop bp
+
+.no_cond_skip:
+	; Tracing and range stepping: keep going, without
+	; bothering the bridge, while we are inside the range
+	cmp byte [cs:trace_on], 0
+	jne .fast_path
+	cmp byte [cs:range_stepping], 1
+	jne .stop
+
+.fast_path:
+	push bp
+	push eax
+	push edx
+	mov  bp, sp ; IP at bp+10, CS at bp+12
+
+	; Insn breakpoint hit? (the single-step that got
+	; us here already traced it)
+	mov  eax, DR6
+	and  al, byte [cs:hw_bp_used]
+	test byte [cs:hw_bp_exec], al
+	jnz  .range_stop
+
+	cmp  byte [cs:trace_on], 0
+	je   .range_watch
+	call trace_record
+
+.range_watch:
+	; Watchpoint hit?
+	test al, 0x0F
+	jnz  .range_stop
+
+	; Tracing a single-step?
+	cmp byte [cs:range_stepping], 1
+	jne .range_stop
+
+%ifdef UART_POLLING
+	; Ctrl-C? (there is nothing else the bridge could
+	; send us now, so the byte is consumed here)
+	inputb UART_LSR
+	test al, 1
+	jz   .range_no_input
+	inputb UART_RB
+	cmp  al, MSG_CTRLC
+	jne  .range_no_input
+	mov  byte [cs:range_stepping], 0
+	jmp  .range_stop
+.range_no_input:
+%endif
+
+	; Current physical address
+	movzx eax, word [ss:bp+12]
+	shl   eax, 4
+	movzx edx, word [ss:bp+10]
+	add   eax, edx
+
+	; Our insn breakpoints are disabled if we started
+	; on them, so check them by hand
+	call hw_bp_match
+	test dl, dl
+	jnz  .range_stop
+
+	cmp eax, dword [cs:step_start]
+	jb  .range_stop
+	cmp eax, dword [cs:step_end]
+	jae .range_stop
+
+	; Still inside, step again
+	pop edx
+	pop eax
+	pop bp
+	iret
+
+.range_stop:
+	pop edx
+	pop eax
+	pop bp
+
+.stop:
 	; Save everyone
 	push_regs
 
+	; Breakpoint whose condition is false?
+	call cond_check
+	jc   exit_int1
+
 handler_int1_send:
+	; Not range stepping anymore
+	mov byte [cs:range_stepping], 0
+
+	; Send what we have traced so far, if any
+	call trace_drain
+
 	; Send all regs and stop reason to our bridge
 	call send_stop_msg
 
@@ -246,6 +368,9 @@ handler_int1_send:
 	; Disable breakpoints
 	call disable_hw_breakpoints
 
+	; Framed mode: make sure everything was sent
+	call frame_flush
+
 %ifndef UART_POLLING
 	; Disable TF because we shouldn't trigger a SS-trap
 	; for hlt or jmp
@@ -255,6 +380,11 @@ handler_int1_send:
 
 %ifdef UART_POLLING
 	jmp read_uart
+%else
+	; Framed mode: handle whatever arrived while sending,
+	; nothing would interrupt us for it
+	cmp byte [cs:framed], 0
+	jne read_uart
 %endif
 
 exit_int1:
@@ -262,6 +392,25 @@ exit_int1:
 exit_int1_iret:
 	iret
 
+;
+; INT3 handler
+;
+; Our software breakpoints: IP points to the byte after
+; the int3, so step it back to the breakpoint address
+; and stop as int1 does.
+;
+; Stack order:
+;  Same as int1
+;
+handler_int3:
+	push bp
+	mov  bp, sp
+	dec  word [ss:bp+2] ; IP
+	pop  bp
+
+	push_regs
+	jmp handler_int1_send
+
 ;
 ; Serial/COM1 handler & main state machine
 ;
@@ -279,15 +428,34 @@ handler_int4_com1:
 
 	; Read a single byte from UART to al
 read_uart:
+	; Framed mode: the bytes of the last frame come
+	; first, and what we have to send goes before
+	; waiting for more
+	cmp  byte [cs:framed], 0
+	je   .raw
+	call frame_next_byte
+	jnc  .got_byte
+	call frame_flush
+
+.raw:
 	inputb UART_LSR ; Check if there is input available
 	bt  ax, 0
 %ifdef UART_POLLING
-	jnc read_uart
+	jc   .input
+	call frame_rx_silence
+	jmp  read_uart
+.input:
 %else
 	jnc exit_int4
 %endif
 
 	inputb UART_RB
+	cmp  byte [cs:framed], 0
+	je   .got_byte
+	call frame_rx_byte
+	jc   read_uart
+
+.got_byte:
 	mov byte [cs:byte_read], al
 
 	; Check state and acts accordingly
@@ -327,6 +495,45 @@ read_uart:
 	cmp al, MSG_REM_HW_WATCH  ; Remove a hw watchpoint
 	je .state_start_rem_hw_watch
 
+	cmp al, MSG_HELLO         ; Capabilities negotiation
+	je .state_start_hello
+
+	cmp al, MSG_READ_MEM_RLE  ; Read memory (compressed)
+	je .state_start_read_memory_rle
+
+	cmp al, MSG_WRITE_MEM_RLE ; Write memory (compressed)
+	je .state_start_write_memory_rle
+
+	cmp al, MSG_SEARCH_MEM    ; Search memory
+	je .state_start_search_memory
+
+	cmp al, MSG_CRC32         ; CRC32 of memory
+	je .state_start_crc32
+
+	cmp al, MSG_RANGE_STEP    ; Range step
+	je .state_start_range_step
+
+	cmp al, MSG_TRACE         ; Enable/disable trace
+	je .state_start_trace
+
+	cmp al, MSG_COND          ; Breakpoint condition
+	je .state_start_cond
+
+	cmp al, MSG_SW_BP         ; Swap byte (int3 breakpoints)
+	je .state_start_sw_bp
+
+	cmp al, MSG_ADD_HW_BP     ; Add hw breakpoint (DRn)
+	je .state_start_add_hw_bp
+
+	cmp al, MSG_REM_HW_BP     ; Remove hw breakpoint (DRn)
+	je .state_start_rem_hw_bp
+
+	cmp al, MSG_BAUD          ; Serial speed negotiation
+	je .state_start_baud
+
+	cmp al, MSG_FRAMED        ; Enable framed mode
+	je .state_start_framed
+
 	jmp read_uart             ; Unrecognized byte
 
 	; Already inside a state, check which one
@@ -350,6 +557,54 @@ read_uart:
 	cmp byte [cs:state], STATE_HW_WATCH
 	je .state_add_hw_watch_params
 
+	cmp byte [cs:state], STATE_HELLO
+	je .state_hello_params
+
+	cmp byte [cs:state], STATE_READ_MEM_RLE
+	je .state_read_memory_rle_params
+
+	cmp byte [cs:state], STATE_WRITE_MEM_RLE_PAR
+	je .state_write_memory_rle_params
+
+	cmp byte [cs:state], STATE_WRITE_MEM_RLE
+	je .state_write_memory_rle_ctrl
+
+	cmp byte [cs:state], STATE_WRITE_MEM_RLE_LIT
+	je .state_write_memory_rle_lit
+
+	cmp byte [cs:state], STATE_WRITE_MEM_RLE_RUN
+	je .state_write_memory_rle_run
+
+	cmp byte [cs:state], STATE_SEARCH_MEM
+	je .state_search_memory_params
+
+	cmp byte [cs:state], STATE_CRC32
+	je .state_crc32_params
+
+	cmp byte [cs:state], STATE_RANGE_STEP
+	je .state_range_step_params
+
+	cmp byte [cs:state], STATE_TRACE
+	je .state_trace_params
+
+	cmp byte [cs:state], STATE_COND_LEN
+	je .state_cond_len
+
+	cmp byte [cs:state], STATE_COND_CODE
+	je .state_cond_code
+
+	cmp byte [cs:state], STATE_SW_BP
+	je .state_sw_bp_params
+
+	cmp byte [cs:state], STATE_ADD_HW_BP
+	je .state_add_hw_bp_params
+
+	cmp byte [cs:state], STATE_REM_HW_BP
+	je .state_rem_hw_bp_params
+
+	cmp byte [cs:state], STATE_BAUD
+	je .state_baud_params
+
 	jmp read_uart
 
 	; ---------------------------------------------
@@ -379,11 +634,36 @@ read_uart:
 	mov si, bx
 
 	mov cx, word [cs:read_mem_size]
-	.mem_dump:
-		lodsb
-		mov bl, al
-		call uart_write_byte
-		loop .mem_dump
+	call uart_write_buf
+
+	; Reset our state
+	mov byte [cs:state], STATE_DEFAULT
+	jmp read_uart
+
+	; Define read (compressed) state
+	;
+	; Params: address (4-bytes LE) + size (2-bytes LE)
+	define_start_and_params_state \
+		read_memory_rle, STATE_READ_MEM_RLE, 6
+
+	;
+	; Read memory, RLE-compressed
+	;
+.state_read_memory_rle:
+	; Signal that we're dumping the memory
+	mov bl, MSG_READ_MEM_RLE
+	call uart_write_byte
+
+	; Convert to SEG:OFF
+	mov eax, dword [cs:read_mem_addr]
+	call phys_to_seg
+
+	; Set our seg:off accordingly
+	mov ds, ax
+	mov si, bx
+
+	mov cx, word [cs:read_mem_size]
+	call uart_write_rle
 
 	; Reset our state
 	mov byte [cs:state], STATE_DEFAULT
@@ -416,6 +696,7 @@ read_uart:
 	cmp byte [cs:byte_counter], 6
 	jne .exit
 	mov byte [cs:state], STATE_WRITE_MEM
+	uart_rx_trigger UART_FCR_TRIG_14
 	jmp read_uart
 
 	.exit:
@@ -425,32 +706,190 @@ read_uart:
 	; Write memory
 	;
 .state_write_memory:
-	mov eax, dword [cs:read_mem_addr]
-	call phys_to_seg
+	; Write and check
+	call mem_write_byte
+	jz .end
 
-	; SEG:OFF
-	mov ds, ax
-	mov si, bx
+	; Take the next bytes right here while they keep
+	; coming
+	call uart_read_timeout
+	jnc  .state_write_memory
+	jmp  read_uart
 
-	; Write
-	mov al, byte [cs:byte_read]
-	mov byte [ds:si], al
+.end:
+	; Reset state
+	mov byte [cs:state], STATE_DEFAULT
+	uart_rx_trigger UART_FCR_TRIG_1
 
-	; Increment phys address
-	inc dword [cs:read_mem_addr]
+	; Send an 'OK'
+	mov bl, MSG_OK
+	call uart_write_byte
+	jmp read_uart
+
+	; Define write (compressed) state
+	;
+	; Params: address (4-bytes LE) + size (2-bytes LE),
+	; where size is the uncompressed size
+	define_start_and_params_state \
+		write_memory_rle, STATE_WRITE_MEM_RLE_PAR, 6
+
+.state_write_memory_rle:
+	mov byte [cs:state], STATE_WRITE_MEM_RLE
+	uart_rx_trigger UART_FCR_TRIG_14
+	jmp read_uart
+
+	;
+	; Control byte: decides between literal bytes or
+	; a repeated byte
+	;
+.state_write_memory_rle_ctrl:
+	cmp al, RLE_MAX_LIT
+	jae .rle_ctrl_run
+	inc al
+	mov byte [cs:rle_count], al
+	mov byte [cs:state], STATE_WRITE_MEM_RLE_LIT
+	jmp read_uart
+.rle_ctrl_run:
+	sub al, 0x80 - RLE_MIN_RUN
+	mov byte [cs:rle_count], al
+	mov byte [cs:state], STATE_WRITE_MEM_RLE_RUN
+	jmp read_uart
+
+	;
+	; Literal bytes: write as they come
+	;
+.state_write_memory_rle_lit:
+	call mem_write_byte
+	jz .end
+	dec byte [cs:rle_count]
+	jnz read_uart
+	mov byte [cs:state], STATE_WRITE_MEM_RLE
+	jmp read_uart
 
-	; Decrement and check
-	dec word [cs:read_mem_size]
+	;
+	; Repeated byte: write it rle_count times
+	;
+.state_write_memory_rle_run:
+	call mem_write_byte
 	jz .end
+	dec byte [cs:rle_count]
+	jz .rle_run_end
+	mov al, byte [cs:byte_read]
+	jmp .state_write_memory_rle_run
+.rle_run_end:
+	mov byte [cs:state], STATE_WRITE_MEM_RLE
 	jmp read_uart
 
-.end:
+	; ---------------------------------------------
+	; Search memory operations
+	; ---------------------------------------------
+
+	;
+	; Start of state
+	;
+.state_start_search_memory:
+	mov byte [cs:byte_counter], 0
+	mov byte [cs:state], STATE_SEARCH_MEM
+	jmp read_uart
+
+	;
+	; Obtain search parameters:
+	;   address        (4-bytes LE)
+	;   length         (4-bytes LE)
+	;   pattern length (1-byte, up to SEARCH_MAX_PAT)
+	;   pattern
+	;
+.state_search_memory_params:
+	movzx bx, byte [cs:byte_counter]
+	mov   byte [cs:range_params+bx], al
+	inc   bx
+	mov   byte [cs:byte_counter], bl
+
+	; Check if we read everything
+	cmp   bx, 9
+	jbe   read_uart
+	movzx ax, byte [cs:search_pat_len]
+	add   ax, 9
+	cmp   bx, ax
+	jne   read_uart
+
+	;
+	; Search memory
+	;
+.state_search_memory:
+%ifndef UART_POLLING
+	; Our stop loop should not be part of the search
+	mov ds, word [cs:saved_cs]
+	mov si, word [cs:saved_eip]
+	mov eax, dword [cs:saved_insn]
+	mov dword [ds:si], eax
+%endif
+
+	call mem_search
+
+%ifndef UART_POLLING
+	; Put it back (does not change the flags)
+	mov ds, word [cs:saved_cs]
+	mov si, word [cs:saved_eip]
+	mov dword [ds:si], STOP_OPC
+%endif
+
+	; Found (1) or not (0)
+	mov ebx, eax
+	mov cl,  1
+	jnc .search_reply
+	xor cl,  cl
+.search_reply:
+	push ebx
+	mov  bl, MSG_SEARCH_MEM
+	call uart_write_byte
+	mov  bl, cl
+	call uart_write_byte
+	pop  ebx
+	call uart_write_dword
+
 	; Reset state
 	mov byte [cs:state], STATE_DEFAULT
+	jmp read_uart
 
-	; Send an 'OK'
-	mov bl, MSG_OK
+	; ---------------------------------------------
+	; CRC32 operations
+	; ---------------------------------------------
+
+	; Define CRC32 state
+	;
+	; Params: address (4-bytes LE) + length (4-bytes LE)
+	define_start_and_params_state \
+		crc32, STATE_CRC32, 8, range_params
+
+	;
+	; Calculates the CRC32 of the memory range
+	;
+.state_crc32:
+%ifndef UART_POLLING
+	; Our stop loop should not be part of the CRC
+	mov ds, word [cs:saved_cs]
+	mov si, word [cs:saved_eip]
+	mov eax, dword [cs:saved_insn]
+	mov dword [ds:si], eax
+%endif
+
+	call mem_crc32
+
+%ifndef UART_POLLING
+	mov ds, word [cs:saved_cs]
+	mov si, word [cs:saved_eip]
+	mov dword [ds:si], STOP_OPC
+%endif
+
+	mov  ecx, eax
+	mov  bl, MSG_CRC32
 	call uart_write_byte
+	mov  ebx, ecx
+	call uart_write_dword
+
+	; Reset state
+	mov byte [cs:state], STATE_DEFAULT
 	jmp read_uart
 
 
@@ -488,6 +927,16 @@ read_uart:
 .check_continue:
 	mov bp, sp
 
+	; First insn since the trace was enabled: the int1
+	; handler only records the ones after it
+	cmp  byte [cs:trace_first], 0
+	je   .traced
+	mov  byte [cs:trace_first], 0
+	add  bp, EIP_OFF - 10
+	call trace_record
+	mov  bp, sp
+.traced:
+
 	; Set TF as it might be disabled from a previous
 	; continue
 	or word [ss:bp+EFLAGS_OFF], EFLAGS_TF
@@ -497,6 +946,16 @@ read_uart:
 	cmp byte [cs:byte_read], MSG_CONTINUE
 	jne .not_continue
 
+	; While tracing, a continue is a range step over
+	; the whole memory
+	cmp byte [cs:trace_on], 0
+	je  .continue_no_trace
+	mov dword [cs:step_start], 0
+	mov dword [cs:step_end],   0xFFFFFFFF
+	mov byte  [cs:range_stepping], 1
+	jmp .not_continue
+
+.continue_no_trace:
 	; Clear the 'TF' flag of our EFLAGS, and
 	; everything should be fine
 	and word [ss:bp+EFLAGS_OFF], ~EFLAGS_TF
@@ -510,41 +969,56 @@ read_uart:
 	jmp exit_int4
 
 	; ---------------------------------------------
-	; Ctrl-C/break
+	; Range step
 	; ---------------------------------------------
 
+	; Define range step state
 	;
-	; Start of state
+	; Params: start (4-bytes LE) + end (4-bytes LE)
+	define_start_and_params_state \
+		range_step, STATE_RANGE_STEP, 8, step_range
+
 	;
-.state_start_ctrlc:
-	jmp handler_int1_send ; Jump to our int1 handler as if
-	                      ; we're dealing with a single-step
+	; Single-step, but only stops (in our int1 handler)
+	; when leaving the range
+	;
+.state_range_step:
+	mov byte [cs:range_stepping], 1
+
+	; The last byte read is a parameter, make sure it
+	; is not mistaken by a continue
+	mov byte [cs:byte_read], MSG_SINGLE_STEP
+	jmp .state_start_single_step
 
 	; ---------------------------------------------
-	; Add 'software' breakpoint
+	; Instruction trace
 	; ---------------------------------------------
 
-	; Note: Although this is expected to be a sw breakpoint,
-	; the breakpoints used here are hardware breakpoints
-	; instead. This was chosen because there would be some
-	; complications with int3 and the interrupt-based approach,
-	; since this approach overwrites the memory too.
-	;
-	; In order to make things easier, I opted to use hw
-	; breakpoints =)
-
-	; Define sw breakpoint state
+	; Define trace state
 	;
-	; Params: phys address to break (4-bytes LE)
+	; Params: buffer address (4-bytes LE) + buffer size
+	; (2-bytes LE) + flags (1-byte)
 	define_start_and_params_state \
-		add_sw_breakpoint, STATE_SW_BREAKPOINT, 4
+		trace, STATE_TRACE, 7, trace_params
 
 	;
-	; Software breapoint
+	; Enable (or disable) the trace, sending what was
+	; left from the previous one
 	;
-.state_add_sw_breakpoint:
-	mov eax, dword [cs:read_mem_addr]
-	mov DR0, eax
+.state_trace:
+	call trace_drain
+
+	mov  eax, dword [cs:trace_addr]
+	call phys_to_seg
+	mov  word [cs:trace_seg],   ax
+	mov  word [cs:trace_start], bx
+	mov  word [cs:trace_pos],   bx
+	add  bx, word [cs:trace_size]
+	mov  word [cs:trace_end],   bx
+
+	mov  al, byte [cs:trace_flags]
+	mov  byte [cs:trace_on], al
+	mov  byte [cs:trace_first], al
 
 	; Reset state
 	mov byte [cs:state], STATE_DEFAULT
@@ -555,19 +1029,41 @@ read_uart:
 	jmp read_uart
 
 	; ---------------------------------------------
-	; Remove 'software' breakpoint
+	; Breakpoint condition
 	; ---------------------------------------------
 
 	;
 	; Start of state
 	;
-.state_start_rem_sw_break:
-	; Since we only support 1 instruction breakpoint
-	; we only remove that...
-	xor eax, eax
-	mov DR0, eax
-	call disable_hw_breakpoints
+.state_start_cond:
+	mov byte [cs:state], STATE_COND_LEN
+	jmp read_uart
+
+	;
+	; Condition length, 0 removes it
+	;
+.state_cond_len:
+	mov byte [cs:cond_len], al
+	mov byte [cs:byte_counter], 0
+	test al, al
+	jz   .state_cond_done
+	mov byte [cs:state], STATE_COND_CODE
+	jmp read_uart
+
+	;
+	; Condition bytecode
+	;
+.state_cond_code:
+	movzx bx, byte [cs:byte_counter]
+	mov   byte [cs:cond_code+bx], al
+	inc   byte [cs:byte_counter]
 
+	; Check if we read everything
+	mov al, byte [cs:byte_counter]
+	cmp al, byte [cs:cond_len]
+	jb  read_uart
+
+.state_cond_done:
 	; Reset state
 	mov byte [cs:state], STATE_DEFAULT
 
@@ -577,79 +1073,147 @@ read_uart:
 	jmp read_uart
 
 	; ---------------------------------------------
-	; Register write operations
+	; Software (int3) breakpoints
 	; ---------------------------------------------
 
-	; Define read state
+	; Define swap byte state
 	;
-	; Params: register number (1-byte LE) +
-	;         register value  (4-bytes LE)
+	; Params: phys address (4-bytes LE) + new byte (1-byte)
 	define_start_and_params_state \
-		reg_write, STATE_REG_WRITE_PARAMS, 5
+		sw_bp, STATE_SW_BP, 5, swbp_params
 
 	;
-	; Writes the read value to the appropriate
-	; register
+	; Writes the new byte (int3 or the original one) and
+	; replies with the old byte and what was read back,
+	; so the bridge knows if the memory is RAM or not
 	;
-.state_reg_write:
-	; Read the register number and get its stack
-	; offset
-	xor ax,  ax
-	mov al,  [cs:first_param_byte]   ; reg number
-	mov ebx, [cs:second_param_dword] ; reg value
-	mov bp,  sp
+.state_sw_bp:
+	mov cl,  byte  [cs:swbp_byte]
+	mov eax, dword [cs:swbp_addr]
 
-	cmp al, 8
-	jge .reg_is_16bit
-.reg_is_32bit:
-	shl al, 2
-	add bp, ax
-	mov dword [ss:bp], ebx
-	jmp .end_reg_write
-.reg_is_16bit:
-	sub al, 8  ; get zero-indexed
-	shl al, 1  ; get its offset
-	add al, 32 ; skip the first 8 32-bit regs
-	add bp, ax
-	mov word [ss:bp], bx
-.end_reg_write:
-	; Reset state
-	mov byte [cs:state], STATE_DEFAULT
+%ifndef UART_POLLING
+	; The first 4 bytes where we stopped are our stop
+	; loop, the original ones are in saved_insn
+	movzx ebx, word [cs:saved_cs]
+	shl   ebx, 4
+	movzx edx, word [cs:saved_eip]
+	add   ebx, edx
+	mov   edx, eax
+	sub   edx, ebx
+	cmp   edx, 4
+	jae   .sw_bp_mem
+
+	mov bx, dx
+	mov al, byte [cs:saved_insn+bx] ; Old
+	mov byte [cs:saved_insn+bx], cl
+	mov ah, cl                      ; Read back
+	jmp .sw_bp_reply
+.sw_bp_mem:
+%endif
 
-	; Send an 'OK'
-	mov bl, MSG_OK
+	call phys_to_seg
+	mov  ds, ax
+	mov  al, byte [ds:bx] ; Old
+	mov  byte [ds:bx], cl
+	mov  ah, byte [ds:bx] ; Read back
+
+.sw_bp_reply:
+	mov  cx, ax
+	mov  bl, MSG_SW_BP
 	call uart_write_byte
+	mov  bx, cx
+	call uart_write_word
+
+	; Reset state
+	mov byte [cs:state], STATE_DEFAULT
 	jmp read_uart
 
 	; ---------------------------------------------
-	; Add hardware watchpoint operations
+	; Ctrl-C/break
 	; ---------------------------------------------
 
-	; Define add hw watchpoint state
 	;
-	; Params:
-	;   1-byte LE: watchpoint kind (whether write or
-	;              read/write (access))
-	;   4-byte LE: watchpoint address
+	; Start of state
 	;
+.state_start_ctrlc:
+	jmp handler_int1_send ; Jump to our int1 handler as if
+	                      ; we're dealing with a single-step
+
+	; ---------------------------------------------
+	; Add 'software' breakpoint
+	; ---------------------------------------------
+
+	; Note: Although this is expected to be a sw breakpoint,
+	; the breakpoint used here is a hardware breakpoint
+	; instead. The bridge uses it for breakpoints in ROM
+	; and conditional ones, the others are int3 (see
+	; MSG_SW_BP).
+
+	; Define sw breakpoint state
+	;
+	; Params: phys address to break (4-bytes LE)
 	define_start_and_params_state \
-		add_hw_watch, STATE_HW_WATCH, 5
+		add_sw_breakpoint, STATE_SW_BREAKPOINT, 4
 
 	;
-	; Adds a hardware watchpoint for the given type
-	; and address
+	; Software breapoint: instruction breakpoint in DR0
 	;
-.state_add_hw_watch:
-	mov   eax, [cs:second_param_dword]    ; Watch address
-	mov   DR2, eax
-	movzx eax, byte [cs:first_param_byte] ; R/W
-	shl   eax, 24  ; R/W at R/W 2
-	mov   ebx, DR7
-	or    ebx, eax
-	; 4-byte length watch & not enable it
-	or    ebx, DR7_LE2_4byte
-	mov   DR7, ebx
+.state_add_sw_breakpoint:
+	mov eax, dword [cs:read_mem_addr]
+	mov dword [cs:hw_bp_addr], eax
+	mov byte  [cs:hw_bp_slot], 0
+	mov byte  [cs:hw_bp_ctl],  0
+	jmp .state_add_hw_bp
+
+	; ---------------------------------------------
+	; Remove 'software' breakpoint
+	; ---------------------------------------------
+
+	;
+	; Start of state
+	;
+.state_start_rem_sw_break:
+	; The legacy instruction breakpoint is DR0
+	mov byte [cs:hw_bp_slot], 0
+	jmp .state_rem_hw_bp
+
+	; ---------------------------------------------
+	; Register write operations
+	; ---------------------------------------------
 
+	; Define read state
+	;
+	; Params: register number (1-byte LE) +
+	;         register value  (4-bytes LE)
+	define_start_and_params_state \
+		reg_write, STATE_REG_WRITE_PARAMS, 5
+
+	;
+	; Writes the read value to the appropriate
+	; register
+	;
+.state_reg_write:
+	; Read the register number and get its stack
+	; offset
+	xor ax,  ax
+	mov al,  [cs:first_param_byte]   ; reg number
+	mov ebx, [cs:second_param_dword] ; reg value
+	mov bp,  sp
+
+	cmp al, 8
+	jge .reg_is_16bit
+.reg_is_32bit:
+	shl al, 2
+	add bp, ax
+	mov dword [ss:bp], ebx
+	jmp .end_reg_write
+.reg_is_16bit:
+	sub al, 8  ; get zero-indexed
+	shl al, 1  ; get its offset
+	add al, 32 ; skip the first 8 32-bit regs
+	add bp, ax
+	mov word [ss:bp], bx
+.end_reg_write:
 	; Reset state
 	mov byte [cs:state], STATE_DEFAULT
 
@@ -658,6 +1222,33 @@ read_uart:
 	call uart_write_byte
 	jmp read_uart
 
+	; ---------------------------------------------
+	; Add hardware watchpoint operations
+	; ---------------------------------------------
+
+	; Define add hw watchpoint state
+	;
+	; Params:
+	;   1-byte LE: watchpoint kind (whether write or
+	;              read/write (access))
+	;   4-byte LE: watchpoint address
+	;
+	define_start_and_params_state \
+		add_hw_watch, STATE_HW_WATCH, 5
+
+	;
+	; Adds a hardware watchpoint for the given type
+	; and address: a 4-byte watchpoint in DR2
+	;
+.state_add_hw_watch:
+	mov eax, dword [cs:second_param_dword] ; Watch address
+	mov dword [cs:hw_bp_addr], eax
+	mov al, byte [cs:first_param_byte]     ; R/W
+	or  al, HW_WATCH_4BYTE
+	mov byte [cs:hw_bp_ctl],  al
+	mov byte [cs:hw_bp_slot], 2
+	jmp .state_add_hw_bp
+
 	; ---------------------------------------------
 	; Remove hardware watchpoint operations
 	; ---------------------------------------------
@@ -666,14 +1257,104 @@ read_uart:
 	; Start of state
 	;
 .state_start_rem_hw_watch:
-	; Since we only support 1 watchpoint, there is
-	; no need to do fancy stuff
-	xor eax, eax
+	; The legacy watchpoint is DR2
+	mov byte [cs:hw_bp_slot], 2
+	jmp .state_rem_hw_bp
+
+	; ---------------------------------------------
+	; Hardware breakpoints (DR0-DR3)
+	; ---------------------------------------------
+
+	; Define add hw breakpoint state
+	;
+	; Params: slot (1-byte) + control (1-byte) +
+	;         phys address (4-bytes LE)
+	define_start_and_params_state \
+		add_hw_bp, STATE_ADD_HW_BP, 6, hw_bp_params
+
+	;
+	; Sets the address, R/W and LEN of the slot, which
+	; is only enabled when the code runs again
+	;
+.state_add_hw_bp:
+	mov eax, dword [cs:hw_bp_addr]
+	mov cl,  byte  [cs:hw_bp_slot]
+	and cl,  3
+
+	cmp cl, 1
+	jb  .add_hw_bp_dr0
+	je  .add_hw_bp_dr1
+	cmp cl, 3
+	jb  .add_hw_bp_dr2
+	mov DR3, eax
+	jmp .add_hw_bp_ctl
+.add_hw_bp_dr0:
+	mov DR0, eax
+	jmp .add_hw_bp_ctl
+.add_hw_bp_dr1:
+	mov DR1, eax
+	jmp .add_hw_bp_ctl
+.add_hw_bp_dr2:
 	mov DR2, eax
-	mov eax, DR7
-	and eax, ~(DR7_L2 | DR7_LE2_RW | DR7_LE2_4byte)
-	mov DR7, eax
 
+.add_hw_bp_ctl:
+	; Replace the R/W and LEN bits of the slot
+	movzx edx, byte [cs:hw_bp_ctl]
+	and   dl,  0x0F
+	mov   ebx, 0x0F
+	shl   cl,  2
+	add   cl,  DR7_RW_LEN
+	shl   edx, cl
+	shl   ebx, cl
+	not   ebx
+	mov   eax, DR7
+	and   eax, ebx
+	or    eax, edx
+	mov   DR7, eax
+
+	; Mark it as used, and as an insn breakpoint or not
+	mov cl, byte [cs:hw_bp_slot]
+	and cl, 3
+	mov al, 1
+	shl al, cl
+	or  byte [cs:hw_bp_used], al
+	not al
+	and byte [cs:hw_bp_exec], al
+	test byte [cs:hw_bp_ctl], 3
+	jnz .hw_bp_ok
+	not al
+	or  byte [cs:hw_bp_exec], al
+	jmp .hw_bp_ok
+
+	; Define remove hw breakpoint state
+	;
+	; Params: slot (1-byte)
+	define_start_and_params_state \
+		rem_hw_bp, STATE_REM_HW_BP, 1, hw_bp_params
+
+	;
+	; Disables the slot and clears its R/W and LEN bits
+	;
+.state_rem_hw_bp:
+	mov cl, byte [cs:hw_bp_slot]
+	and cl, 3
+	mov al, 1
+	shl al, cl
+	not al
+	and byte [cs:hw_bp_used], al
+	and byte [cs:hw_bp_exec], al
+
+	mov   ebx, 0x0F
+	shl   cl,  2
+	add   cl,  DR7_RW_LEN
+	shl   ebx, cl
+	not   ebx
+	mov   eax, DR7
+	and   eax, ebx
+	mov   DR7, eax
+	call  disable_hw_breakpoints
+
+.hw_bp_ok:
 	; Reset state
 	mov byte [cs:state], STATE_DEFAULT
 
@@ -682,7 +1363,148 @@ read_uart:
 	call uart_write_byte
 	jmp read_uart
 
+	; ---------------------------------------------
+	; Serial speed negotiation
+	; ---------------------------------------------
+
+	; Define baud state
+	;
+	; Params: speed (4-bytes LE)
+	define_start_and_params_state \
+		baud, STATE_BAUD, 4, baud_rate
+
+	;
+	; Switches to the new speed, if the UART clock
+	; allows it, and keeps it only if the bridge can
+	; talk to us there
+	;
+.state_baud:
+	mov byte [cs:state], STATE_DEFAULT
+
+	; Divisor for the new speed, must be exact
+	mov  eax, UART_CLOCK_SIGNAL >> 4
+	xor  edx, edx
+	mov  ecx, dword [cs:baud_rate]
+	test ecx, ecx
+	jz   .baud_refuse
+	div  ecx
+	test edx, edx
+	jnz  .baud_refuse
+	test eax, eax
+	jz   .baud_refuse
+	cmp  eax, 0xFFFF
+	ja   .baud_refuse
+	mov  si, ax
+
+	mov  bl, MSG_BAUD
+	call uart_write_byte
+	mov  bl, 1
+	call uart_write_byte
+
+	; Switch only after the reply has gone out
+.baud_drain:
+	inputb UART_LSR
+	test   al, UART_LSR_TEMT
+	jz     .baud_drain
+
+	mov  bx, si
+	call uart_set_divisor
+
+	; Wait for the probe, at the new speed
+	mov ecx, BAUD_TIMEOUT
+.baud_wait:
+	inputb UART_LSR
+	test   al, 1
+	jnz    .baud_probe
+	dec    ecx
+	jnz    .baud_wait
+	jmp    .baud_revert
+
+.baud_probe:
+	inputb UART_RB
+	cmp    al, BAUD_PROBE
+	jne    .baud_revert
+
+	mov  word [cs:uart_divisor], si
+	mov  bl, BAUD_PROBE_ACK
+	call uart_write_byte
+	jmp  read_uart
+
+.baud_revert:
+	mov  bx, word [cs:uart_divisor]
+	call uart_set_divisor
+	jmp  read_uart
+
+.baud_refuse:
+	mov  bl, MSG_BAUD
+	call uart_write_byte
+	mov  bl, 0
+	call uart_write_byte
+	jmp  read_uart
+
+	; ---------------------------------------------
+	; Framed mode
+	; ---------------------------------------------
+
+	;
+	; Reply, still unframed, and start from scratch
+	; (see 'Framed mode' in constants.inc)
+	;
+.state_start_framed:
+	mov  bl, MSG_FRAMED
+	call uart_write_raw
+
+	xor  al, al
+	mov  byte [cs:frame_tx_seq],   al
+	mov  byte [cs:frame_tx_len],   al
+	mov  byte [cs:frame_rx_seq],   al
+	mov  byte [cs:frame_rx_pos],   al
+	mov  byte [cs:frame_rx_avail], al
+	mov  byte [cs:frame_rx_state], FRAME_RX_IDLE
+	mov  byte [cs:framed], 1
+	jmp  read_uart
+
+	; ---------------------------------------------
+	; Capabilities negotiation
+	; ---------------------------------------------
+
+	; Define hello state
+	;
+	; Params: features wanted by the bridge (2-bytes LE)
+	define_start_and_params_state \
+		hello, STATE_HELLO, 2
+
+	;
+	; Enable the features that we support and reply
+	; with all our capabilities
+	;
+.state_hello:
+	mov ax, word [cs:read_mem_params]
+	and ax, CAPS_SUPPORTED
+	mov word [cs:features], ax
+
+	; Our next delta stop should have everything
+	mov byte [cs:delta_full], 1
+
+	; Reset state
+	mov byte [cs:state], STATE_DEFAULT
+
+	; Send our capabilities
+	mov bl, MSG_HELLO
+	call uart_write_byte
+	mov bx, CAPS_SUPPORTED
+	call uart_write_word
+	jmp read_uart
+
 exit_int4:
+	call frame_flush
+%ifndef UART_POLLING
+	; Framed mode: a frame might have arrived while sending
+	; ours, and nothing would interrupt us for it
+	mov al, byte [cs:frame_rx_pos]
+	cmp al, byte [cs:frame_rx_avail]
+	jb  read_uart
+%endif
 	pop_regs
 	iret
 
@@ -723,14 +1545,18 @@ setup_pic:
 ; 8 bits, no parity, one stop bit
 ;
 setup_uart:
-	; Calculate and set divisor
-	outbyte UART_LCR,  UART_LCR_DLA
-	outbyte UART_DLB1, UART_DIVISOR & 0xFF
-	outbyte UART_DLB2, UART_DIVISOR >> 8
-	; Set line control register:
-	outbyte UART_LCR, UART_LCR_BPC_8
+	; Set divisor and line control register
+	mov  bx, UART_DIVISOR
+	call uart_set_divisor
 	; Reset FIFOs and set trigger level to 1 byte.
-	outbyte UART_FCR, UART_FCR_CLRRECV|UART_FCR_CLRTMIT|UART_FCR_TRIG_1
+	outbyte UART_FCR, UART_FCR_ENABLE|UART_FCR_CLRRECV|UART_FCR_CLRTMIT|UART_FCR_TRIG_1
+	; Working FIFOs? If so, send bytes in bursts
+	inputb UART_IIR
+	and    al, UART_IIR_FIFO
+	cmp    al, UART_IIR_FIFO
+	jne    .no_fifo
+	mov    byte [cs:uart_fifo_size], UART_FIFO_SIZE
+.no_fifo:
 	; IRQs enabled, RTS/DSR set
 	outbyte UART_MCR, UART_MCR_OUT2|UART_MCR_RTS|UART_MCR_DTR
 	; Enable 'Data Available Interrupt'
@@ -739,6 +1565,24 @@ setup_uart:
 %endif
 	ret
 
+;
+; Set the UART divisor (speed), 8 bits, no parity,
+; one stop bit
+;
+; Parameters:
+;   bx = divisor
+;
+uart_set_divisor:
+	outbyte UART_LCR,  UART_LCR_DLA
+	mov     dx, UART_DLB1
+	mov     al, bl
+	out     dx, al
+	mov     dx, UART_DLB2
+	mov     al, bh
+	out     dx, al
+	outbyte UART_LCR, UART_LCR_BPC_8
+	ret
+
 ;
 ; Write a string to UART
 ; Parameters:
@@ -761,15 +1605,41 @@ uart_write_string:
 ;   bl = byte to be sent
 ;
 uart_write_byte:
+	cmp  byte [cs:framed], 0
+	jne  frame_put_byte
+
+;
+; Write a single byte to UART, even in framed mode
+; Parameters:
+;   bl = byte to be sent
+;
+uart_write_raw:
+	call uart_tx_wait
+	dec  byte [cs:uart_tx_room]
+	mov  dx, UART_BASE
+	mov  al, bl
+	out  dx, al
+	ret
+
+;
+; Wait until there is room in the transmitter FIFO:
+; once it is found empty, it holds uart_fifo_size
+; bytes without checking it again
+;
+; Return:
+;   uart_tx_room = bytes that can be written (non-zero)
+;
+uart_tx_wait:
+	cmp byte [cs:uart_tx_room], 0
+	jne .out
 	mov dx, UART_LSR
 	.loop:
-		in  al, dx
-		and al, UART_LSR_TFE
-		cmp al, 0
-		je .loop
-	mov dx, UART_BASE
-	mov al, bl
-	out dx, al
+		in   al, dx
+		test al, UART_LSR_TFE
+		jz   .loop
+	mov al, byte [cs:uart_fifo_size]
+	mov byte [cs:uart_tx_room], al
+.out:
 	ret
 
 ;
@@ -800,6 +1670,1032 @@ uart_write_dword:
 	call uart_write_byte
 	ret
 
+;
+; Write a memory block to UART
+;
+; Parameters:
+;   ds:si = data to be sent
+;   cx    = data length
+;
+uart_write_buf:
+	jcxz .out
+	push bx
+	cmp  byte [cs:framed], 0
+	jne  .framed
+	mov  bx, cx
+.burst:
+	; As much as the FIFO holds
+	call  uart_tx_wait
+	movzx cx, byte [cs:uart_tx_room]
+	cmp   cx, bx
+	jbe   .send
+	mov   cx, bx
+.send:
+	sub  bx, cx
+	sub  byte [cs:uart_tx_room], cl
+	mov  dx, UART_BASE
+	rep  outsb
+	test bx, bx
+	jnz  .burst
+	jmp  .done
+.framed:
+	lodsb
+	mov  bl, al
+	call frame_put_byte
+	loop .framed
+.done:
+	pop  bx
+.out:
+	ret
+
+;
+; Wait a little for a byte from UART (in framed mode,
+; only the bytes left in the last frame)
+;
+; Return:
+;   CF = 0 and al = byte read, if it arrived within
+;   UART_RX_TIMEOUT reads of the LSR, CF = 1 otherwise
+;
+uart_read_timeout:
+	cmp byte [cs:framed], 0
+	jne frame_next_byte
+	mov ecx, UART_RX_TIMEOUT
+	mov dx,  UART_LSR
+	.loop:
+		in   al, dx
+		test al, 1
+		jnz  .read
+		dec  ecx
+		jnz  .loop
+	stc
+	ret
+.read:
+	inputb UART_RB
+	clc
+	ret
+
+;
+; Framed mode: add a byte to the frame being written,
+; sending it if full (see 'Framed mode' in constants.inc)
+;
+; Parameters:
+;   bl = byte to be sent
+;
+frame_put_byte:
+	push  si
+	movzx si, byte [cs:frame_tx_len]
+	mov   byte [cs:frame_tx_buf+si], bl
+	inc   byte [cs:frame_tx_len]
+	pop   si
+	cmp   byte [cs:frame_tx_len], FRAME_MAX
+	jb    .out
+	call  frame_flush
+.out:
+	ret
+
+;
+; Framed mode: send the bytes written so far as a frame,
+; and wait for its ack, sending it again until it comes
+;
+frame_flush:
+	cmp byte [cs:frame_tx_len], 0
+	jne .send
+	ret
+.send:
+	pushad
+
+.again:
+	mov  byte [cs:frame_acked], FRAME_WAITING
+
+	mov  bl, FRAME_SOF
+	call uart_write_raw
+	mov  di, CRC16_INIT
+	mov  bl, byte [cs:frame_tx_len]
+	call frame_write_crc
+	mov  bl, byte [cs:frame_tx_seq]
+	call frame_write_crc
+
+	mov   si, frame_tx_buf
+	movzx cx, byte [cs:frame_tx_len]
+	.data:
+		mov  bl, byte [cs:si]
+		call frame_write_crc
+		inc  si
+		loop .data
+
+	mov  bx, di
+	call uart_write_raw
+	mov  bl, bh
+	call uart_write_raw
+
+	; Wait for the ack, while also receiving whatever
+	; the bridge sends (Ctrl-C does not matter, we are
+	; stopped already)
+	mov ecx, FRAME_TIMEOUT
+.wait:
+	cmp byte [cs:frame_acked], FRAME_GOT_ACK
+	je  .acked
+	cmp byte [cs:frame_acked], FRAME_GOT_NAK
+	je  .again
+	inputb UART_LSR
+	test   al, 1
+	jz     .no_input
+	inputb UART_RB
+	call   frame_rx_byte
+	jmp    .next
+.no_input:
+	call   frame_rx_silence
+.next:
+	dec ecx
+	jnz .wait
+	jmp .again
+
+.acked:
+	mov al, byte [cs:frame_tx_seq]
+	inc al
+	and al, FRAME_SEQ_MASK
+	mov byte [cs:frame_tx_seq], al
+	mov byte [cs:frame_tx_len], 0
+	popad
+	ret
+
+;
+; Framed mode: send a byte and add it to the CRC-16
+;
+; Parameters:
+;   bl = byte to be sent
+;   di = CRC-16 so far, updated
+;
+frame_write_crc:
+	mov  al, bl
+	mov  dx, di
+	call crc16_update
+	mov  di, dx
+	jmp  uart_write_raw
+
+;
+; Framed mode: send an ack (or nak) frame
+;
+; Parameters:
+;   al = seq (FRAME_NAK, if nak)
+;
+frame_send_ack:
+	pusha
+	mov  cl, al
+	mov  dx, CRC16_INIT
+	xor  al, al
+	call crc16_update
+	mov  al, cl
+	call crc16_update
+	mov  si, dx
+
+	mov  bl, FRAME_SOF
+	call uart_write_raw
+	xor  bl, bl
+	call uart_write_raw
+	mov  bl, cl
+	call uart_write_raw
+	mov  bx, si
+	call uart_write_raw
+	mov  bl, bh
+	call uart_write_raw
+	popa
+	ret
+
+;
+; Framed mode: handle a byte received from UART
+;
+; Parameters:
+;   al = byte received
+; Return:
+;   CF = 0 if al is a byte out of frames (MSG_CTRLC),
+;   to be handled right away, 1 otherwise
+;
+frame_rx_byte:
+	push bx
+	push dx
+	mov  dword [cs:frame_rx_quiet], 0
+
+	mov bl, byte [cs:frame_rx_state]
+	cmp bl, FRAME_RX_LEN
+	je  .len
+	cmp bl, FRAME_RX_SEQ
+	je  .seq
+	cmp bl, FRAME_RX_DATA
+	je  .data
+	cmp bl, FRAME_RX_CRC1
+	je  .crc1
+	cmp bl, FRAME_RX_CRC2
+	je  .crc2
+
+	; Out of frames: start of frame or Ctrl-C, anything
+	; else is noise
+	cmp al, FRAME_SOF
+	je  .sof
+	cmp al, MSG_CTRLC
+	jne .consumed
+	pop dx
+	pop bx
+	clc
+	ret
+
+.sof:
+	mov word [cs:frame_rx_crc],   CRC16_INIT
+	mov byte [cs:frame_rx_state], FRAME_RX_LEN
+	jmp .consumed
+
+.len:
+	cmp al, FRAME_MAX
+	ja  .reset
+	mov byte [cs:frame_rx_len], al
+	mov byte [cs:frame_rx_idx], 0
+	mov byte [cs:frame_rx_state], FRAME_RX_SEQ
+
+	; Keep the data only if the last frame was entirely
+	; handled
+	mov  bl, byte [cs:frame_rx_pos]
+	cmp  bl, byte [cs:frame_rx_avail]
+	sete byte [cs:frame_rx_store]
+	jmp  .crc
+
+.seq:
+	mov byte [cs:frame_rx_hseq],  al
+	mov byte [cs:frame_rx_state], FRAME_RX_DATA
+	cmp byte [cs:frame_rx_len], 0
+	jne .crc
+	mov byte [cs:frame_rx_state], FRAME_RX_CRC1
+	jmp .crc
+
+.data:
+	cmp   byte [cs:frame_rx_store], 0
+	je    .data_skip
+	movzx bx, byte [cs:frame_rx_idx]
+	mov   byte [cs:frame_rx_buf+bx], al
+.data_skip:
+	inc byte [cs:frame_rx_idx]
+	mov bl, byte [cs:frame_rx_idx]
+	cmp bl, byte [cs:frame_rx_len]
+	jne .crc
+	mov byte [cs:frame_rx_state], FRAME_RX_CRC1
+
+.crc:
+	mov  dx, word [cs:frame_rx_crc]
+	call crc16_update
+	mov  word [cs:frame_rx_crc], dx
+	jmp  .consumed
+
+.crc1:
+	mov byte [cs:frame_rx_crc_lo], al
+	mov byte [cs:frame_rx_state],  FRAME_RX_CRC2
+	jmp .consumed
+
+.crc2:
+	mov byte [cs:frame_rx_state], FRAME_RX_IDLE
+	mov ah, al
+	mov al, byte [cs:frame_rx_crc_lo]
+	cmp ax, word [cs:frame_rx_crc]
+	jne .bad
+
+	; Ack/nak of the frame being sent?
+	mov al, byte [cs:frame_rx_hseq]
+	cmp byte [cs:frame_rx_len], 0
+	jne .data_frame
+	mov bl, FRAME_GOT_NAK
+	test al, FRAME_NAK
+	jnz .answer
+	cmp al, byte [cs:frame_tx_seq]
+	jne .consumed
+	mov bl, FRAME_GOT_ACK
+.answer:
+	mov byte [cs:frame_acked], bl
+	jmp .consumed
+
+.data_frame:
+	cmp al, byte [cs:frame_rx_seq]
+	je  .new_frame
+
+	; Repeated (our ack got lost)?
+	inc al
+	and al, FRAME_SEQ_MASK
+	cmp al, byte [cs:frame_rx_seq]
+	jne .consumed
+	mov al, byte [cs:frame_rx_hseq]
+	call frame_send_ack
+	jmp .consumed
+
+.new_frame:
+	; Still handling the last one, wait for it again
+	cmp byte [cs:frame_rx_store], 0
+	je  .consumed
+	call frame_send_ack
+	inc al
+	and al, FRAME_SEQ_MASK
+	mov byte [cs:frame_rx_seq], al
+	mov byte [cs:frame_rx_pos], 0
+	mov bl, byte [cs:frame_rx_len]
+	mov byte [cs:frame_rx_avail], bl
+	jmp .consumed
+
+.bad:
+	mov  al, byte [cs:frame_rx_seq]
+	or   al, FRAME_NAK
+	call frame_send_ack
+	jmp  .consumed
+
+.reset:
+	mov byte [cs:frame_rx_state], FRAME_RX_IDLE
+.consumed:
+	pop dx
+	pop bx
+	stc
+	ret
+
+;
+; Framed mode: count a read of the LSR without input, and
+; drop the frame being received if its rest does not come
+; within FRAME_RX_GAP of them: its length might be corrupted,
+; so the next FRAME_SOF is looked for
+;
+frame_rx_silence:
+	cmp byte [cs:frame_rx_state], FRAME_RX_IDLE
+	je  .out
+	inc dword [cs:frame_rx_quiet]
+	cmp dword [cs:frame_rx_quiet], FRAME_RX_GAP
+	jb  .out
+	mov byte [cs:frame_rx_state], FRAME_RX_IDLE
+.out:
+	ret
+
+;
+; Framed mode: next byte of the last frame received
+;
+; Return:
+;   CF = 0 and al = byte, if there is any left, CF = 1
+;   otherwise
+;
+frame_next_byte:
+	push  bx
+	movzx bx, byte [cs:frame_rx_pos]
+	cmp   bl, byte [cs:frame_rx_avail]
+	jae   .empty
+	mov   al, byte [cs:frame_rx_buf+bx]
+	inc   byte [cs:frame_rx_pos]
+	pop   bx
+	clc
+	ret
+.empty:
+	pop bx
+	stc
+	ret
+
+;
+; Update the CRC-16 (see 'Framed mode' in constants.inc)
+; with a byte
+;
+; Parameters:
+;   al = byte
+;   dx = CRC-16 so far
+; Return:
+;   dx = new CRC-16
+;
+crc16_update:
+	push cx
+	xor  dh, al
+	mov  cx, 8
+.loop:
+	shl  dx, 1
+	jnc  .next
+	xor  dx, CRC16_POLY
+.next:
+	loop .loop
+	pop  cx
+	ret
+
+;
+; Write a memory block to UART, RLE-compressed
+; (see 'RLE' in constants.inc)
+;
+; Parameters:
+;   ds:si = data to be sent
+;   cx    = data length
+;
+uart_write_rle:
+	test cx, cx
+	jz   .out
+	call rle_run_len
+	cmp  di, RLE_MIN_RUN
+	jb   .literal
+
+	; Repeated byte
+	mov  bx, di
+	add  bl, 0x80 - RLE_MIN_RUN
+	call uart_write_byte
+	mov  bl, byte [si]
+	call uart_write_byte
+	add  si, di
+	sub  cx, di
+	jmp  uart_write_rle
+
+	; Literal bytes, until the next run (or RLE_MAX_LIT)
+.literal:
+	push si
+	xor  bp, bp
+	.lit_len:
+		inc  bp
+		inc  si
+		dec  cx
+		jz   .lit_send
+		cmp  bp, RLE_MAX_LIT
+		je   .lit_send
+		call rle_run_len
+		cmp  di, RLE_MIN_RUN
+		jb   .lit_len
+.lit_send:
+	pop  si
+	mov  bx, bp
+	dec  bl
+	call uart_write_byte
+	.lit_data:
+		mov  bl, byte [si]
+		call uart_write_byte
+		inc  si
+		dec  bp
+		jnz  .lit_data
+	jmp  uart_write_rle
+.out:
+	ret
+
+;
+; Length of the run of equal bytes at ds:si
+;
+; Parameters:
+;   ds:si = data
+;   cx    = data length (non-zero)
+; Return:
+;   di = run length (1 up to RLE_MAX_RUN)
+;
+rle_run_len:
+	push bx
+	mov  al, byte [si]
+	mov  bx, 1
+.loop:
+	cmp  bx, cx
+	jae  .out
+	cmp  bx, RLE_MAX_RUN
+	jae  .out
+	cmp  al, byte [bx+si]
+	jne  .out
+	inc  bx
+	jmp  .loop
+.out:
+	mov  di, bx
+	pop  bx
+	ret
+
+;
+; Write a byte into the current memory write position
+; (read_mem_addr) and advance it
+;
+; Parameters:
+;   al = byte to be written
+; Return:
+;   ZF = 1 if there is nothing left to be written
+;
+mem_write_byte:
+	mov  cl, al
+	mov  eax, dword [cs:read_mem_addr]
+	call phys_to_seg
+	mov  ds, ax
+	mov  byte [ds:bx], cl
+	inc  dword [cs:read_mem_addr]
+	dec  word [cs:read_mem_size]
+	ret
+
+;
+; Search the memory for the pattern given by the
+; search_* parameters
+;
+; Return:
+;   CF  = 0 if found, 1 otherwise
+;   eax = match address (if found)
+;
+; Note: The searched range should not go beyond
+; the 0x10FFF0 limit.
+;
+mem_search:
+	cld
+	mov   ax, cs
+	mov   ds, ax
+
+	; ebp = amount of positions to be checked
+	movzx ecx, byte [cs:search_pat_len]
+	mov   ebp, dword [cs:range_len]
+	sub   ebp, ecx
+	jb    .not_found
+	inc   ebp
+	mov   edx, dword [cs:range_addr]
+
+	;
+	; Search in blocks of up to RANGE_BLOCK positions,
+	; so that a block (plus the pattern) never wraps
+	; around the segment
+	;
+.block:
+	mov   eax, edx
+	call  phys_to_seg
+	mov   es, ax
+	mov   di, bx
+	mov   ecx, ebp
+	cmp   ecx, RANGE_BLOCK
+	jbe   .first_byte_pos
+	mov   ecx, RANGE_BLOCK
+.first_byte_pos:
+	mov   al, byte [cs:search_pattern]
+.scan:
+	repne scasb
+	jne   .block_done
+
+	; First byte matches, check the remaining ones
+	push  cx
+	push  di
+	movzx cx, byte [cs:search_pat_len]
+	mov   si, search_pattern + 1
+	dec   cx
+	repe  cmpsb
+	pop   di
+	pop   cx
+	je    .found
+	jcxz  .block_done
+	jmp   .scan
+
+	; Go to the next block, if any
+.block_done:
+	movzx eax, di
+	sub   ax, bx
+	add   edx, eax
+	sub   ebp, eax
+	jnz   .block
+.not_found:
+	stc
+	ret
+.found:
+	movzx eax, di
+	sub   ax, bx
+	dec   eax
+	add   eax, edx
+	clc
+	ret
+
+;
+; Append the CS:IP (and FLAGS, if TRACE_FLAGS) of the
+; next instruction to the trace buffer, and drains the
+; buffer if full
+;
+; Parameters:
+;   ss:bp+10 = IP, CS and FLAGS (int1 frame)
+;
+trace_record:
+	push ax
+	push di
+	push es
+
+	mov es, word [cs:trace_seg]
+	mov di, word [cs:trace_pos]
+
+	mov ax, word [ss:bp+10] ; IP
+	mov word [es:di], ax
+	mov ax, word [ss:bp+12] ; CS
+	mov word [es:di+2], ax
+	add di, 4
+
+	test byte [cs:trace_on], TRACE_FLAGS
+	jz   .saved
+	mov  ax, word [ss:bp+14] ; FLAGS
+	mov  word [es:di], ax
+	add  di, 2
+
+.saved:
+	mov word [cs:trace_pos], di
+	cmp di, word [cs:trace_end]
+	jb  .exit
+	call trace_drain
+.exit:
+	pop es
+	pop di
+	pop ax
+	ret
+
+;
+; Send the trace buffer contents, if any, to the bridge
+; and empties it (see 'Instruction trace' in
+; constants.inc)
+;
+trace_drain:
+	pushad
+	push ds
+
+	mov si, word [cs:trace_start]
+	mov cx, word [cs:trace_pos]
+	sub cx, si
+	jz  .exit
+
+	mov  bl, MSG_TRACE_DATA
+	call uart_write_byte
+	mov  bl, byte [cs:trace_on]
+	call uart_write_byte
+	mov  bx, cx
+	call uart_write_word
+	mov  ds, word [cs:trace_seg]
+	call uart_write_buf
+
+	mov ax, word [cs:trace_start]
+	mov word [cs:trace_pos], ax
+.exit:
+	pop ds
+	popad
+	ret
+
+;
+; Check if we stopped at the insn breakpoint but none of
+; its conditions holds and, if so, prepares to silently
+; step over it (see 'Conditional breakpoints' in
+; constants.inc)
+;
+; Return:
+;   CF = 1 if the execution should go on
+;
+; Required stack layout:
+; Stack:
+;   ret_addr
+;   push_regs
+;
+cond_check:
+	cmp byte [cs:cond_len], 0
+	je  .stop
+
+	mov bp, sp
+	add bp, 2
+
+	; Other slots always stop
+	mov  eax, DR6
+	and  al, byte [cs:hw_bp_used]
+	test al, 0x0E
+	jnz  .stop
+
+	; Insn breakpoint hit, or reached while range stepping?
+	test al, 0x01
+	jnz  .hit
+	cmp  byte [cs:range_stepping], 1
+	jne  .stop
+
+	movzx eax, word [ss:bp+CS_OFF]
+	shl   eax, 4
+	movzx ebx, word [ss:bp+EIP_OFF]
+	add   eax, ebx
+	mov   ebx, DR0
+	cmp   eax, ebx
+	jne   .stop
+
+.hit:
+	call cond_eval
+	jc   .stop
+
+	; Step over it, with the breakpoint disabled
+	mov eax, DR6
+	and al,  0xF0
+	mov DR6, eax
+	mov eax, DR7
+	and eax, ~DR7_L0
+	mov DR7, eax
+
+	; Remember if we were single-stepping or not
+	mov  byte [cs:cond_tf], 0
+	test word [ss:bp+EFLAGS_OFF], EFLAGS_TF
+	jz   .step_over
+	mov  byte [cs:cond_tf], 1
+.step_over:
+	or  word [ss:bp+EFLAGS_OFF], EFLAGS_TF
+	mov byte [cs:cond_skip], 1
+	stc
+	ret
+.stop:
+	clc
+	ret
+
+;
+; Evaluate the insn breakpoint conditions (see
+; 'Conditional breakpoints' in constants.inc)
+;
+; Parameters:
+;   ss:bp = push_regs frame
+;
+; Return:
+;   CF = 1 if one of the conditions holds (or if it
+;        could not be evaluated, e.g., division by zero)
+;
+cond_eval:
+	mov si, cond_code
+	xor di, di ; Stack top (bytes)
+
+.next:
+	movzx bx, byte [cs:si]
+	inc   si
+	shl   bx, 1
+	jmp   word [cs:.ops+bx]
+
+.ops:
+	dw .done, .end, .const, .reg, .ref8, .ref16, .ref32
+	dw .add, .sub, .mul, .divs, .divu, .rems, .remu
+	dw .lsh, .rshs, .rshu, .and, .or, .xor
+	dw .eq, .lts, .ltu, .ifgoto, .goto, .pick, .op_pop
+	dw .swap, .rot
+
+.done:
+	clc
+	ret
+.true:
+	stc
+	ret
+
+.end:
+	call .pop_a
+	test eax, eax
+	jnz  .true
+	xor  di, di ; Next condition, empty stack
+	jmp  .goto
+
+.const:
+	mov eax, dword [cs:si]
+	add si, 4
+	jmp .push
+
+	; Registers, as GDB sees them
+.reg:
+	movzx bx, byte [cs:si]
+	inc   si
+	mov   cl, bl
+	movzx bx, byte [cs:cond_regs+bx]
+	add   bx, bp
+	cmp   cl, 8
+	jae   .reg16
+
+	mov eax, dword [ss:bx]
+	cmp cl, 4 ; ESP
+	jne .reg_ebp
+	add eax, 2*8
+	jmp .reg_ss
+.reg_ebp:
+	cmp cl, 5 ; EBP
+	jne .push
+.reg_ss:
+	movzx edx, word [ss:bp+SS_OFF]
+	jmp   .reg_phys
+
+.reg16:
+	movzx eax, word [ss:bx]
+	cmp   cl, 8 ; EIP
+	jne   .push
+	movzx edx, word [ss:bp+CS_OFF]
+.reg_phys:
+	shl edx, 4
+	add eax, edx
+	jmp .push
+
+	; Memory
+.ref8:
+	call  .ref_seg
+	movzx eax, byte [es:bx]
+	jmp   .push
+.ref16:
+	call  .ref_seg
+	movzx eax, word [es:bx]
+	jmp   .push
+.ref32:
+	call  .ref_seg
+	mov   eax, dword [es:bx]
+	jmp   .push
+.ref_seg:
+	call .pop_a
+	call phys_to_seg
+	mov  es, ax
+	ret
+
+	; Arithmetic
+.add:
+	call .pop_ab
+	add  eax, ebx
+	jmp  .push
+.sub:
+	call .pop_ab
+	sub  eax, ebx
+	jmp  .push
+.mul:
+	call .pop_ab
+	imul eax, ebx
+	jmp  .push
+.divs:
+	call .pop_ab
+	test ebx, ebx
+	jz   .true
+	cmp  ebx, -1 ; Avoid the overflow of INT_MIN / -1
+	je   .neg
+	cdq
+	idiv ebx
+	jmp  .push
+.neg:
+	neg eax
+	jmp .push
+.divu:
+	call .pop_ab
+	test ebx, ebx
+	jz   .true
+	xor  edx, edx
+	div  ebx
+	jmp  .push
+.rems:
+	call .pop_ab
+	test ebx, ebx
+	jz   .true
+	cmp  ebx, -1
+	je   .zero
+	cdq
+	idiv ebx
+	mov  eax, edx
+	jmp  .push
+.zero:
+	xor eax, eax
+	jmp .push
+.remu:
+	call .pop_ab
+	test ebx, ebx
+	jz   .true
+	xor  edx, edx
+	div  ebx
+	mov  eax, edx
+	jmp  .push
+.lsh:
+	call .pop_ab
+	mov  cl, bl
+	shl  eax, cl
+	jmp  .push
+.rshs:
+	call .pop_ab
+	mov  cl, bl
+	sar  eax, cl
+	jmp  .push
+.rshu:
+	call .pop_ab
+	mov  cl, bl
+	shr  eax, cl
+	jmp  .push
+.and:
+	call .pop_ab
+	and  eax, ebx
+	jmp  .push
+.or:
+	call .pop_ab
+	or   eax, ebx
+	jmp  .push
+.xor:
+	call .pop_ab
+	xor  eax, ebx
+	jmp  .push
+
+	; Comparisons
+.eq:
+	call .pop_ab
+	cmp  eax, ebx
+	sete al
+	jmp  .bool
+.lts:
+	call .pop_ab
+	cmp  eax, ebx
+	setl al
+	jmp  .bool
+.ltu:
+	call .pop_ab
+	cmp  eax, ebx
+	setb al
+.bool:
+	movzx eax, al
+	jmp   .push
+
+	; Jumps
+.ifgoto:
+	call .pop_a
+	test eax, eax
+	jnz  .goto
+	add  si, 2
+	jmp  .next
+.goto:
+	mov si, word [cs:si]
+	add si, cond_code
+	jmp .next
+
+	; Stack
+.pick:
+	movzx bx, byte [cs:si]
+	inc   si
+	shl   bx, 2
+	neg   bx
+	add   bx, di
+	mov   eax, dword [cs:cond_stack+bx-4]
+	jmp   .push
+.op_pop:
+	sub di, 4
+	jmp .next
+.swap:
+	call .pop_ab
+	mov  dword [cs:cond_stack+di], ebx
+	add  di, 4
+	jmp  .push
+.rot:
+	sub di, 12
+	mov eax, dword [cs:cond_stack+di]   ; a
+	mov ebx, dword [cs:cond_stack+di+4] ; b
+	mov ecx, dword [cs:cond_stack+di+8] ; c
+	mov dword [cs:cond_stack+di],   ecx
+	mov dword [cs:cond_stack+di+4], eax
+	mov dword [cs:cond_stack+di+8], ebx
+	add di, 12
+	jmp .next
+
+.push:
+	mov dword [cs:cond_stack+di], eax
+	add di, 4
+	jmp .next
+
+	; eax = top
+.pop_a:
+	sub di, 4
+	mov eax, dword [cs:cond_stack+di]
+	ret
+
+	; eax = next-to-top, ebx = top
+.pop_ab:
+	sub di, 8
+	mov eax, dword [cs:cond_stack+di]
+	mov ebx, dword [cs:cond_stack+di+4]
+	ret
+
+;
+; CRC32 of the memory range given by range_addr and
+; range_len, as GDB expects it (see 'CRC32' in
+; constants.inc)
+;
+; Return:
+;   eax = CRC32
+;
+; Note: The range should not go beyond the 0x10FFF0
+; limit.
+;
+mem_crc32:
+	cld
+	mov  edx, dword [cs:range_addr]
+	mov  ebp, dword [cs:range_len]
+	mov  edi, CRC32_INIT
+
+	; Process in blocks, like mem_search
+.block:
+	test ebp, ebp
+	jz   .out
+	mov  eax, edx
+	call phys_to_seg
+	mov  ds, ax
+	mov  si, bx
+	mov  ecx, ebp
+	cmp  ecx, RANGE_BLOCK
+	jbe  .block_len
+	mov  ecx, RANGE_BLOCK
+.block_len:
+	add  edx, ecx
+	sub  ebp, ecx
+
+	; One nibble at a time, high nibble first
+.byte:
+	lodsb
+	mov  ah,  al
+	shr  ah,  4
+	mov  ebx, edi
+	shr  ebx, 28
+	xor  bl,  ah
+	shl  bx,  2
+	shl  edi, 4
+	xor  edi, dword [cs:crc32_table+bx]
+
+	and  al,  0x0F
+	mov  ebx, edi
+	shr  ebx, 28
+	xor  bl,  al
+	shl  bx,  2
+	shl  edi, 4
+	xor  edi, dword [cs:crc32_table+bx]
+	loop .byte
+	jmp  .block
+.out:
+	mov  eax, edi
+	ret
+
 ;
 ; Convert a physical address to SEG:OFF
 ; Parameters:
@@ -808,12 +2704,16 @@ uart_write_dword:
 ;   ax = Segment
 ;   bx = Offset
 ;
+; Note: The returned SEG:OFF is normalized (offset
+; < 16), so up to 0xFFF0 bytes can be accessed from
+; it without wrapping around the segment.
+;
 phys_to_seg:
 	cmp eax, (1<<20)
 	jge .a20_addr
 	mov bx, ax
+	and bx, 0xF
 	shr eax, 4
-	and eax, 0xF000
 	ret
 .a20_addr:
 	mov ebx, eax
@@ -832,50 +2732,188 @@ phys_to_seg:
 ;     push_regs
 ;
 send_stop_msg:
-	; Signal that we stopped!
-	mov bl, MSG_SINGLE_STEP
+	mov bp, sp
+	add bp, 2   ; Ignores return address/EIP
+
+	; Signal that we stopped (and in which format)!
+	mov  ax, word [cs:features]
+	mov  bl, MSG_SINGLE_STEP
+	test ax, CAP_EXPEDITE
+	jz   .not_expedited
+	mov  bl, MSG_STOP_EXPEDITED
+.not_expedited:
+	test ax, CAP_DELTA_STOP
+	jnz  .delta
 	call uart_write_byte
 
 	;
-	; Now we need to send our registers
-	; First: 32-bit regs: EDI-EAX
+	; Now we need to send our registers, 32-bit regs
+	; (EDI-EAX) and then 16-bit regs (GS-EFLAGS), all
+	; little-endian, just like they are in the stack, so
+	; a single block is enough
 	;
 	mov ax, ss
 	mov ds, ax
-	mov si, sp
-	add si, 2   ; Ignores return address/EIP
-	mov cx, 8
-	.loop1:
-		lodsd
-		mov ebx, eax
-		call uart_write_dword
-		loop .loop1
-
-	; Second: 16-bit regs: GS-EFLAGS
-	mov cx, 8
-	.loop2:
-		lodsw
-		mov bx, ax
-		call uart_write_word
-		loop .loop2
+	mov si, bp
+	mov cx, EFLAGS_OFF+2
+	call uart_write_buf
 
 	; Discover what make us stop and send the reason
+	call send_stop_reason
+	jnc  .expedite
+	call uart_write_dword ; stub value, should not be used
+	jmp  .expedite
+
+	;
+	; Delta stop: only the registers that changed since the
+	; last stop are sent (see 'Delta stop' in constants.inc)
+	;
+.delta:
+	add  bl, MSG_STOP_DELTA - MSG_SINGLE_STEP
+	call uart_write_byte
+
+	; Build the change mask and save the new values
+	xor  dx, dx   ; Change mask
+	mov  cx, 1    ; Current register bit
+	xor  di, di   ; Current register offset
+
+	; 32-bit regs: EDI-EAX
+.delta_mask32:
+	mov  eax, dword [ss:bp+di]
+	cmp  eax, dword [cs:prev_regs+di]
+	je   .delta_same32
+	or   dx, cx
+	mov  dword [cs:prev_regs+di], eax
+.delta_same32:
+	shl  cx, 1
+	add  di, 4
+	cmp  di, GS_OFF
+	jb   .delta_mask32
+
+	; 16-bit regs: GS-EFLAGS
+.delta_mask16:
+	mov  ax, word [ss:bp+di]
+	cmp  ax, word [cs:prev_regs+di]
+	je   .delta_same16
+	or   dx, cx
+	mov  word [cs:prev_regs+di], ax
+.delta_same16:
+	shl  cx, 1
+	add  di, 2
+	cmp  di, EFLAGS_OFF+2
+	jb   .delta_mask16
+
+	; The bridge does not know anything yet, send all
+	cmp  byte [cs:delta_full], 0
+	je   .delta_send_mask
+	mov  dx, 0xFFFF
+	mov  byte [cs:delta_full], 0
+
+.delta_send_mask:
+	mov  si, dx
+	mov  bx, dx
+	call uart_write_word
+
+	; Stop reason, plus the address if not normal
+	call send_stop_reason
+
+	; Changed registers, in the push_regs order
+.delta_send_regs:
+	xor  di, di
+.delta_send32:
+	shr  si, 1
+	jnc  .delta_skip32
+	mov  ebx, dword [ss:bp+di]
+	call uart_write_dword
+.delta_skip32:
+	add  di, 4
+	cmp  di, GS_OFF
+	jb   .delta_send32
+
+.delta_send16:
+	shr  si, 1
+	jnc  .delta_skip16
+	mov  bx, word [ss:bp+di]
+	call uart_write_word
+.delta_skip16:
+	add  di, 2
+	cmp  di, EFLAGS_OFF+2
+	jb   .delta_send16
+
+.expedite:
+	;
+	; If enabled, also send the bytes at CS:IP and SS:SP,
+	; so that the bridge do not need to ask for them on
+	; every stop.
+	;
+	test word [cs:features], CAP_EXPEDITE
+	jz .out
+
+	mov ds, word [bp+CS_OFF]
+	mov si, word [bp+EIP_OFF]
+	mov cx, EXPEDITE_SIZE
+	call uart_write_buf
+
+	; Skip the segment regs and IRET frame (like the bridge)
+	mov ds, word [bp+SS_OFF]
+	mov si, word [bp+ESP_OFF]
+	add si, 2*8
+	mov cx, EXPEDITE_SIZE
+	call uart_write_buf
+.out:
+	ret
+
+;
+; Send the stop reason: normal, or which slot fired
+; followed by its address (see 'Hardware breakpoints'
+; in constants.inc)
+;
+; Return:
+;   CF = 1 if normal (no address sent)
+;
+send_stop_reason:
 	mov eax, DR6
-	bt  ax,  2
-	jnc .normal_break
+	and al,  byte [cs:hw_bp_used]
+	jz  .normal
+
+	test word [cs:features], CAP_HW_BP
+	jnz  .slot
 
-	; Watchpoint break in DR2
-	mov bl, STOP_REASON_WATCHPOINT
+	; Legacy: only the watchpoint in DR2
+	test al, 0x04
+	jz   .normal
+	mov  bl, STOP_REASON_WATCHPOINT
 	call uart_write_byte
-	mov eax, DR2
-	mov ebx, eax
+	mov  ebx, DR2
+	jmp  .addr
+
+.slot:
+	; Lowest slot that fired
+	movzx cx, al
+	bsf   cx, cx
+	mov   bl, STOP_REASON_DR0
+	add   bl, cl
+	call  uart_write_byte
+
+	mov ebx, DR0
+	cmp cl, 1
+	jb  .addr
+	mov ebx, DR1
+	cmp cl, 1
+	je  .addr
+	mov ebx, DR2
+	cmp cl, 3
+	jb  .addr
+	mov ebx, DR3
+.addr:
 	call uart_write_dword
+	clc
 	ret
 
-.normal_break:
-	mov bl, STOP_REASON_NORMAL
+.normal:
+	mov  bl, STOP_REASON_NORMAL
 	call uart_write_byte
-	call uart_write_dword ; stub value, should not be used
+	stc
 	ret
 
 ;
@@ -888,9 +2926,9 @@ disable_hw_breakpoints:
 	mov eax, DR6
 	xor al,  al   ; Clear L0/G0-L3/G3
 	mov DR6, eax
-	; Disable LE0 and LE2
+	; Disable L0-L3
 	mov eax, DR7
-	and al, ~(DR7_L0 | DR7_L2)
+	and al, ~DR7_L_ALL
 	mov DR7, eax
 	ret
 
@@ -912,61 +2950,76 @@ enable_hw_breakpoints:
 	and al,  0xF0
 	mov DR6, eax
 
-	; Enable insn hw breakpoints
-	call enable_insn_hw_bp
+	; Get phys addr
+	mov   bp,  sp
+	add   bp,  2
+	movzx eax, word [ss:bp+CS_OFF]
+	shl   eax, 4
+	movzx ebx, word [ss:bp+EIP_OFF]
+	add   eax, ebx ; Current physical address
 
-	; Enable watchpoints if any
-	mov eax, DR2
-	cmp eax, 0
-	je  .not_enable
-	mov eax, DR7
-	or  eax, DR7_L2 ; We can always safely enable
-	mov DR7, eax    ; when returning to execute
+	;
+	; Insn breakpoints at the current address shouldn't
+	; be enabled, otherwise, we would never leave it.
+	; Watchpoints can always be safely enabled
+	;
+	call hw_bp_match
+	not  dl
+	and  dl, byte [cs:hw_bp_used]
+
+	; Slot n is enabled by Ln, bit 2n of DR7
+	xor  cl, cl
+	mov  ch, DR7_L0
+.slot:
+	shr  dl, 1
+	jnc  .next
+	or   cl, ch
+.next:
+	shl  ch, 2
+	jnz  .slot
 
-.not_enable:
+	mov eax, DR7
+	and al,  ~DR7_L_ALL
+	or  al,  cl
+	mov DR7, eax
 	ret
 
 ;
-; Enable instruction breakpoints if any
+; Find the insn breakpoints at a given address
 ;
 ; Parameters:
-;   none
+;   eax = phys address
 ;
-; Required stack layout:
-; Stack:
-;   ret_addr
-;   ret_addr
-;   push_regs
+; Return:
+;   dl = slots (bit n = DRn) with an insn breakpoint
+;        at eax
 ;
-enable_insn_hw_bp:
-	; Get phys addr
-	mov   bp,  sp
-	add   bp,  4
-	movzx eax, word [ss:bp+CS_OFF]
-	shl   eax, 4
-	movzx ebx, word [ss:bp+EIP_OFF]
-	add   eax, ebx ; Current physical address
-
-	; Check if there is something First
-	mov ebx, DR0
-	cmp ebx, 0
-	mov ecx, DR7
-	jz  .not_enable
-
-	;
-	; Compare current addr with break addr
-	; if the same, if shouldn't enable it!
-	; otherwise, thats no problem =)
-	;
-	cmp eax, ebx
-	jne .enable
-.not_enable:
-	and ecx, ~DR7_L0 ; Disabled
-	jmp .exit
-.enable:
-	or  ecx,  DR7_L0 ; Enabled
-.exit:
-	mov DR7, ecx
+hw_bp_match:
+	push ebx
+	xor  dl, dl
+
+	mov  ebx, DR0
+	cmp  eax, ebx
+	jne  .dr1
+	or   dl, 1
+.dr1:
+	mov  ebx, DR1
+	cmp  eax, ebx
+	jne  .dr2
+	or   dl, 2
+.dr2:
+	mov  ebx, DR2
+	cmp  eax, ebx
+	jne  .dr3
+	or   dl, 4
+.dr3:
+	mov  ebx, DR3
+	cmp  eax, ebx
+	jne  .out
+	or   dl, 8
+.out:
+	and  dl, byte [cs:hw_bp_exec]
+	pop  ebx
 	ret
 
 ; --------------------------------
@@ -988,6 +3041,169 @@ saved_insn:
 %endif
 
 
+; Features enabled by the bridge (MSG_HELLO)
+features:
+	dw 0
+
+; CRC32 lookup table, one entry per nibble
+crc32_table:
+	dd 0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9
+	dd 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005
+	dd 0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61
+	dd 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD
+
+; Memory range commands (MSG_SEARCH_MEM/MSG_CRC32)
+; parameters
+range_params:
+range_addr:
+	dd 0
+range_len:
+	dd 0
+search_pat_len:
+	db 0
+search_pattern:
+	times SEARCH_MAX_PAT db 0
+
+; Range step: range [start, end) and whether we are
+; range stepping or not
+step_range:
+step_start:
+	dd 0
+step_end:
+	dd 0
+range_stepping:
+	db 0
+
+; Instruction trace: MSG_TRACE parameters, the current
+; flags and where the buffer is
+trace_params:
+trace_addr:
+	dd 0
+trace_size:
+	dw 0
+trace_flags:
+	db 0
+trace_on:
+	db 0
+trace_first:
+	db 0
+trace_seg:
+	dw 0
+trace_start:
+	dw 0
+trace_pos:
+	dw 0
+trace_end:
+	dw 0
+
+; Conditional breakpoints: bytecode, evaluation stack
+; and whether we are stepping over a breakpoint (and
+; if we were single-stepping before)
+cond_len:
+	db 0
+cond_code:
+	times COND_MAX_CODE db 0
+cond_stack:
+	times COND_MAX_STACK dd 0
+cond_skip:
+	db 0
+cond_tf:
+	db 0
+
+; push_regs offset of each register, in GDB order
+cond_regs:
+	db EAX_OFF, ECX_OFF, EDX_OFF, EBX_OFF
+	db ESP_OFF, EBP_OFF, ESI_OFF, EDI_OFF
+	db EIP_OFF, EFLAGS_OFF, CS_OFF, SS_OFF
+	db DS_OFF,  ES_OFF,  FS_OFF, GS_OFF
+
+; Serial speed: MSG_BAUD parameter and the current
+; divisor
+baud_rate:
+	dd 0
+uart_divisor:
+	dw UART_DIVISOR
+
+; Framed mode: whether it is enabled, the frame being
+; sent (and its answer), the frame being received and
+; the last one received (frame_rx_buf), being handled
+framed:
+	db 0
+frame_tx_seq:
+	db 0
+frame_tx_len:
+	db 0
+frame_tx_buf:
+	times FRAME_MAX db 0
+frame_acked:
+	db FRAME_WAITING
+frame_rx_state:
+	db FRAME_RX_IDLE
+frame_rx_seq:
+	db 0
+frame_rx_hseq:
+	db 0
+frame_rx_len:
+	db 0
+frame_rx_idx:
+	db 0
+frame_rx_store:
+	db 0
+frame_rx_crc:
+	dw 0
+frame_rx_crc_lo:
+	db 0
+frame_rx_quiet:
+	dd 0
+frame_rx_pos:
+	db 0
+frame_rx_avail:
+	db 0
+frame_rx_buf:
+	times FRAME_MAX db 0
+
+; UART FIFOs: transmitter FIFO size (1 if there is none)
+; and how many bytes can still be written to it without
+; checking the LSR
+uart_fifo_size:
+	db 1
+uart_tx_room:
+	db 0
+
+; Hardware breakpoints: MSG_ADD_HW_BP/MSG_REM_HW_BP
+; parameters, the slots in use and which of them are
+; insn breakpoints (bit n = DRn)
+hw_bp_params:
+hw_bp_slot:
+	db 0
+hw_bp_ctl:
+	db 0
+hw_bp_addr:
+	dd 0
+hw_bp_used:
+	db 0
+hw_bp_exec:
+	db 0
+
+; Software breakpoints: MSG_SW_BP parameters
+swbp_params:
+swbp_addr:
+	dd 0
+swbp_byte:
+	db 0
+
+; Delta stop: registers sent in the last stop, and
+; whether the next one should send all of them
+prev_regs:
+	times (EFLAGS_OFF+2) db 0
+delta_full:
+	db 1
+
+; RLE-compressed write: remaining bytes of the current
+; literal/repeated block
+rle_count:
+	db 0
+
 ; State machine
 state:
 	db STATE_DEFAULT
@@ -24,10 +24,16 @@
 
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "ax.h"
+#include "cache.h"
+#include "capture.h"
 #include "net.h"
+#include "protocol.h"
 #include "util.h"
 
 #ifdef VERBOSE
@@ -41,44 +47,340 @@
 static int gdb_fd;
 static int serial_fd;
 
+/*
+ * Max packet size advertised to GDB (qSupported).
+ *
+ * The command buffer grows as needed, and both memory
+ * reads and writes are split into smaller serial commands,
+ * so this is only limited by how much we want GDB to ask
+ * at once.
+ */
+#define GDB_PACKET_SIZE 0x40000
+
+/* If the ack ('+') of every packet should be skipped. */
+static int gdb_no_ack;
+
 /* GDB handle states. */
 #define GDB_STATE_START   0x1
 #define GDB_STATE_CMD     0x2
 #define GDB_STATE_CSUM_D1 0x4
 #define GDB_STATE_CSUM_D2 0x8
 
-/* Serial handle states. */
-#define SERIAL_STATE_START         0x10
-#define SERIAL_STATE_ADD_SW_BREAK  0xA8
-#define SERIAL_STATE_REM_SW_BREAK  0xB8
-#define SERIAL_STATE_SS            0xC8
-#define SERIAL_STATE_READ_MEM_CMD  0xD8
-#define SERIAL_STATE_CONTINUE      0xE8
-#define SERIAL_STATE_WRITE_MEM_CMD 0xF8
-#define SERIAL_STATE_REG_WRITE     0xA7
-#define SERIAL_STATE_ADD_HW_WATCH  0xB7
-#define SERIAL_STATE_REM_HW_WATCH  0xC7
-#define SERIAL_MSG_OK              0x04
-
-/* Watch types. */
+/*
+ * Serial handle states: besides the start, the message
+ * being received (MSG_*, see protocol.h).
+ */
+#define SERIAL_STATE_START 0x10
+
+/*
+ * Target capabilities.
+ *
+ * At the first stop, the bridge sends the features it
+ * wants to use, and the target replies with all the
+ * capabilities it has.
+ */
+#define BRIDGE_CAPS  \
+	(CAP_RLE|CAP_EXPEDITE|CAP_SEARCH|CAP_CRC32|CAP_DELTA_STOP|\
+	 CAP_RANGE_STEP|CAP_TRACE|CAP_COND|CAP_SW_BP|CAP_HW_BP|CAP_BAUD|\
+	 CAP_FRAMED)
+static int hello_sent;
+static int link_pending; /* Hello replied, negotiations to do. */
+static int link_ready;   /* Hello replied, negotiations done.  */
+static uint16_t target_caps;
+
+/*
+ * Serial speed negotiation
+ *
+ * After the capabilities, the bridge asks the target for
+ * the higher speeds, up to serial_baud, and both switch
+ * if the target UART clock allows it. The new speed is
+ * then checked with a probe, and if it does not come
+ * back, both go back to SERIAL_DEFAULT_BAUD.
+ */
+#define BAUD_REPLY_MS   1000 /* Target reply, old speed.     */
+#define BAUD_PROBE_MS   200  /* Probe reply, new speed.      */
+#define BAUD_REVERT_MS  1500 /* Target gives up the new one. */
+static int serial_baud;
+
+/*
+ * Framed mode
+ *
+ * If enabled (and supported by the target), after the
+ * capabilities (and speed), everything sent to/received
+ * from the target goes inside frames with length, seq and
+ * CRC-16, acked by the other side and sent again if not.
+ * See 'Framed mode' in constants.inc.
+ */
+#define FRAME_REPLY_MS  1000 /* MSG_FRAMED reply.           */
+#define FRAME_ACK_MS    300  /* Ack, before sending again.  */
+#define FRAME_TRIES     40   /* Sends, before giving up.    */
+#define FRAME_PENDING   0x10000
+#define FRAME_RX_IDLE   0
+#define FRAME_RX_LEN    1
+#define FRAME_RX_SEQ    2
+#define FRAME_RX_DATA   3
+#define FRAME_RX_CRC1   4
+#define FRAME_RX_CRC2   5
+#define FRAME_WAITING   0
+#define FRAME_GOT_ACK   1
+#define FRAME_GOT_NAK   2
+static int frame_wanted;
+static struct frame_state
+{
+	int on;
+	int flushing;
+
+	/* Frame being written, and its ack. */
+	uint8_t tx_buff[FRAME_MAX];
+	size_t  tx_len;
+	uint8_t tx_seq;
+	int     acked;
+
+	/* Frame being received: length and seq, data and CRC. */
+	int      rx_state;
+	uint8_t  rx_hdr[2];
+	uint8_t  rx_buff[FRAME_MAX];
+	size_t   rx_idx;
+	uint16_t rx_crc;
+	uint8_t  rx_seq;
+	uint64_t rx_last;
+
+	/* Data received, not handled yet. */
+	uint8_t pending[FRAME_PENDING];
+	size_t  pending_len;
+} frame;
+static void serial_flush(void);
+
+/* Watch types (and insn breakpoint), as in DR7 R/W. */
+#define HW_BP_EXEC      0x00
 #define HW_WATCH_WRITE  0x01
 #define HW_WATCH_ACCESS 0x03
 
-/* Stop reasons. */
-#define STOP_REASON_NORMAL      10
-#define STOP_REASON_WATCHPOINT  20
+/*
+ * Instruction trace: the target saves the CS:IP (and
+ * optionally FLAGS) of each executed instruction in a
+ * buffer in its memory, and sends it in bulk, which
+ * we write to the trace file.
+ *
+ * The buffer overwrites whatever was there, so there is
+ * no default address: only the user knows which memory
+ * is free.
+ */
+#define TRACE_DEFAULT_SIZE 0x8000
+#define TRACE_MAX_SIZE     0xFFF0
+#define TRACE_MEM_LIMIT    0x100000
+static const char *trace_path = "trace.txt";
+static FILE *trace_file;
 
 /* The registers are cached, so this flag signals
  * if the cache is updated or not. */
 static int have_x86_regs = 0;
 
-/* Memory dump helpers. */
-static uint8_t *dump_buffer;
+/*
+ * Memory dump helpers.
+ *
+ * Memory reads are split into serial sub-requests of up to
+ * READ_CHUNK_SIZE bytes, with up to READ_PIPELINE of them
+ * in-flight, so that the target always has the next request
+ * waiting while it sends the current one. The 'last_dump'
+ * variables refer to the sub-request being received.
+ */
+#define READ_CHUNK_SIZE 0x800
+#define READ_PIPELINE   2
+static uint8_t  dump_buffer[READ_CHUNK_SIZE];
 static uint32_t last_dump_phys_addr;
 static uint16_t last_dump_amnt;
 
-/* Breakpoint cache. */
-static uint32_t breakpoint_insn_addr;
+/* Memory writes are split in commands of up to this size. */
+#define WRITE_CHUNK_SIZE 0x8000
+
+/*
+ * Serial 'OK's that should not be forwarded to GDB, i.e:
+ * from all but the last command of a split write.
+ */
+static int serial_ok_skip;
+
+/*
+ * Serial read sub-requests: the in-flight ones, in the
+ * order they were sent, and the range yet to be requested.
+ */
+static struct read_fetch
+{
+	uint32_t addr[READ_PIPELINE];
+	uint16_t amnt[READ_PIPELINE];
+	int      stale[READ_PIPELINE];
+	int      head;
+	int      count;
+	uint32_t next;
+	uint32_t end;
+} read_fetch;
+
+/*
+ * Memory read reply being streamed to GDB: the reply starts
+ * as soon as the first requested bytes are available, and
+ * goes on as the remaining ones arrive.
+ */
+static struct gdb_read
+{
+	int      active;
+	int      started;
+	int      csum;
+	uint32_t addr;
+	uint32_t end;
+} gdb_read;
+
+/*
+ * Memory search done by the bridge, over the memory read
+ * into the cache, when the pattern is too long for the
+ * target, see handle_gdb_search_memory(). Any pattern that
+ * fits in a GDB packet fits here.
+ */
+static struct gdb_search
+{
+	int      active;
+	uint32_t addr;
+	uint32_t end;
+	uint8_t  pattern[GDB_PACKET_SIZE];
+	size_t   pat_len;
+} gdb_search;
+
+/* What to XOR to the CRC32 calculated by the target. */
+static uint32_t crc_fix;
+
+/*
+ * Adaptive read-ahead
+ *
+ * The window grows (up to READ_AHEAD_MAX) while GDB keeps
+ * reading forward, and shrinks back (down to a single
+ * page) whenever a non-sequential read happens.
+ */
+#define READ_AHEAD_MIN  CACHE_PAGE_SIZE
+#define READ_AHEAD_MAX  (32 * 1024)
+#define REAL_MODE_LIMIT 0x10FFF0
+static uint32_t read_ahead_win = READ_AHEAD_MIN;
+static uint32_t read_ahead_addr;
+static uint32_t read_ahead_next;
+
+/*
+ * Physical memory regions, in real mode
+ *
+ * Only RAM is read beyond what GDB asked for (rounded to
+ * pages and read-ahead), and never past the end of the
+ * region being read: video memory, ROMs and the holes
+ * between them are read exactly as requested.
+ */
+static const struct mem_region
+{
+	uint32_t start;
+	uint32_t end;
+	int      ram;
+} mem_regions[] = {
+	{0x00000,  0xA0000,         1}, /* Conventional memory. */
+	{0xA0000,  0xC0000,         0}, /* Video memory.        */
+	{0xC0000,  0x100000,        0}, /* Option ROMs and BIOS. */
+	{0x100000, REAL_MODE_LIMIT, 1}, /* HMA.                 */
+};
+
+/*
+ * Command stats (see 'monitor stats')
+ *
+ * For each command below: how many, the bytes from/to GDB
+ * and to/from the target, and how long from the command
+ * to its reply, in total and on the serial link (from the
+ * first byte sent to the target to the last one received),
+ * plus a histogram of the total, in log2 buckets of us.
+ */
+#define STATS_BUCKETS 24
+static const char stats_cmds[] = "mMXscvZzP";
+static struct cmd_stats
+{
+	uint64_t count;
+	uint64_t gdb_in;
+	uint64_t gdb_out;
+	uint64_t serial_out;
+	uint64_t serial_in;
+	uint64_t total_ns;
+	uint64_t serial_ns;
+	uint64_t max_ns;
+	uint64_t hist[STATS_BUCKETS];
+} cmd_stats[sizeof(stats_cmds) - 1];
+
+/* Command waiting for its reply, and the time GDB takes between them. */
+static struct stats_cur
+{
+	struct cmd_stats *cs;
+	uint64_t start;
+	uint64_t serial_start;
+	uint64_t serial_end;
+	uint64_t gdb_out;
+	uint64_t serial_out;
+	uint64_t serial_in;
+} stats_cur;
+static uint64_t stats_last_reply;
+static uint64_t stats_gdb_ns;
+static uint64_t stats_gdb_count;
+
+/*
+ * Hardware breakpoints
+ *
+ * The debug registers DR0-DR3 are allocated here, each
+ * slot with its own type and length. Watchpoints may
+ * need more than one slot, since each one only covers
+ * 1, 2 or 4 aligned bytes. The conditions (if any) are
+ * always for the DR0 insn breakpoint.
+ *
+ * Targets without CAP_HW_BP only have DR0 for insn
+ * breakpoints and DR2 for a 4-byte watchpoint.
+ */
+#define HW_BP_SLOTS 4
+static struct hw_breakpoint
+{
+	int      used;
+	uint8_t  type;     /* HW_BP_EXEC or HW_WATCH_*.      */
+	uint8_t  len;      /* Slot length: 1, 2 or 4 bytes.  */
+	uint32_t addr;     /* Slot address.                  */
+	uint32_t gdb_addr; /* Address and length asked by    */
+	uint32_t gdb_len;  /* GDB, might span multiple slots. */
+} hw_bps[HW_BP_SLOTS];
+
+/* If the target has a condition for the insn breakpoint. */
+static int breakpoint_has_cond;
+
+/*
+ * Software breakpoints
+ *
+ * Breakpoints in RAM are int3 instructions written over the
+ * original code, so there is no limit on how many of them we
+ * may have (besides our table). The original bytes are kept
+ * here, so that GDB never sees the int3 when reading memory.
+ *
+ * Since only the target knows if the memory is RAM or not,
+ * inserting a breakpoint is asynchronous: the target reads
+ * the byte back, and if the int3 is not there, the hardware
+ * breakpoint (DR0) is used instead.
+ */
+#define SW_BP_MAX 64
+static struct sw_breakpoint
+{
+	uint32_t addr;
+	uint8_t  orig;
+} sw_bps[SW_BP_MAX];
+static int sw_bp_count;
+
+/* Breakpoint being inserted/removed, waiting the target reply. */
+static struct sw_bp_pending
+{
+	int      insert;
+	int      quiet;
+	uint32_t addr;
+} sw_bp_pending;
+
+/* Swap replies to be ignored, see sw_bp_swap_range(). */
+static int sw_bp_swaps;
+
+/* If GDB supports the 'swbreak'/'hwbreak' stop reasons. */
+static int gdb_swbreak;
+static int gdb_hwbreak;
 
 /**
  * Mini-buffr to hold different byte-sized values
@@ -130,6 +432,8 @@ union x86_stop_data
 		struct   srm_x86_regs x86_regs;
 		uint8_t  stop_reason;
 		uint32_t stop_addr;
+		uint8_t  code[EXPEDITE_SIZE];  /* Only if expedited. */
+		uint8_t  stack[EXPEDITE_SIZE]; /* Only if expedited. */
 #ifndef UART_POLLING
 		uint8_t  saved_insns[4];
 #endif
@@ -177,1091 +481,4006 @@ static union ux86_regs
 } x86_regs;
 
 /* ------------------------------------------------------------------*
- * GDB commands                                                      *
+ * Command stats                                                     *
  * ------------------------------------------------------------------*/
 
 /**
- * @brief Send a GDB command/packet in the format:
- * $data#NN, where NN is the checksum modulo 256.
- *
- * All GDB commands follows the same structure.
- *
- * @param buff Buffer containing the data to be
- * sent.
- * @param len Buffer length.
- *
- * @return Returns 0 if success, -1 otherwise.
+ * @brief Returns the current monotonic time, in ns.
  */
-static ssize_t send_gdb_cmd(const char *buff, size_t len)
+static uint64_t stats_now(void)
 {
-	size_t i;
-	int csum;
-	ssize_t ret;
-	char csum_str[3];
-
-	/* Calculate checksum. */
-	for (i = 0, csum = 0; i < len; i++)
-		csum += buff[i];
-	csum &= 0xFF;
-
-	send_all(gdb_fd, "$", 1);
-	send_all(gdb_fd, buff, len);
-	send_all(gdb_fd, "#", 1);
-	snprintf(csum_str, 3, "%02x", csum);
-	ret = send_all(gdb_fd, csum_str, 2);
-
-	if (ret < 0)
-		errx("Unable to send command to GDB!\n");
-
-	return (0);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
 }
 
 /**
- * @brief Send the halt reason to GDB.
+ * @brief Starts timing the GDB command @p cmd, if it is
+ * one of the stats_cmds.
+ *
+ * @param cmd Command (first char of the packet).
+ * @param len Packet length.
  */
-static inline void send_gdb_halt_reason(void)
+static void stats_cmd_start(char cmd, size_t len)
 {
-	char buf[32] = {0};
+	const char *c;
+	uint64_t now;
 
-	/* Instruction hw bp, Ctrl+C, or initial break. */
-	if (x86_stop_data.d.stop_reason == STOP_REASON_NORMAL)
+	now = stats_now();
+	if (stats_last_reply)
 	{
-		send_gdb_cmd("S05", 3);
-		return;
+		stats_gdb_ns += now - stats_last_reply;
+		stats_gdb_count++;
+		stats_last_reply = 0;
 	}
 
-	/*
-	 * Hardware watchpoint
-	 * GDB requires another type of message, that tells
-	 * the stop reason and address.
-	 */
-	snprintf(buf, sizeof buf - 1, "T05watch:%08x;",
-		x86_stop_data.d.stop_addr);
-
-	send_gdb_cmd(buf, strlen(buf));
-}
+	memset(&stats_cur, 0, sizeof stats_cur);
+	c = cmd ? strchr(stats_cmds, cmd) : NULL;
+	if (!c)
+		return;
 
-/**
- * @brief Acks a previous message/packet sent from GDB
- */
-static inline void send_gdb_ack(void) {
-	send_all(gdb_fd, "+", 1);
+	stats_cur.cs     = &cmd_stats[c - stats_cmds];
+	stats_cur.start  = now;
+	stats_cur.cs->gdb_in += len;
 }
 
 /**
- * @brief Tells GDB that we do not support the
- * receive message/packet.
+ * @brief Accounts @p len bytes sent to the target, for
+ * the command being timed.
+ *
+ * @param len Amount of bytes.
  */
-static inline void send_gdb_unsupported_msg(void) {
-	send_gdb_cmd(NULL, 0);
+static inline void stats_serial_out(size_t len)
+{
+	if (!stats_cur.cs)
+		return;
+	if (!stats_cur.serial_start)
+		stats_cur.serial_start = stats_now();
+	stats_cur.serial_out += len;
 }
 
 /**
- * @brief Confirms that the previous command was
- * successfully executed.
+ * @brief Accounts @p len bytes received from the target,
+ * for the command being timed.
  *
- * The 'OK' command is generally sent by the serial,
- * and then forwarded to GDB, as the serial device is
- * the only one that knows if the command succeeded
- * or not.
+ * @param len Amount of bytes.
  */
-static inline void send_gdb_ok(void) {
-	send_gdb_cmd("OK", 2);
+static inline void stats_serial_in(size_t len)
+{
+	if (!stats_cur.cs)
+		return;
+	stats_cur.serial_end = stats_now();
+	stats_cur.serial_in += len;
 }
 
 /**
- * @brief Tells GDB that something went wrong with
- * the latest command.
+ * @brief Finishes the command being timed, as its reply
+ * was just sent to GDB.
  */
-static inline void send_gdb_error(void) {
-	send_gdb_cmd("E00", 3);
-}
+static void stats_cmd_end(void)
+{
+	struct cmd_stats *cs;
+	uint64_t now, ns, us;
+	int b;
 
-/**
- * @brief Sends a 'Ctrl+C' to the serial device.
- */
-static void send_serial_ctrlc(void) {
-	send_serial_byte(3);
-}
+	now = stats_now();
+	stats_last_reply = now;
 
-/* ------------------------------------------------------------------*
- * Misc                                                              *
- * ------------------------------------------------------------------*/
+	cs = stats_cur.cs;
+	if (!cs)
+		return;
+
+	ns = now - stats_cur.start;
+	for (b = 0, us = ns / 1000; us > 1 && b < STATS_BUCKETS - 1; us >>= 1)
+		b++;
+
+	cs->count++;
+	cs->hist[b]++;
+	cs->total_ns   += ns;
+	cs->max_ns      = MAX(cs->max_ns, ns);
+	cs->gdb_out    += stats_cur.gdb_out + 4; /* $, #NN. */
+	cs->serial_out += stats_cur.serial_out;
+	cs->serial_in  += stats_cur.serial_in;
+	if (stats_cur.serial_end > stats_cur.serial_start)
+		cs->serial_ns += stats_cur.serial_end - stats_cur.serial_start;
+
+	stats_cur.cs = NULL;
+}
 
 /**
- * Read all registers (already in cache), encodes
- * them to hex and returns it.
+ * @brief Returns the upper bound (us) of the histogram
+ * bucket where the @p q (0-100) percentile of @p cs is,
+ * clamped to the max time seen.
  *
- * @return Returns all the registers hex-encoded.
+ * @param cs Command stats.
+ * @param q Percentile.
+ *
+ * @return Returns the percentile, in us.
  */
-static char *read_registers(void)
+static uint64_t stats_percentile(const struct cmd_stats *cs, int q)
 {
-	char *buff;
-
-#ifdef MOCK_REGISTERS
-	int i;
+	uint64_t acc, want;
+	int b;
 
-	for (i = 0; i < MAX_REGS; i++)
+	want = (cs->count * q + 99) / 100;
+	for (b = 0, acc = 0; b < STATS_BUCKETS - 1; b++)
 	{
-		if (i & 1)
-			x86_regs.r32[i] = 0xabcdefAB;
-		else
-			x86_regs.r32[i] = 0x12345678;
+		acc += cs->hist[b];
+		if (acc >= want)
+			break;
 	}
-
-	/* Some 'sane' data. */
-	x86_regs.r.cs  = 0x0;
-	x86_regs.r.ds  = 0x100;
-	x86_regs.r.es  = 0x100;
-	x86_regs.r.fs  = 0x100;
-	x86_regs.r.gs  = 0x100;
-	x86_regs.r.eip = 0x7c00;
-#else
-	if (!have_x86_regs)
-		errx("Error! registers are not available!\n");
-#endif
-
-	buff = encode_hex((const char*)x86_regs.r8,
-		sizeof (struct sx86_regs));
-	return (buff);
+	return (MIN(2ull << b, cs->max_ns / 1000));
 }
 
-#ifdef USE_MOCKS
 /**
- * @brief Reads from a 'fake' memory (filled with NOPs)
- * and returns it.
- *
- * @param len Desired memory size.
+ * @brief Prints the stats, one line at a time, with
+ * @p print.
  *
- * @return Returns the fake memory.
+ * @param print Line printer.
  */
-static char *read_mock_memory(size_t len)
+static void stats_print(void (*print)(const char *line))
 {
-	char *buff, *buff1;
+	const struct cmd_stats *cs;
+	struct net_stats ns;
+	char line[256]; /* Fits 11 full 64-bit numbers. */
+	size_t i, len;
+	int b;
 
-	if ((buff = malloc(len)) == NULL)
-		errx("Unable to allocate %zd bytes!\n", len);
+	print("cmd   count   avg_us   p50_us   p99_us   max_us  serial_us"
+		"   gdb_in  gdb_out  ser_out   ser_in\n");
 
-	for (size_t i = 0; i < len; i++)
-		buff[i] = 0x90;
+	for (i = 0; i < sizeof(stats_cmds) - 1; i++)
+	{
+		cs = &cmd_stats[i];
+		if (!cs->count)
+			continue;
+
+		snprintf(line, sizeof line,
+			"%c   %7llu %8llu %8llu %8llu %8llu %10llu %8llu %8llu %8llu %8llu\n",
+			stats_cmds[i],
+			(unsigned long long)cs->count,
+			(unsigned long long)(cs->total_ns  / cs->count / 1000),
+			(unsigned long long)stats_percentile(cs, 50),
+			(unsigned long long)stats_percentile(cs, 99),
+			(unsigned long long)(cs->max_ns / 1000),
+			(unsigned long long)(cs->serial_ns / cs->count / 1000),
+			(unsigned long long)cs->gdb_in,
+			(unsigned long long)cs->gdb_out,
+			(unsigned long long)cs->serial_out,
+			(unsigned long long)cs->serial_in);
+		print(line);
+	}
 
-	buff1 = encode_hex(buff, len);
-	free(buff);
+	/* Histograms: <upper bound us>:<count>, non-empty buckets only. */
+	for (i = 0; i < sizeof(stats_cmds) - 1; i++)
+	{
+		cs  = &cmd_stats[i];
+		len = 0;
+		for (b = 0; b < STATS_BUCKETS; b++)
+		{
+			if (!cs->hist[b])
+				continue;
+
+			if (!len)
+				len = snprintf(line, sizeof line, "%c  ", stats_cmds[i]);
+
+			len += snprintf(line + len, sizeof line - len, " %llu:%llu",
+				2ull << b, (unsigned long long)cs->hist[b]);
+
+			/* Room for another " <20 digits>:<20 digits>\n". */
+			if (len > sizeof(line) - 48)
+			{
+				strcat(line, "\n");
+				print(line);
+				len = snprintf(line, sizeof line, "%c  ", stats_cmds[i]);
+			}
+		}
+		if (len > 3)
+		{
+			strcat(line, "\n");
+			print(line);
+		}
+	}
 
-	return (buff1);
+	get_net_stats(&ns);
+	snprintf(line, sizeof line,
+		"gdb: %llu us between replies and commands (%llu), "
+		"net: %llu sends, %llu writes\n",
+		(unsigned long long)(stats_gdb_ns / 1000),
+		(unsigned long long)stats_gdb_count,
+		(unsigned long long)ns.sends, (unsigned long long)ns.writes);
+	print(line);
 }
-#endif
-
-/* ------------------------------------------------------------------*
- * GDB handlers                                                      *
- * ------------------------------------------------------------------*/
 
 /**
- * @brief Handles the single-step command from
- * GDB.
+ * @brief Clears the stats.
  */
-static void handle_gdb_single_step(void)
+static void stats_reset(void)
 {
-	/* For mock, just send the we're already halted =). */
-#ifdef USE_MOCKS
-	send_gdb_halt_reason();
-#else
-	/* Send to our serial-line that we want a single-step. */
-	send_serial_byte(SERIAL_STATE_SS);
-	have_x86_regs = 0;
-#endif
+	memset(cmd_stats, 0, sizeof cmd_stats);
+	stats_gdb_ns    = 0;
+	stats_gdb_count = 0;
 }
 
 /**
- * @brief Sends the continue to the serial device.
+ * @brief Prints a stats line to stderr.
+ * @param line Line to be printed.
  */
-static void send_gdb_continue(void)
+static void stats_print_stderr(const char *line)
 {
-	have_x86_regs = 0;
-	send_serial_byte(SERIAL_STATE_CONTINUE);
+	fputs(line, stderr);
 }
 
 /**
- * @brief Handles the 'continue' command from GDB.
+ * @brief Dumps the stats summary at exit.
  */
-static void handle_gdb_continue(void) {
-	/* Send to our serial-line that we want to continue. */
-	send_gdb_continue();
+static void stats_dump(void) {
+	stats_print(stats_print_stderr);
 }
 
 /**
- * @brief Handles the 'halt reason (?)' command from GDB.
+ * @brief Makes the stats summary be dumped at exit,
+ * registered only once, whatever the amount of calls.
  */
-static void handle_gdb_halt_reason(void) {
-	send_gdb_halt_reason();
+void set_stats_dump(void)
+{
+	static int registered;
+	if (registered)
+		return;
+	registered = 1;
+	atexit(stats_dump);
 }
 
+/* ------------------------------------------------------------------*
+ * Framed mode                                                       *
+ * ------------------------------------------------------------------*/
+
 /**
- * @brief Handle he 'read registers (g)' command from GDB.
+ * @brief Sends an ack frame for the frame @p seq, or a
+ * nak, if @p seq has FRAME_NAK.
+ *
+ * @param seq Seq to be acked.
  */
-static void handle_gdb_read_registers(void) {
-	send_gdb_cmd(read_registers(), 128);
+static void frame_send_ack(uint8_t seq)
+{
+	uint8_t ack[5];
+	uint16_t crc;
+
+	ack[0] = FRAME_SOF;
+	ack[1] = 0;
+	ack[2] = seq;
+	crc    = crc16_update(CRC16_INIT, ack + 1, 2);
+	ack[3] = crc & 0xFF;
+	ack[4] = crc >> 8;
+	send_buffered(serial_fd, ack, sizeof ack);
 }
 
 /**
- * @brief Handles the 'read memory (m)' command from GDB.
- *
- * @param Message buffer to be parsed.
- * @param Buffer length.
- *
- * @return Returns 0 if the request is valid, -1 otherwise.
- *
- * @note Please note that the actual memory read is
- * done by the serial device. This routine only parses
- * the command and forward the request to the serial
- * device.
+ * @brief Handles a frame just received: acks/naks are
+ * saved for frame_send(), and the data of new frames is
+ * saved to be handled by the serial state machine.
  */
-static int handle_gdb_read_memory(const char *buff, size_t len)
+static void frame_rx_done(void)
 {
-	const char *ptr;
-	uint32_t addr, amnt;
+	uint8_t len, seq;
+	uint16_t crc;
 
-	ptr = buff;
+	len = frame.rx_hdr[0];
+	seq = frame.rx_hdr[1];
 
-	/* Skip first 'm'. */
-	expect_char('m', ptr, len);
-	addr = read_int(ptr, &len, &ptr, 16);
-	expect_char(',', ptr, len);
+	crc = crc16_update(CRC16_INIT, frame.rx_hdr, 2);
+	crc = crc16_update(crc, frame.rx_buff, len);
+	if (crc != frame.rx_crc)
+	{
+		LOG_CMD_REC("Frame with bad CRC, asking again\n");
+		frame_send_ack(frame.rx_seq | FRAME_NAK);
+		return;
+	}
 
-	/* Get amount. */
-	amnt = simple_read_int(ptr, len, 16);
+	/* Ack/nak of our frame. */
+	if (!len)
+	{
+		if (seq & FRAME_NAK)
+			frame.acked = FRAME_GOT_NAK;
+		else if (seq == frame.tx_seq)
+			frame.acked = FRAME_GOT_ACK;
+		return;
+	}
 
-	/*
-	 * The addresses asked by GDB are already physical,
-	 * since we convert them at handle_serial_single_step_stop()
-	 */
+	if (seq != frame.rx_seq)
+	{
+		/* Repeated, our ack got lost. */
+		if (((seq + 1) & FRAME_SEQ_MASK) == frame.rx_seq)
+			frame_send_ack(seq);
+		return;
+	}
 
-	last_dump_phys_addr = addr;
-	last_dump_amnt = amnt;
+	/* No room, the target sends it again later. */
+	if (frame.pending_len + len > sizeof frame.pending)
+		return;
 
-#ifndef USE_MOCKS
-	/* Already prepare our buffer. */
-	dump_buffer = malloc(amnt);
-	if (!dump_buffer)
-		errx("Unable to alloc %d bytes!\n", amnt);
+	frame_send_ack(seq);
+	memcpy(frame.pending + frame.pending_len, frame.rx_buff, len);
+	frame.pending_len += len;
+	frame.rx_seq = (seq + 1) & FRAME_SEQ_MASK;
+}
 
-	/*
-	 * Asks the serial device to send its memory
-	 *
-	 * Our 'protocol', is as follows:
-	 *
-	 * 0xD8 <address-4-bytes-LE> <size-2-bytes-LE>
-	 *  ^--- read memory command, 1-byte
-	 */
-	send_serial_byte(SERIAL_STATE_READ_MEM_CMD);
-	send_serial_dword(addr);
-	send_serial_word(amnt);
+/**
+ * @brief Handles a byte received in framed mode.
+ *
+ * @param c Byte received.
+ */
+static void frame_rx_byte(uint8_t c)
+{
+	switch (frame.rx_state) {
+	case FRAME_RX_IDLE:
+		if (c == FRAME_SOF)
+			frame.rx_state = FRAME_RX_LEN;
+		break;
+	case FRAME_RX_LEN:
+		frame.rx_hdr[0] = c;
+		frame.rx_idx    = 0;
+		frame.rx_state  = (c <= FRAME_MAX) ? FRAME_RX_SEQ : FRAME_RX_IDLE;
+		break;
+	case FRAME_RX_SEQ:
+		frame.rx_hdr[1] = c;
+		frame.rx_state  = frame.rx_hdr[0] ? FRAME_RX_DATA : FRAME_RX_CRC1;
+		break;
+	case FRAME_RX_DATA:
+		frame.rx_buff[frame.rx_idx++] = c;
+		if (frame.rx_idx == frame.rx_hdr[0])
+			frame.rx_state = FRAME_RX_CRC1;
+		break;
+	case FRAME_RX_CRC1:
+		frame.rx_crc   = c;
+		frame.rx_state = FRAME_RX_CRC2;
+		break;
+	case FRAME_RX_CRC2:
+		frame.rx_crc  |= c << 8;
+		frame.rx_state = FRAME_RX_IDLE;
+		frame_rx_done();
+		break;
+	}
+}
 
-	/*
-	 * For serial, we do not answer immediately, instead,
-	 * we wait for the serial answer, and only then,
-	 * reply with the memory.
-	 *
-	 * For mocks, we answer immediately.
-	 */
-#endif
+/**
+ * @brief Handles the @p len bytes in @p buf, received in
+ * framed mode.
+ *
+ * There is no byte stuffing, so a frame whose length got
+ * corrupted would swallow the next ones: if the rest of
+ * a frame does not come within FRAME_GAP_MS, it is dropped
+ * and the next SOF is looked for.
+ *
+ * @param buf Bytes received.
+ * @param len Amount of bytes.
+ */
+static void frame_rx(const uint8_t *buf, size_t len)
+{
+	uint64_t now;
+	size_t i;
 
-#ifdef USE_MOCKS
-	ptr = read_mock_memory(len);
-	send_gdb_cmd(ptr, len * 2);
-#endif
+	now = stats_now();
+	if (frame.rx_state != FRAME_RX_IDLE &&
+		now - frame.rx_last > FRAME_GAP_MS * 1000000ull)
+	{
+		LOG_CMD_REC("Incomplete frame, dropped\n");
+		frame.rx_state = FRAME_RX_IDLE;
+	}
+	frame.rx_last = now;
 
-	return (0);
+	for (i = 0; i < len; i++)
+		frame_rx_byte(buf[i]);
 }
 
 /**
- * @brief Handles the 'write memory (M)' command from GDB.
- *
- * @param Message buffer to be parsed.
- * @param Buffer length.
- *
- * @return Returns 0 if the request is valid, -1 otherwise.
+ * @brief Sends the frame written so far and waits for its
+ * ack, sending it again if it does not come.
  *
- * @note Please note that the actual memory write is
- * done by the serial device. This routine only parses
- * the command and forward the request to the serial
- * device.
+ * Whatever the target sends meanwhile is received too, so
+ * both sides can wait for each other.
  */
-static int handle_gdb_write_memory_hex(const char *buff, size_t len)
+static void frame_send(void)
 {
-	const char *ptr, *memory;
-	uint32_t addr, amnt;
+	uint8_t buff[FRAME_MAX + 5];
+	uint8_t in[256];
+	uint16_t crc;
+	ssize_t ret;
+	size_t len;
+	int tries;
+
+	len     = frame.tx_len;
+	buff[0] = FRAME_SOF;
+	buff[1] = len;
+	buff[2] = frame.tx_seq;
+	memcpy(buff + 3, frame.tx_buff, len);
+	crc = crc16_update(CRC16_INIT, buff + 1, len + 2);
+	buff[len + 3] = crc & 0xFF;
+	buff[len + 4] = crc >> 8;
+
+	for (tries = 0; tries < FRAME_TRIES; tries++)
+	{
+		frame.acked = FRAME_WAITING;
+		send_buffered(serial_fd, buff, len + 5);
+
+		while (frame.acked == FRAME_WAITING)
+		{
+			ret = read_some(serial_fd, in, sizeof in, FRAME_ACK_MS);
+			if (ret < 0)
+				errx("Serial closed!\n");
+			if (!ret)
+				break;
+			frame_rx(in, ret);
+		}
 
-	ptr = buff;
+		if (frame.acked == FRAME_GOT_ACK)
+		{
+			frame.tx_seq = (frame.tx_seq + 1) & FRAME_SEQ_MASK;
+			frame.tx_len = 0;
+			return;
+		}
+		LOG_CMD_REC("Frame %d not acked, sending again\n", frame.tx_seq);
+	}
+	errx("Target does not ack our frames, aborting...\n");
+}
 
-	/* Skip first 'M'. */
-	expect_char('M', ptr, len);
-	addr = read_int(ptr, &len, &ptr, 16);
-	expect_char(',', ptr, len);
+/**
+ * @brief Sends @p len bytes to the serial device: right
+ * away, or in frames, if in framed mode.
+ *
+ * In framed mode, the frames are only sent when full or
+ * by serial_flush().
+ *
+ * @param buf Data to be sent.
+ * @param len Data length.
+ */
+static void send_serial(const void *buf, size_t len)
+{
+	const uint8_t *p;
+	size_t amnt;
 
-	/* Get amount. */
-	amnt = read_int(ptr, &len, &ptr, 16);
-	expect_char(':', ptr, len);
+	stats_serial_out(len);
 
-	/* If 0, just send that we support X command and quit. */
-	if (!amnt)
+	if (!frame.on)
 	{
-		send_gdb_ok();
-		return (0);
+		send_buffered(serial_fd, buf, len);
+		return;
 	}
 
-	/* Decode hex buffer to binary. */
-	memory = decode_hex(ptr, amnt);
+	for (p = buf; len; len -= amnt, p += amnt)
+	{
+		amnt = MIN(len, FRAME_MAX - frame.tx_len);
+		memcpy(frame.tx_buff + frame.tx_len, p, amnt);
+		frame.tx_len += amnt;
+		if (frame.tx_len == FRAME_MAX)
+			frame_send();
+	}
+}
 
-	/* Send to our serial device. */
-	send_serial_byte(SERIAL_STATE_WRITE_MEM_CMD);
-	send_serial_dword(addr);
-	send_serial_word(amnt);
-	send_all(serial_fd, memory, amnt);
-	return (0);
+/**
+ * @brief Framed mode: sends what was written so far in a
+ * frame of its own, without waiting for it to be full.
+ */
+static void frame_end(void)
+{
+	if (frame.on && frame.tx_len)
+		frame_send();
 }
 
+/* ------------------------------------------------------------------*
+ * Software breakpoints                                              *
+ * ------------------------------------------------------------------*/
+
 /**
- * @brief Handles the 'add breakpoint (Zn)' command from GDB.
+ * @brief Finds the software breakpoint at @p addr.
  *
- * This routine handles all kinds of breakpoints that GDB
- * might ask for, from Z0 to Z4. Please note that even
- * SW breakpoints are handled as HW breakpoints, and this
- * current implementation only supports 1 instruction
- * breakpoint and 1 hw watchpoint (whether access or write).
+ * @param addr Breakpoint physical address.
  *
- * The only kind of breakpoint that is not supported is the
- * 'Z3' or 'read watchpoint', because x86 does not supports
- * them. However, GDB is smart enough to realize that and
- * asks to use Z4 instead. When a Z4 breakpoints (emulating
- * Z3) happens, all the writes are silently ignored and GDB
- * continues to execute again.
+ * @return Returns the breakpoint index, or -1 if not found.
+ */
+static int sw_bp_find(uint32_t addr)
+{
+	int i;
+	for (i = 0; i < sw_bp_count; i++)
+		if (sw_bps[i].addr == addr)
+			return (i);
+	return (-1);
+}
+
+/**
+ * @brief Gets what should be XORed to the CRC32 of the
+ * target memory [@p addr, @p addr + @p len), with the
+ * int3s, to get the CRC32 of the original memory.
  *
- * @param Message buffer to be parsed.
- * @param Buffer length.
+ * Since the CRC32 is linear (besides its initial value),
+ * that's the CRC32, from 0, of the XOR of both memories:
+ * zeros, but where the int3s are. The zeros before the
+ * first int3 do not change a CRC32 of 0, and are skipped.
  *
- * @return Returns 0 if the request is valid, -1 otherwise.
+ * @param addr Memory physical address.
+ * @param len Memory length.
+ *
+ * @return Returns the value to be XORed.
  */
-static int handle_gdb_add_breakpoint(const char *buff, size_t len)
+static uint32_t sw_bp_crc_fix(uint32_t addr, uint32_t len)
 {
-	const char *ptr = buff;
-	uint32_t addr;
+	static uint8_t chunk[READ_CHUNK_SIZE];
+	uint32_t crc, off, start, n;
+	int i;
 
-	/* Skip 'Z0'. */
-	expect_char('Z', ptr, len);
-	expect_char_range('0', '4', ptr, len);
-	expect_char(',', ptr, len);
+	start = len;
+	for (i = 0; i < sw_bp_count; i++)
+		if (sw_bps[i].addr - addr < len)
+			start = MIN(start, sw_bps[i].addr - addr);
 
-	/* Get breakpoint address (that is already physical). */
-	addr = read_int(ptr, &len, &ptr, 16);
-	expect_char(',', ptr, len);
+	for (crc = 0, off = start; off < len; off += n)
+	{
+		n = MIN(len - off, sizeof chunk);
+		memset(chunk, 0, n);
 
-	/*
-	 * Check which type of breakpoint we have and act
-	 * accordingly.
-	 */
-	switch (buff[1]) {
-	/*
-	 * Instruction break,
-	 * Since we only support hw break anyway, 0 (sw) and
-	 * 1 (hw) will have the same meaning...
-	 */
-	case '0':
-	case '1':
-		breakpoint_insn_addr = addr;
-		send_serial_byte(SERIAL_STATE_ADD_SW_BREAK);
-		send_serial_dword(breakpoint_insn_addr);
-		break;
-	/* Write watchpoint. */
-	case '2':
-		send_serial_byte(SERIAL_STATE_ADD_HW_WATCH);
-		send_serial_byte(HW_WATCH_WRITE);
-		send_serial_dword(addr);
-		break;
-	/* Read watchpoint. */
-	case '3':
-		send_gdb_unsupported_msg();
-		break;
-	/* Access (Read/Write) watchpoint. */
-	case '4':
-		send_serial_byte(SERIAL_STATE_ADD_HW_WATCH);
-		send_serial_byte(HW_WATCH_ACCESS);
-		send_serial_dword(addr);
-		break;
-	}
+		for (i = 0; i < sw_bp_count; i++)
+			if (sw_bps[i].addr - addr - off < n)
+				chunk[sw_bps[i].addr - addr - off] =
+					INT3_OPC ^ sw_bps[i].orig;
 
-	return (0);
+		crc = crc32_update(crc, chunk, n);
+	}
+	return (crc);
 }
 
 /**
- * @brief Handles the 'remove breakpoint (zn)' command from GDB.
+ * @brief Puts the original bytes back in place of the
+ * int3 instructions, in the memory @p buff, read from
+ * the target.
  *
- * Since one breakpoint for instruction and one for data is
- * supported, the address provided in the packet is ignored.
+ * @param addr Memory physical address.
+ * @param buff Memory read.
+ * @param len Memory length.
+ */
+static void sw_bp_patch_read(uint32_t addr, uint8_t *buff, size_t len)
+{
+	int i;
+	for (i = 0; i < sw_bp_count; i++)
+		if (sw_bps[i].addr - addr < len)
+			buff[sw_bps[i].addr - addr] = sw_bps[i].orig;
+}
+
+/**
+ * @brief Keeps the int3 instructions in the memory @p data,
+ * to be written into the target, saving the new bytes as
+ * the original ones.
  *
- * @param Message buffer to be parsed.
- * @param Buffer length.
+ * @param addr Memory physical address.
+ * @param data Memory to be written.
+ * @param len Memory length.
  *
- * @return Returns 0 if the request is valid, -1 otherwise.
+ * @return Returns @p data itself, or a patched copy of it,
+ * if there is any breakpoint in the range.
  */
-static int handle_gdb_remove_breakpoint(const char *buff, size_t len)
+static const char *sw_bp_patch_write(uint32_t addr, const char *data,
+	size_t len)
 {
-	const char *ptr = buff;
+	static char buff[WRITE_CHUNK_SIZE];
+	const char *ret;
+	int i;
 
-	/* Skip 'z0'. */
-	expect_char('z', ptr, len);
-	expect_char_range('0', '4', ptr, len);
-	expect_char(',', ptr, len);
+	for (i = 0, ret = data; i < sw_bp_count; i++)
+	{
+		if (sw_bps[i].addr - addr >= len)
+			continue;
 
-	/*
-	 * Check which type of breakpoint we have and act
-	 * accordingly.
-	 *
-	 * Since we only support 1 instruction (ATM) and 1
-	 * data breakpoint, there is no need to check
-	 * address and etc...
-	 */
-	switch (buff[1]) {
-	/* Instruction break. */
-	case '0':
-	case '1':
-		breakpoint_insn_addr = 0;
-		send_serial_byte(SERIAL_STATE_REM_SW_BREAK);
-		break;
-	/* Remaining. */
-	case '2':
-	case '3':
-	case '4':
-		send_serial_byte(SERIAL_STATE_REM_HW_WATCH);
-		break;
+		if (ret == data)
+		{
+			memcpy(buff, data, len);
+			ret = buff;
+		}
+
+		sw_bps[i].orig = data[sw_bps[i].addr - addr];
+		buff[sw_bps[i].addr - addr] = (char)INT3_OPC;
 	}
 
-	return (0);
+	return (ret);
 }
 
 /**
- * @brief Handles the 'write register (P)' GDB command;
- *
- * Please note the the segment registers and EIP,EFLAGS
- * are 16-bit. An attempt to write a 32-bit value on them
- * will emit an error.
- *
- * Also note that the mapping from what we receive from
- * the serial device and the mapping expected by GDB
- * differs, so there is a need to a conversion.
+ * @brief Asks the target to replace the byte at @p addr
+ * by @p new_byte.
  *
- * @param buff Buffer to be parsed.
- * @param len Buffer length.
+ * The target replies with the old byte and what was read
+ * back, see handle_serial_state_sw_bp().
  *
- * @return Returns 0 if the command is valid, -1 otherwise.
+ * @param addr Physical address.
+ * @param new_byte New byte.
+ * @param insert 1 if inserting a breakpoint, 0 if removing.
+ * @param quiet 1 if the reply is not for GDB.
  */
-static int handle_gdb_write_register(const char *buff, size_t len)
+static void send_serial_sw_bp(uint32_t addr, uint8_t new_byte, int insert,
+	int quiet)
 {
-	uint32_t reg_num_gdb, reg_num_rm;
-	const char *ptr, *dec;
-	union minibuf value;
+	/*
+	 * Swap byte command:
+	 * 0xC2 <addr-4-bytes-LE> <byte-1-byte>
+	 */
+	send_serial_byte(MSG_SW_BP);
+	send_serial_dword(addr);
+	send_serial_byte(new_byte);
 
-	static const int gdb_to_rm[] =
-		/* EAX. */                           /* GS. */
-		   {7,6,5,4,3,2,1,0,13,15,14,12,11,10,9,8};
+	sw_bp_pending.insert = insert;
+	sw_bp_pending.quiet  = quiet;
+	sw_bp_pending.addr   = addr;
+}
 
-	ptr = buff;
+/**
+ * @brief Temporarily swaps back the original bytes of our
+ * int3s in [@p addr, @p addr + @p len), or the int3s again,
+ * around a target command that should not see them.
+ *
+ * The breakpoints do not change, so their replies are only
+ * skipped, see handle_serial_state_sw_bp().
+ *
+ * @param addr Memory physical address.
+ * @param len Memory length.
+ * @param orig If 1, swaps in the original bytes, if 0,
+ * the int3s.
+ */
+static void sw_bp_swap_range(uint32_t addr, uint32_t len, int orig)
+{
+	int i;
+	for (i = 0; i < sw_bp_count; i++)
+	{
+		if (sw_bps[i].addr - addr >= len)
+			continue;
 
-	expect_char('P', ptr, len);
-	reg_num_gdb = read_int(ptr, &len, &ptr, 16);
-	expect_char('=', ptr, len);
-	dec = decode_hex(ptr, 4);
+		send_serial_byte(MSG_SW_BP);
+		send_serial_dword(sw_bps[i].addr);
+		send_serial_byte(orig ? sw_bps[i].orig : INT3_OPC);
+		sw_bp_swaps++;
+	}
+}
 
-	memcpy(&value, dec, 4);
+/* ------------------------------------------------------------------*
+ * Hardware breakpoints                                              *
+ * ------------------------------------------------------------------*/
 
-	/* Validate register. */
-	if (reg_num_gdb >= 16)
+/**
+ * @brief Finds the hardware breakpoint slot of type @p type
+ * asked by GDB at @p addr, starting from @p slot.
+ *
+ * @param type Breakpoint type (HW_BP_EXEC or HW_WATCH_*).
+ * @param addr Breakpoint address, as asked by GDB.
+ * @param slot First slot to look at.
+ *
+ * @return Returns the slot, or -1 if not found.
+ */
+static int hw_bp_find(uint8_t type, uint32_t addr, int slot)
+{
+	for (; slot < HW_BP_SLOTS; slot++)
 	{
-		send_gdb_error();
-		return (-1);
+		if (hw_bps[slot].used && hw_bps[slot].type == type &&
+			hw_bps[slot].gdb_addr == addr)
+		{
+			return (slot);
+		}
 	}
+	return (-1);
+}
 
-	reg_num_rm = gdb_to_rm[reg_num_gdb];
+/**
+ * @brief Finds a free slot for a breakpoint of type @p type.
+ *
+ * The slots are allocated from DR3 to DR0, so that DR0 is
+ * kept free for conditional breakpoints as long as possible.
+ *
+ * @param type Breakpoint type (HW_BP_EXEC or HW_WATCH_*).
+ * @param cond 1 if the breakpoint has conditions, 0 otherwise.
+ *
+ * @return Returns the slot, or -1 if there is none.
+ */
+static int hw_bp_alloc(uint8_t type, int cond)
+{
+	int slot;
 
-	/*
-	 * Validate value: 16-bit registers should not
-	 * receive values greater than 16-bit =)
-	 */
-	if (reg_num_rm >= 8 && value.b32 > ((1<<16)-1))
+	/* Legacy targets. */
+	if (!(target_caps & CAP_HW_BP))
+		slot = (type == HW_BP_EXEC) ? 0 : 2;
+	else if (cond)
+		slot = 0;
+	else
 	{
-		send_gdb_error();
-		return (-1);
+		for (slot = HW_BP_SLOTS - 1; slot > 0; slot--)
+			if (!hw_bps[slot].used)
+				break;
+	}
+
+	return (hw_bps[slot].used ? -1 : slot);
+}
+
+/**
+ * @brief Asks the target to set the breakpoint of the
+ * slot @p slot.
+ *
+ * @param slot Breakpoint slot.
+ */
+static void send_serial_add_hw_bp(int slot)
+{
+	struct hw_breakpoint *bp = &hw_bps[slot];
+
+	/* Legacy targets: DR0 or DR2. */
+	if (!(target_caps & CAP_HW_BP))
+	{
+		if (bp->type == HW_BP_EXEC)
+			send_serial_byte(MSG_ADD_SW_BREAK);
+		else
+		{
+			send_serial_byte(MSG_ADD_HW_WATCH);
+			send_serial_byte(bp->type);
+		}
+		send_serial_dword(bp->addr);
+		return;
+	}
+
+	/*
+	 * Add hw breakpoint command:
+	 * 0xC1 <slot-1-byte> <control-1-byte> <addr-4-bytes-LE>
+	 *
+	 * The control byte is the DR7 R/W and LEN of the slot.
+	 */
+	send_serial_byte(MSG_ADD_HW_BP);
+	send_serial_byte(slot);
+	send_serial_byte(bp->type | ((bp->len == 4 ? 3 : bp->len - 1) << 2));
+	send_serial_dword(bp->addr);
+}
+
+/**
+ * @brief Asks the target to remove the breakpoint of the
+ * slot @p slot, and frees it.
+ *
+ * @param slot Breakpoint slot.
+ */
+static void send_serial_rem_hw_bp(int slot)
+{
+	/* Remove hw breakpoint command: 0xC0 <slot-1-byte>. */
+	if (target_caps & CAP_HW_BP)
+	{
+		send_serial_byte(MSG_REM_HW_BP);
+		send_serial_byte(slot);
+	}
+	else if (hw_bps[slot].type == HW_BP_EXEC)
+		send_serial_byte(MSG_REM_SW_BREAK);
+	else
+		send_serial_byte(MSG_REM_HW_WATCH);
+
+	hw_bps[slot].used = 0;
+}
+
+/* ------------------------------------------------------------------*
+ * GDB commands                                                      *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Starts a GDB packet whose data is sent in parts,
+ * with send_gdb_cmd_data().
+ *
+ * @param csum Packet checksum, initialized here.
+ */
+static void send_gdb_cmd_start(int *csum)
+{
+	*csum = 0;
+	send_buffered(gdb_fd, "$", 1);
+}
+
+/**
+ * @brief Sends a part of the GDB packet data.
+ *
+ * @param buff Buffer containing the data to be sent.
+ * @param len Buffer length.
+ * @param csum Packet checksum, updated here.
+ */
+static void send_gdb_cmd_data(const char *buff, size_t len, int *csum)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		*csum += buff[i];
+
+	stats_cur.gdb_out += len;
+	send_buffered(gdb_fd, buff, len);
+}
+
+/**
+ * @brief Finishes a GDB packet, by sending its checksum.
+ *
+ * @param csum Packet checksum.
+ */
+static void send_gdb_cmd_end(int csum)
+{
+	char csum_str[4];
+
+	snprintf(csum_str, sizeof csum_str, "#%02x", csum & 0xFF);
+	if (send_buffered(gdb_fd, csum_str, 3) < 0)
+		errx("Unable to send command to GDB!\n");
+
+	stats_cmd_end();
+}
+
+/**
+ * @brief Send a GDB command/packet in the format:
+ * $data#NN, where NN is the checksum modulo 256.
+ *
+ * All GDB commands follows the same structure.
+ *
+ * @param buff Buffer containing the data to be
+ * sent.
+ * @param len Buffer length.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static ssize_t send_gdb_cmd(const char *buff, size_t len)
+{
+	int csum;
+
+	send_gdb_cmd_start(&csum);
+	send_gdb_cmd_data(buff, len, &csum);
+	send_gdb_cmd_end(csum);
+	return (0);
+}
+
+/**
+ * @brief Send the halt reason to GDB.
+ */
+static inline void send_gdb_halt_reason(void)
+{
+	char buf[96] = {0};
+	size_t i, len;
+	int reason, type;
+
+	/* EIP, ESP and EBP, in GDB numbering. */
+	static const int expedite_regs[] = {8, 4, 5};
+
+	/*
+	 * Expedite the registers GDB needs to show where we
+	 * stopped, so that it does not need to ask for all
+	 * of them first.
+	 */
+	len = snprintf(buf, sizeof buf, "T05");
+	for (i = 0; i < sizeof expedite_regs / sizeof expedite_regs[0]; i++)
+	{
+		len += snprintf(buf + len, sizeof buf - len, "%02x:%.8s;",
+			expedite_regs[i],
+			encode_hex((char*)&x86_regs.r32[expedite_regs[i]], 4));
+	}
+
+	/* Our int3, GDB does not need to adjust the PC. */
+	if (gdb_swbreak && sw_bp_find(x86_regs.r.eip) >= 0)
+		len += snprintf(buf + len, sizeof buf - len, "swbreak:;");
+
+	/*
+	 * Hardware breakpoint/watchpoint
+	 * GDB also requires the stop reason and address for
+	 * the watchpoints.
+	 */
+	reason = x86_stop_data.d.stop_reason;
+	if (reason == STOP_REASON_WATCHPOINT)
+		type = HW_WATCH_WRITE;
+	else if (reason >= STOP_REASON_DR0 &&
+		reason < STOP_REASON_DR0 + HW_BP_SLOTS)
+	{
+		type = hw_bps[reason - STOP_REASON_DR0].type;
+	}
+	else
+		type = -1;
+
+	if (type == HW_WATCH_WRITE || type == HW_WATCH_ACCESS)
+	{
+		len += snprintf(buf + len, sizeof buf - len, "%s:%08x;",
+			(type == HW_WATCH_WRITE) ? "watch" : "awatch",
+			x86_stop_data.d.stop_addr);
+	}
+	else if (type == HW_BP_EXEC && gdb_hwbreak)
+		len += snprintf(buf + len, sizeof buf - len, "hwbreak:;");
+
+	send_gdb_cmd(buf, len);
+}
+
+/**
+ * @brief Acks a previous message/packet sent from GDB
+ */
+static inline void send_gdb_ack(void) {
+	if (!gdb_no_ack)
+		send_buffered(gdb_fd, "+", 1);
+}
+
+/**
+ * @brief Asks GDB to retransmit the previous message/packet.
+ */
+static inline void send_gdb_nack(void) {
+	if (!gdb_no_ack)
+		send_buffered(gdb_fd, "-", 1);
+}
+
+/**
+ * @brief Tells GDB that we do not support the
+ * receive message/packet.
+ */
+static inline void send_gdb_unsupported_msg(void) {
+	send_gdb_cmd(NULL, 0);
+}
+
+/**
+ * @brief Confirms that the previous command was
+ * successfully executed.
+ *
+ * The 'OK' command is generally sent by the serial,
+ * and then forwarded to GDB, as the serial device is
+ * the only one that knows if the command succeeded
+ * or not.
+ */
+static inline void send_gdb_ok(void) {
+	send_gdb_cmd("OK", 2);
+}
+
+/**
+ * @brief Tells GDB that something went wrong with
+ * the latest command.
+ */
+static inline void send_gdb_error(void) {
+	send_gdb_cmd("E00", 3);
+}
+
+/**
+ * @brief Asks the serial device to write @p len bytes
+ * from @p data at the physical address @p addr.
+ *
+ * If supported by the target, the data is sent RLE
+ * compressed, as long as it is worth doing so. Big
+ * writes are split in multiple commands.
+ *
+ * @param addr Physical address.
+ * @param data Data to be written.
+ * @param len Data length.
+ */
+static void send_serial_write_memory(uint32_t addr, const char *data,
+	uint32_t len)
+{
+	const char *rle, *chunk;
+	size_t rle_len;
+	uint16_t amnt;
+
+	for (; len; len -= amnt, addr += amnt, data += amnt)
+	{
+		amnt  = MIN(len, WRITE_CHUNK_SIZE);
+		chunk = sw_bp_patch_write(addr, data, amnt);
+
+		/* Only the last 'OK' should reach GDB. */
+		if (len > amnt)
+			serial_ok_skip++;
+
+		if (target_caps & CAP_RLE)
+		{
+			rle = rle_encode(chunk, amnt, &rle_len);
+			if (rle_len < amnt)
+			{
+				send_serial_byte(MSG_WRITE_MEM_RLE);
+				send_serial_dword(addr);
+				send_serial_word(amnt);
+				send_serial(rle, rle_len);
+				continue;
+			}
+		}
+
+		send_serial_byte(MSG_WRITE_MEM);
+		send_serial_dword(addr);
+		send_serial_word(amnt);
+		send_serial(chunk, amnt);
+	}
+}
+
+/**
+ * @brief Sends a 'Ctrl+C' to the serial device.
+ *
+ * It is never framed, since the target might be running
+ * and unable to ack it.
+ */
+static void send_serial_ctrlc(void) {
+	uint8_t ctrlc = MSG_CTRLC;
+	send_buffered(serial_fd, &ctrlc, 1);
+}
+
+/* ------------------------------------------------------------------*
+ * Misc                                                              *
+ * ------------------------------------------------------------------*/
+
+/**
+ * Read all registers (already in cache), encodes
+ * them to hex and returns it.
+ *
+ * @return Returns all the registers hex-encoded.
+ */
+static char *read_registers(void)
+{
+	char *buff;
+
+#ifdef MOCK_REGISTERS
+	int i;
+
+	for (i = 0; i < MAX_REGS; i++)
+	{
+		if (i & 1)
+			x86_regs.r32[i] = 0xabcdefAB;
+		else
+			x86_regs.r32[i] = 0x12345678;
+	}
+
+	/* Some 'sane' data. */
+	x86_regs.r.cs  = 0x0;
+	x86_regs.r.ds  = 0x100;
+	x86_regs.r.es  = 0x100;
+	x86_regs.r.fs  = 0x100;
+	x86_regs.r.gs  = 0x100;
+	x86_regs.r.eip = 0x7c00;
+#else
+	if (!have_x86_regs)
+		errx("Error! registers are not available!\n");
+#endif
+
+	buff = encode_hex((const char*)x86_regs.r8,
+		sizeof (struct sx86_regs));
+	return (buff);
+}
+
+#ifdef USE_MOCKS
+/**
+ * @brief Reads from a 'fake' memory (filled with NOPs)
+ * and returns it.
+ *
+ * @param len Desired memory size.
+ *
+ * @return Returns the fake memory.
+ */
+static char *read_mock_memory(size_t len)
+{
+	char *buff, *buff1;
+
+	if ((buff = malloc(len)) == NULL)
+		errx("Unable to allocate %zd bytes!\n", len);
+
+	for (size_t i = 0; i < len; i++)
+		buff[i] = 0x90;
+
+	buff1 = encode_hex(buff, len);
+	free(buff);
+
+	return (buff1);
+}
+#endif
+
+/* ------------------------------------------------------------------*
+ * Memory read relay                                                 *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Asks the serial device for the next pieces of the
+ * range being fetched, as long as there is room in the
+ * pipeline.
+ *
+ * Pages already in the cache are skipped.
+ */
+static void read_fetch_issue(void)
+{
+	uint32_t amnt;
+	size_t span;
+	int idx;
+
+	while (read_fetch.count < READ_PIPELINE &&
+		read_fetch.next < read_fetch.end)
+	{
+		/* Skip what we already have. */
+		span = cache_span(read_fetch.next,
+			read_fetch.end - read_fetch.next);
+		read_fetch.next += CACHE_PAGE_DOWN(span);
+		if (read_fetch.next >= read_fetch.end)
+			break;
+
+		amnt = MIN(READ_CHUNK_SIZE, read_fetch.end - read_fetch.next);
+
+		idx = (read_fetch.head + read_fetch.count) % READ_PIPELINE;
+		read_fetch.addr[idx]  = read_fetch.next;
+		read_fetch.amnt[idx]  = amnt;
+		read_fetch.stale[idx] = 0;
+		read_fetch.count++;
+
+		/*
+		 * Asks the serial device to send its memory
+		 *
+		 * Our 'protocol', is as follows:
+		 *
+		 * 0xD8 <address-4-bytes-LE> <size-2-bytes-LE>
+		 *  ^--- read memory command, 1-byte
+		 *
+		 * or 0xD7 (same parameters), if the target supports
+		 * sending it RLE-compressed.
+		 */
+		if (target_caps & CAP_RLE)
+			send_serial_byte(MSG_READ_MEM_RLE);
+		else
+			send_serial_byte(MSG_READ_MEM);
+		send_serial_dword(read_fetch.next);
+		send_serial_word(amnt);
+
+		/*
+		 * Framed mode: besides the command being replied,
+		 * the target keeps a single frame, and drops new
+		 * ones until it is handled. With two requests in
+		 * a frame, the next one would wait for a resend.
+		 */
+		frame_end();
+
+		read_fetch.next += amnt;
+	}
+}
+
+/**
+ * @brief Fetches the memory range [@p start, @p end) from
+ * the serial device into the cache.
+ *
+ * If the range continues what is already being fetched,
+ * the current fetch is just extended, otherwise, what was
+ * not requested yet is dropped in favor of the new range.
+ *
+ * @param start Start physical address.
+ * @param end End physical address (exclusive).
+ */
+static void read_fetch_start(uint32_t start, uint32_t end)
+{
+	if (read_fetch.count &&
+		start >= read_fetch.addr[read_fetch.head] &&
+		start <= read_fetch.next)
+	{
+		read_fetch.end = MAX(read_fetch.end, end);
+	}
+	else
+	{
+		read_fetch.next = start;
+		read_fetch.end  = end;
+	}
+	read_fetch_issue();
+}
+
+/**
+ * @brief Finds the memory region of @p addr.
+ *
+ * @param addr Physical address.
+ *
+ * @return Returns the region, or NULL if above
+ * REAL_MODE_LIMIT.
+ */
+static const struct mem_region *mem_region_find(uint32_t addr)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof mem_regions / sizeof mem_regions[0]; i++)
+		if (addr >= mem_regions[i].start && addr < mem_regions[i].end)
+			return (&mem_regions[i]);
+	return (NULL);
+}
+
+/**
+ * @brief Fetches the memory range [@p addr, @p end), and,
+ * if in RAM, the read-ahead up to @p ahead, everything
+ * rounded to pages but within the region of @p addr.
+ *
+ * @param addr Start physical address.
+ * @param end End physical address (exclusive).
+ * @param ahead Read-ahead end address (exclusive).
+ */
+static void read_fetch_range(uint32_t addr, uint32_t end, uint32_t ahead)
+{
+	const struct mem_region *r;
+	uint32_t start;
+
+	r     = mem_region_find(addr);
+	start = addr;
+	if (r && r->ram)
+	{
+		start = MAX(CACHE_PAGE_DOWN(addr), r->start);
+		ahead = MIN(CACHE_PAGE_UP(MAX(end, ahead)), r->end);
+		end   = MAX(end, ahead);
+	}
+	read_fetch_start(start, end);
+}
+
+/**
+ * @brief Keeps the cache up to date with our write of
+ * @p len bytes from @p data at @p addr.
+ *
+ * Only RAM surely holds what was written: anything else
+ * (ROMs, holes) is dropped from the cache instead, so
+ * the next read shows what the target really has.
+ *
+ * @param addr Start physical address.
+ * @param data Data written.
+ * @param len Amount of bytes.
+ */
+static void cache_update_write(uint32_t addr, const uint8_t *data,
+	size_t len)
+{
+	const struct mem_region *r;
+	size_t amnt;
+
+	for (; len; len -= amnt, addr += amnt, data += amnt)
+	{
+		r    = mem_region_find(addr);
+		amnt = r ? MIN(len, r->end - addr) : len;
+
+		if (r && r->ram)
+			cache_fill_written(addr, data, amnt);
+		else
+			cache_drop(addr, amnt);
+	}
+}
+
+/**
+ * @brief Drops everything we know about the target
+ * memory, including the in-flight reads, since their
+ * data might be outdated when they arrive.
+ */
+static void invalidate_memory(void)
+{
+	int i;
+
+	cache_invalidate();
+	for (i = 0; i < read_fetch.count; i++)
+		read_fetch.stale[(read_fetch.head + i) % READ_PIPELINE] = 1;
+	read_fetch.next = read_fetch.end;
+}
+
+/**
+ * @brief Streams to GDB whatever is available of the
+ * memory read in progress, and make sure that the
+ * missing part is being fetched.
+ */
+static void gdb_read_continue(void)
+{
+	static uint8_t buff[READ_CHUNK_SIZE];
+	size_t amnt;
+
+	while (gdb_read.active)
+	{
+		amnt = cache_read(gdb_read.addr, buff,
+			MIN(sizeof buff, gdb_read.end - gdb_read.addr));
+		if (!amnt)
+			break;
+
+		if (!gdb_read.started)
+		{
+			send_gdb_cmd_start(&gdb_read.csum);
+			gdb_read.started = 1;
+		}
+
+		send_gdb_cmd_data(encode_hex((char*)buff, amnt), amnt * 2,
+			&gdb_read.csum);
+
+		gdb_read.addr += amnt;
+		if (gdb_read.addr == gdb_read.end)
+		{
+			send_gdb_cmd_end(gdb_read.csum);
+			gdb_read.active = 0;
+		}
+	}
+
+	/* Nothing else to arrive: ask for what's missing. */
+	if (gdb_read.active && !read_fetch.count &&
+		read_fetch.next >= read_fetch.end)
+	{
+		read_fetch_range(gdb_read.addr, gdb_read.end, gdb_read.end);
+	}
+}
+
+/**
+ * @brief Searches the memory read so far for the search
+ * in progress, replying to GDB as soon as the pattern is
+ * found or the range is over, and make sure that the
+ * missing part is being fetched.
+ */
+static void gdb_search_continue(void)
+{
+	static uint8_t buff[GDB_PACKET_SIZE + READ_CHUNK_SIZE];
+	size_t amnt, i;
+	char reply[16];
+
+	while (gdb_search.active)
+	{
+		if (gdb_search.end - gdb_search.addr < gdb_search.pat_len)
+		{
+			send_gdb_cmd("0", 1);
+			gdb_search.active = 0;
+			break;
+		}
+
+		amnt = cache_read(gdb_search.addr, buff,
+			MIN(sizeof buff, gdb_search.end - gdb_search.addr));
+		if (amnt < gdb_search.pat_len)
+			break;
+
+		for (i = 0; i + gdb_search.pat_len <= amnt; i++)
+		{
+			if (!memcmp(buff + i, gdb_search.pattern, gdb_search.pat_len))
+			{
+				snprintf(reply, sizeof reply, "1,%x",
+					gdb_search.addr + (uint32_t)i);
+				send_gdb_cmd(reply, strlen(reply));
+				gdb_search.active = 0;
+				return;
+			}
+		}
+
+		/* The next chunk starts where a match could still be. */
+		gdb_search.addr += i;
+	}
+
+	/* Nothing else to arrive: ask for what's missing. */
+	if (gdb_search.active && !read_fetch.count &&
+		read_fetch.next >= read_fetch.end)
+	{
+		read_fetch_range(gdb_search.addr, gdb_search.end,
+			gdb_search.end);
+	}
+}
+
+/**
+ * @brief Updates the read-ahead window accordingly with
+ * the new memory read of @p amnt bytes at @p addr.
+ *
+ * A read is considered sequential if it starts after the
+ * previous one and no later than where the previous one
+ * ended: GDB's 'find' overlaps its chunks by the pattern
+ * size, so exact adjacency is not required.
+ *
+ * @param addr Read address.
+ * @param amnt Read size.
+ *
+ * @return Returns the (exclusive) end address of what should
+ * be read ahead, see read_fetch_range().
+ */
+static uint32_t read_ahead_update(uint32_t addr, uint32_t amnt)
+{
+	int seq;
+
+	seq = (addr > read_ahead_addr && addr <= read_ahead_next);
+
+	if (seq)
+		read_ahead_win = MIN(read_ahead_win * 2, READ_AHEAD_MAX);
+	else
+		read_ahead_win = MAX(read_ahead_win / 2, READ_AHEAD_MIN);
+
+	read_ahead_addr = addr;
+	read_ahead_next = addr + amnt;
+
+	/* Only fetch ahead while the reads are sequential. */
+	if (seq && addr < REAL_MODE_LIMIT)
+		return (addr + MAX(amnt, read_ahead_win));
+
+	return (addr + amnt);
+}
+
+/* ------------------------------------------------------------------*
+ * GDB handlers                                                      *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Handles the single-step command from
+ * GDB.
+ */
+static void handle_gdb_single_step(void)
+{
+	/* For mock, just send the we're already halted =). */
+#ifdef USE_MOCKS
+	send_gdb_halt_reason();
+#else
+	/* Send to our serial-line that we want a single-step. */
+	send_serial_byte(MSG_SINGLE_STEP);
+	have_x86_regs = 0;
+	invalidate_memory();
+#endif
+}
+
+/**
+ * @brief Sends the continue to the serial device.
+ */
+static void send_gdb_continue(void)
+{
+	have_x86_regs = 0;
+	invalidate_memory();
+	send_serial_byte(MSG_CONTINUE);
+}
+
+/**
+ * @brief Handles the 'continue' command from GDB.
+ */
+static void handle_gdb_continue(void) {
+	/* Send to our serial-line that we want to continue. */
+	send_gdb_continue();
+}
+
+/**
+ * @brief Handles the 'halt reason (?)' command from GDB.
+ */
+static void handle_gdb_halt_reason(void) {
+	send_gdb_halt_reason();
+}
+
+/**
+ * @brief Handle he 'read registers (g)' command from GDB.
+ */
+static void handle_gdb_read_registers(void) {
+	send_gdb_cmd(read_registers(), 128);
+}
+
+/**
+ * @brief Handles the 'read memory (m)' command from GDB.
+ *
+ * @param Message buffer to be parsed.
+ * @param Buffer length.
+ *
+ * @return Returns 0 if the request is valid, -1 otherwise.
+ *
+ * @note Please note that the actual memory read is
+ * done by the serial device. This routine only parses
+ * the command and forward the request to the serial
+ * device.
+ */
+static int handle_gdb_read_memory(const char *buff, size_t len)
+{
+	uint32_t addr, amnt, end;
+	const char *ptr;
+
+	ptr = buff;
+
+	/* Skip first 'm'. */
+	expect_char('m', ptr, len);
+	addr = read_int(ptr, &len, &ptr, 16);
+	expect_char(',', ptr, len);
+
+	/* Get amount. */
+	amnt = simple_read_int(ptr, len, 16);
+
+	/*
+	 * The addresses asked by GDB are already physical,
+	 * since we convert them at handle_serial_single_step_stop()
+	 */
+
+	/*
+	 * An empty reply means 'not supported' to GDB, so
+	 * there is no valid reply for nothing.
+	 */
+	if (!amnt)
+	{
+		send_gdb_error();
+		return (0);
+	}
+
+	/* Nothing to be read outside the addressable memory. */
+	if (addr >= REAL_MODE_LIMIT || amnt > REAL_MODE_LIMIT - addr)
+	{
+		send_gdb_cmd("E01", 3);
+		return (-1);
+	}
+
+#ifndef USE_MOCKS
+	end = read_ahead_update(addr, amnt);
+
+	/*
+	 * Sends whatever is already in the cache, and fetch
+	 * the missing pages touched by the request plus the
+	 * read-ahead window, so that subsequent reads are
+	 * served from the cache.
+	 *
+	 * For serial, the reply is streamed to GDB as the
+	 * memory arrives. For mocks, we answer immediately.
+	 */
+	gdb_read.active  = 1;
+	gdb_read.started = 0;
+	gdb_read.addr    = addr;
+	gdb_read.end     = addr + amnt;
+	gdb_read_continue();
+
+	if (gdb_read.active)
+		read_fetch_range(gdb_read.addr, gdb_read.end, end);
+#endif
+
+#ifdef USE_MOCKS
+	ptr = read_mock_memory(len);
+	send_gdb_cmd(ptr, len * 2);
+#endif
+
+	return (0);
+}
+
+/**
+ * @brief Handles the 'write memory (M)' command from GDB.
+ *
+ * @param Message buffer to be parsed.
+ * @param Buffer length.
+ *
+ * @return Returns 0 if the request is valid, -1 otherwise.
+ *
+ * @note Please note that the actual memory write is
+ * done by the serial device. This routine only parses
+ * the command and forward the request to the serial
+ * device.
+ */
+static int handle_gdb_write_memory_hex(const char *buff, size_t len)
+{
+	const char *ptr, *memory;
+	uint32_t addr, amnt;
+
+	ptr = buff;
+
+	/* Skip first 'M'. */
+	expect_char('M', ptr, len);
+	addr = read_int(ptr, &len, &ptr, 16);
+	expect_char(',', ptr, len);
+
+	/* Get amount. */
+	amnt = read_int(ptr, &len, &ptr, 16);
+	expect_char(':', ptr, len);
+
+	/* Nothing to be written. */
+	if (!amnt)
+	{
+		send_gdb_ok();
+		return (0);
+	}
+
+	if (len < (size_t)amnt * 2)
+	{
+		send_gdb_error();
+		return (-1);
+	}
+
+	/* Decode hex buffer to binary. */
+	memory = decode_hex(ptr, amnt);
+	if (!memory)
+	{
+		send_gdb_error();
+		return (-1);
+	}
+
+	/* Keep the cache up to date with our changes. */
+	cache_update_write(addr, (const uint8_t *)memory, amnt);
+
+	/* Send to our serial device. */
+	send_serial_write_memory(addr, memory, amnt);
+	return (0);
+}
+
+/**
+ * @brief Unescapes, in-place, binary data sent by GDB.
+ *
+ * The characters '#', '$', '}' and '*' are escaped as:
+ * '}' followed by the original char XOR 0x20.
+ *
+ * @param data Data to be unescaped.
+ * @param len Data length.
+ *
+ * @return Returns the unescaped data length.
+ */
+static size_t gdb_unescape(char *data, size_t len)
+{
+	char *src, *dst, *end;
+
+	end = data + len;
+	for (src = dst = data; src < end; src++, dst++)
+	{
+		if (*src == '}' && src + 1 < end)
+			*dst = *++src ^ 0x20;
+		else
+			*dst = *src;
+	}
+	return (dst - data);
+}
+
+/**
+ * @brief Handles the 'write memory (X)' command from GDB.
+ *
+ * Contrary to the 'M' command, the data is sent in binary,
+ * escaped (see gdb_unescape()).
+ *
+ * Since the unescaped data is never bigger than the escaped
+ * one, the data is unescaped in-place and sent directly to
+ * the serial device from the command buffer.
+ *
+ * @param Message buffer to be parsed.
+ * @param Buffer length (the actual packet length).
+ *
+ * @return Returns 0 if the request is valid, -1 otherwise.
+ */
+static int handle_gdb_write_memory_bin(char *buff, size_t len)
+{
+	char *memory;
+	uint32_t addr, amnt;
+	const char *cptr;
+
+	cptr = buff;
+
+	/* Skip first 'X'. */
+	expect_char('X', cptr, len);
+	addr = read_int(cptr, &len, &cptr, 16);
+	expect_char(',', cptr, len);
+
+	/* Get amount. */
+	amnt = read_int(cptr, &len, &cptr, 16);
+	expect_char(':', cptr, len);
+
+	/*
+	 * If 0, this is GDB checking if we support the X
+	 * packet, so just say yes.
+	 */
+	if (!amnt)
+	{
+		send_gdb_ok();
+		return (0);
+	}
+
+	memory = buff + (cptr - buff);
+	if (gdb_unescape(memory, len) != amnt)
+	{
+		send_gdb_error();
+		return (-1);
+	}
+
+	/* Keep the cache up to date with our changes. */
+	cache_update_write(addr, (const uint8_t *)memory, amnt);
+
+	/* Send to our serial device. */
+	send_serial_write_memory(addr, memory, amnt);
+	return (0);
+}
+
+/**
+ * @brief Sets the conditions of the instruction breakpoint,
+ * from the GDB condition list @p buff (;X<len>,<expr>...).
+ *
+ * The conditions (agent expressions) are compiled into the
+ * target bytecode, so that the target only stops when one
+ * of them holds, instead of stopping every time and letting
+ * GDB check it and continue. An empty list removes the
+ * conditions.
+ *
+ * @param buff Condition list, the text after the breakpoint
+ * kind.
+ * @param len Condition list length.
+ *
+ * @return Returns 0 if success, -1 if the conditions are
+ * invalid or can't be evaluated by the target.
+ */
+static int set_breakpoint_cond(const char *buff, size_t len)
+{
+	uint8_t prog[COND_MAX_CODE];
+	size_t prog_len;
+	size_t ax_len;
+	const char *ptr, *ax;
+
+	prog_len = 0;
+	ptr      = buff;
+
+	while (len > 1 && ptr[0] == ';' && ptr[1] == 'X')
+	{
+		ptr += 2;
+		len -= 2;
+
+		ax_len = read_int(ptr, &len, &ptr, 16);
+		if (!len || *ptr != ',')
+			return (-1);
+
+		ptr++;
+		len--;
+
+		if (len < ax_len * 2)
+			return (-1);
+
+		ax = decode_hex(ptr, ax_len);
+		if (!ax || ax_compile((const uint8_t *)ax, ax_len,
+			prog, &prog_len, sizeof(prog) - 1) < 0)
+		{
+			return (-1);
+		}
+
+		ptr += ax_len * 2;
+		len -= ax_len * 2;
+	}
+
+	if (prog_len && !(target_caps & CAP_COND))
+		return (-1);
+
+	/* Nothing to set or to remove. */
+	if (!prog_len && !breakpoint_has_cond)
+		return (0);
+
+	if (prog_len)
+		prog[prog_len++] = COND_OP_DONE;
+
+	/*
+	 * Condition command:
+	 * 0xC3 <length-1-byte> <bytecode>
+	 *
+	 * Its 'OK' is not for GDB.
+	 */
+	send_serial_byte(MSG_COND);
+	send_serial_byte(prog_len);
+	send_serial(prog, prog_len);
+	serial_ok_skip++;
+
+	breakpoint_has_cond = (prog_len != 0);
+	return (0);
+}
+
+/**
+ * @brief Removes the hardware instruction breakpoint at
+ * @p addr, if any, and its conditions.
+ *
+ * @param addr Breakpoint physical address.
+ *
+ * @return Returns 1 if removed, 0 if there was none.
+ */
+static int remove_hw_breakpoint(uint32_t addr)
+{
+	int slot;
+
+	slot = hw_bp_find(HW_BP_EXEC, addr, 0);
+	if (slot < 0)
+		return (0);
+
+	if (slot == 0)
+		set_breakpoint_cond(NULL, 0);
+
+	send_serial_rem_hw_bp(slot);
+	return (1);
+}
+
+/**
+ * @brief Inserts a hardware instruction breakpoint at
+ * @p addr, with the conditions @p cond, if any.
+ *
+ * @param addr Breakpoint physical address.
+ * @param cond Condition list, or NULL.
+ * @param len Condition list length.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int insert_hw_breakpoint(uint32_t addr, const char *cond,
+	size_t len)
+{
+	int slot;
+
+	/* Already there: GDB may be changing its conditions. */
+	if (remove_hw_breakpoint(addr))
+		serial_ok_skip++;
+
+	slot = hw_bp_alloc(HW_BP_EXEC, cond != NULL);
+	if (slot < 0)
+		goto err;
+
+	if (cond && set_breakpoint_cond(cond, len) < 0)
+		goto err;
+
+	hw_bps[slot].used     = 1;
+	hw_bps[slot].type     = HW_BP_EXEC;
+	hw_bps[slot].len      = 1;
+	hw_bps[slot].addr     = addr;
+	hw_bps[slot].gdb_addr = addr;
+	hw_bps[slot].gdb_len  = 1;
+	send_serial_add_hw_bp(slot);
+	return (0);
+err:
+	send_gdb_error();
+	return (-1);
+}
+
+/**
+ * @brief Inserts a hardware watchpoint of type @p type
+ * covering @p len bytes from @p addr.
+ *
+ * Since each slot only watches 1, 2 or 4 aligned bytes,
+ * the range is split in as many slots as needed.
+ *
+ * @param type Watchpoint type (HW_WATCH_*).
+ * @param addr Watchpoint physical address.
+ * @param len Watchpoint length.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int insert_hw_watchpoint(uint8_t type, uint32_t addr,
+	uint32_t len)
+{
+	uint32_t start, size;
+	int slots[HW_BP_SLOTS];
+	int i, count = 0;
+
+	if (!len)
+		goto err;
+
+	/* Legacy targets: a single 4-byte watchpoint. */
+	if (!(target_caps & CAP_HW_BP))
+	{
+		if (len > 4)
+			goto err;
+		len = 4;
+	}
+
+	/* Check if there are enough slots. */
+	for (count = 0, start = addr; start < addr + len;
+		start += size, count++)
+	{
+		if (count == HW_BP_SLOTS || (slots[count] =
+			hw_bp_alloc(type, 0)) < 0)
+		{
+			goto err;
+		}
+
+		/* Biggest aligned size that fits. */
+		size = 4;
+		while (size > 1 && ((start & (size - 1)) ||
+			size > addr + len - start))
+		{
+			size >>= 1;
+		}
+
+		/* Legacy: DR2 masks the address by itself. */
+		if (!(target_caps & CAP_HW_BP))
+			size = 4;
+
+		hw_bps[slots[count]].used     = 1;
+		hw_bps[slots[count]].type     = type;
+		hw_bps[slots[count]].len      = size;
+		hw_bps[slots[count]].addr     = start;
+		hw_bps[slots[count]].gdb_addr = addr;
+		hw_bps[slots[count]].gdb_len  = len;
+	}
+
+	/* Only the last 'OK' should reach GDB. */
+	for (i = 0; i < count; i++)
+	{
+		if (i < count - 1)
+			serial_ok_skip++;
+		send_serial_add_hw_bp(slots[i]);
+	}
+	return (0);
+err:
+	for (i = 0; i < count; i++)
+		hw_bps[slots[i]].used = 0;
+	send_gdb_error();
+	return (-1);
+}
+
+/**
+ * @brief Removes the hardware watchpoint of type @p type
+ * at @p addr, with all its slots.
+ *
+ * @param type Watchpoint type (HW_WATCH_*).
+ * @param addr Watchpoint physical address.
+ */
+static void remove_hw_watchpoint(uint8_t type, uint32_t addr)
+{
+	int slot, next;
+
+	slot = hw_bp_find(type, addr, 0);
+	if (slot < 0)
+	{
+		send_gdb_ok();
+		return;
+	}
+
+	/* Only the last 'OK' should reach GDB. */
+	for (; slot >= 0; slot = next)
+	{
+		next = hw_bp_find(type, addr, slot + 1);
+		if (next >= 0)
+			serial_ok_skip++;
+		send_serial_rem_hw_bp(slot);
+	}
+}
+
+/**
+ * @brief Handles the 'add breakpoint (Zn)' command from GDB.
+ *
+ * This routine handles all kinds of breakpoints that GDB
+ * might ask for, from Z0 to Z4. SW breakpoints are int3
+ * instructions, as many as SW_BP_MAX, as long as the code
+ * is in RAM. HW breakpoints (and SW breakpoints in ROM or
+ * with conditions) and hw watchpoints (whether access or
+ * write) share the 4 debug registers.
+ *
+ * The only kind of breakpoint that is not supported is the
+ * 'Z3' or 'read watchpoint', because x86 does not supports
+ * them. However, GDB is smart enough to realize that and
+ * asks to use Z4 instead. When a Z4 breakpoints (emulating
+ * Z3) happens, all the writes are silently ignored and GDB
+ * continues to execute again.
+ *
+ * Instruction breakpoints may also have conditions, which
+ * are evaluated by the target, see set_breakpoint_cond().
+ *
+ * @param Message buffer to be parsed.
+ * @param Buffer length.
+ *
+ * @return Returns 0 if the request is valid, -1 otherwise.
+ */
+static int handle_gdb_add_breakpoint(const char *buff, size_t len)
+{
+	const char *ptr = buff;
+	const char *cond;
+	uint32_t addr;
+	uint32_t kind;
+	int i;
+
+	/* Skip 'Z0'. */
+	expect_char('Z', ptr, len);
+	expect_char_range('0', '4', ptr, len);
+	expect_char(',', ptr, len);
+
+	/* Get breakpoint address (that is already physical). */
+	addr = read_int(ptr, &len, &ptr, 16);
+	expect_char(',', ptr, len);
+
+	/*
+	 * Check which type of breakpoint we have and act
+	 * accordingly.
+	 */
+	switch (buff[1]) {
+	/* Instruction break. */
+	case '0':
+	case '1':
+		/* Conditions, if any, after the kind. */
+		cond = memchr(ptr, ';', len);
+		if (cond)
+			len -= cond - ptr;
+
+		/*
+		 * Unconditional SW breakpoints are int3, whether
+		 * the code is in RAM or not is only known after
+		 * the target replies.
+		 */
+		if (buff[1] == '0' && !cond && (target_caps & CAP_SW_BP))
+		{
+			if (sw_bp_find(addr) >= 0)
+			{
+				send_gdb_ok();
+				break;
+			}
+			if (sw_bp_count < SW_BP_MAX)
+			{
+				/* GDB removed the conditions. */
+				if (remove_hw_breakpoint(addr))
+					serial_ok_skip++;
+
+				send_serial_sw_bp(addr, INT3_OPC, 1, 0);
+				break;
+			}
+		}
+
+		/* GDB added conditions to an int3. */
+		if (buff[1] == '0' && (i = sw_bp_find(addr)) >= 0)
+			send_serial_sw_bp(addr, sw_bps[i].orig, 0, 1);
+
+		return (insert_hw_breakpoint(addr, cond, cond ? len : 0));
+	/* Write watchpoint. */
+	case '2':
+		kind = read_int(ptr, &len, &ptr, 16);
+		return (insert_hw_watchpoint(HW_WATCH_WRITE, addr, kind));
+	/* Read watchpoint. */
+	case '3':
+		send_gdb_unsupported_msg();
+		break;
+	/* Access (Read/Write) watchpoint. */
+	case '4':
+		kind = read_int(ptr, &len, &ptr, 16);
+		return (insert_hw_watchpoint(HW_WATCH_ACCESS, addr, kind));
+	}
+
+	return (0);
+}
+
+/**
+ * @brief Handles the 'remove breakpoint (zn)' command from GDB.
+ *
+ * All breakpoints are found by their type and address.
+ *
+ * @param Message buffer to be parsed.
+ * @param Buffer length.
+ *
+ * @return Returns 0 if the request is valid, -1 otherwise.
+ */
+static int handle_gdb_remove_breakpoint(const char *buff, size_t len)
+{
+	const char *ptr = buff;
+	uint32_t addr;
+	int i;
+
+	/* Skip 'z0'. */
+	expect_char('z', ptr, len);
+	expect_char_range('0', '4', ptr, len);
+	expect_char(',', ptr, len);
+
+	/* Get breakpoint address. */
+	addr = read_int(ptr, &len, &ptr, 16);
+
+	/*
+	 * Check which type of breakpoint we have and act
+	 * accordingly.
+	 */
+	switch (buff[1]) {
+	/* Instruction break. */
+	case '0':
+	case '1':
+		/* Put the original byte back. */
+		if (buff[1] == '0' && (i = sw_bp_find(addr)) >= 0)
+		{
+			send_serial_sw_bp(addr, sw_bps[i].orig, 0, 0);
+			break;
+		}
+
+		/* Not inserted, nothing to do. */
+		if (!remove_hw_breakpoint(addr))
+			send_gdb_ok();
+		break;
+	/* Remaining. */
+	case '2':
+		remove_hw_watchpoint(HW_WATCH_WRITE, addr);
+		break;
+	case '3':
+		send_gdb_ok();
+		break;
+	case '4':
+		remove_hw_watchpoint(HW_WATCH_ACCESS, addr);
+		break;
+	}
+
+	return (0);
+}
+
+/**
+ * @brief Handles the 'write register (P)' GDB command;
+ *
+ * Please note the the segment registers and EIP,EFLAGS
+ * are 16-bit. An attempt to write a 32-bit value on them
+ * will emit an error.
+ *
+ * Also note that the mapping from what we receive from
+ * the serial device and the mapping expected by GDB
+ * differs, so there is a need to a conversion.
+ *
+ * @param buff Buffer to be parsed.
+ * @param len Buffer length.
+ *
+ * @return Returns 0 if the command is valid, -1 otherwise.
+ */
+static int handle_gdb_write_register(const char *buff, size_t len)
+{
+	uint32_t reg_num_gdb, reg_num_rm;
+	const char *ptr, *dec;
+	union minibuf value;
+
+	static const int gdb_to_rm[] =
+		/* EAX. */                           /* GS. */
+		   {7,6,5,4,3,2,1,0,13,15,14,12,11,10,9,8};
+
+	ptr = buff;
+
+	expect_char('P', ptr, len);
+	reg_num_gdb = read_int(ptr, &len, &ptr, 16);
+	expect_char('=', ptr, len);
+
+	if (len < 8)
+	{
+		send_gdb_error();
+		return (-1);
+	}
+
+	dec = decode_hex(ptr, 4);
+	if (!dec)
+	{
+		send_gdb_error();
+		return (-1);
+	}
+
+	memcpy(&value, dec, 4);
+
+	/* Validate register. */
+	if (reg_num_gdb >= 16)
+	{
+		send_gdb_error();
+		return (-1);
+	}
+
+	reg_num_rm = gdb_to_rm[reg_num_gdb];
+
+	/*
+	 * Validate value: 16-bit registers should not
+	 * receive values greater than 16-bit =)
+	 */
+	if (reg_num_rm >= 8 && value.b32 > ((1<<16)-1))
+	{
+		send_gdb_error();
+		return (-1);
 	}
 
 	/* Update our 'cache'. */
 	x86_regs.r32[reg_num_gdb] = value.b32;
 
-	/* Send to our serial device. */
-	send_serial_byte(SERIAL_STATE_REG_WRITE);
-	send_serial_byte(reg_num_rm);
-	send_serial_dword(value.b32);
-	return (0);
+	/*
+	 * Changing CS:EIP (or any other 16-bit register)
+	 * also changes where the saved instructions
+	 * (interrupt mode) should be patched into the
+	 * memory read, so the memory cache can no longer
+	 * be trusted.
+	 */
+	if (reg_num_rm >= 8)
+		invalidate_memory();
+
+	/* Send to our serial device. */
+	send_serial_byte(MSG_REG_WRITE);
+	send_serial_byte(reg_num_rm);
+	send_serial_dword(value.b32);
+	return (0);
+}
+
+/**
+ * @brief Checks if the packet @p buff, of length @p len,
+ * is the command @p cmd (or starts with it).
+ *
+ * @param buff Packet buffer.
+ * @param len Packet length.
+ * @param cmd Command name, like: qSupported.
+ *
+ * @return Returns 1 if matches, 0 otherwise.
+ */
+static inline int is_gdb_cmd(const char *buff, size_t len,
+	const char *cmd)
+{
+	size_t cmd_len = strlen(cmd);
+	return (len >= cmd_len && !memcmp(buff, cmd, cmd_len));
+}
+
+/**
+ * @brief Handles the 'search memory (qSearch:memory)'
+ * command from GDB.
+ *
+ * The search is done by the serial device, so only the
+ * match address needs to be transferred, instead of the
+ * whole memory range.
+ *
+ * If the target is unable to search, an empty reply is
+ * sent, and GDB falls back to search by itself. Patterns
+ * longer than the target supports are searched here, over
+ * the memory read into the cache, see gdb_search_continue().
+ *
+ * The target memory has our int3s, so the ones in the range
+ * are swapped back with the original bytes during the
+ * search, see sw_bp_swap_range().
+ *
+ * @param buff Buffer to be parsed.
+ * @param len Buffer length.
+ *
+ * @return Returns 0 if the request is valid, -1 otherwise.
+ */
+static int handle_gdb_search_memory(char *buff, size_t len)
+{
+	uint32_t addr, amnt;
+	const char *ptr;
+	char *pattern;
+	size_t pat_len;
+
+	if (!(target_caps & CAP_SEARCH))
+	{
+		send_gdb_unsupported_msg();
+		return (-1);
+	}
+
+	ptr  = buff + sizeof("qSearch:memory") - 1;
+	len -= sizeof("qSearch:memory") - 1;
+
+	expect_char(':', ptr, len);
+	addr = read_int(ptr, &len, &ptr, 16);
+	expect_char(';', ptr, len);
+	amnt = read_int(ptr, &len, &ptr, 16);
+	expect_char(';', ptr, len);
+
+	pattern = buff + (ptr - buff);
+	pat_len = gdb_unescape(pattern, len);
+
+	if (!pat_len)
+	{
+		send_gdb_unsupported_msg();
+		return (-1);
+	}
+
+	/* Nothing to be found outside the addressable memory. */
+	if (addr >= REAL_MODE_LIMIT)
+		amnt = 0;
+	else
+		amnt = MIN(amnt, REAL_MODE_LIMIT - addr);
+
+	if (amnt < pat_len)
+	{
+		send_gdb_cmd("0", 1);
+		return (0);
+	}
+
+	if (pat_len > SEARCH_MAX_PAT)
+	{
+		gdb_search.active  = 1;
+		gdb_search.addr    = addr;
+		gdb_search.end     = addr + amnt;
+		gdb_search.pat_len = pat_len;
+		memcpy(gdb_search.pattern, pattern, pat_len);
+		gdb_search_continue();
+		return (0);
+	}
+
+	/*
+	 * Asks the serial device to search its memory
+	 *
+	 * 0xE7 <address-4-bytes-LE> <size-4-bytes-LE>
+	 *      <pattern-size-1-byte> <pattern>
+	 *
+	 * The answer is sent when the serial device replies.
+	 */
+	sw_bp_swap_range(addr, amnt, 1);
+	send_serial_byte(MSG_SEARCH_MEM);
+	send_serial_dword(addr);
+	send_serial_dword(amnt);
+	send_serial_byte(pat_len);
+	send_serial(pattern, pat_len);
+	sw_bp_swap_range(addr, amnt, 0);
+	return (0);
+}
+
+/**
+ * @brief Handles the 'CRC (qCRC)' command from GDB, used
+ * by 'compare-sections'.
+ *
+ * If the whole range is already in the cache, and none of
+ * it came from our writes (that is what compare-sections
+ * checks), the CRC is calculated here, otherwise, by the
+ * serial device, so that the memory does not need to be
+ * transferred.
+ *
+ * @param buff Buffer to be parsed.
+ * @param len Buffer length.
+ *
+ * @return Returns 0 if the request is valid, -1 otherwise.
+ */
+static int handle_gdb_crc(const char *buff, size_t len)
+{
+	static uint8_t chunk[READ_CHUNK_SIZE];
+	uint32_t addr, amnt, crc;
+	const char *ptr;
+	char reply[16];
+	size_t n;
+
+	ptr  = buff + sizeof("qCRC") - 1;
+	len -= sizeof("qCRC") - 1;
+
+	expect_char(':', ptr, len);
+	addr = read_int(ptr, &len, &ptr, 16);
+	expect_char(',', ptr, len);
+	amnt = simple_read_int(ptr, len, 16);
+
+	if (addr > REAL_MODE_LIMIT || amnt > REAL_MODE_LIMIT - addr)
+	{
+		send_gdb_error();
+		return (-1);
+	}
+
+	/* If we already have everything, there is no need to ask. */
+	if (cache_span(addr, amnt) == amnt && !cache_written(addr, amnt))
+	{
+		for (crc = CRC32_INIT; amnt; amnt -= n, addr += n)
+		{
+			n   = cache_read(addr, chunk, MIN(amnt, sizeof chunk));
+			crc = crc32_update(crc, chunk, n);
+		}
+
+		snprintf(reply, sizeof reply, "C%08x", crc);
+		send_gdb_cmd(reply, strlen(reply));
+		return (0);
+	}
+
+	/* Let GDB read the memory by itself. */
+	if (!(target_caps & CAP_CRC32))
+	{
+		send_gdb_unsupported_msg();
+		return (-1);
+	}
+
+	/*
+	 * Asks the serial device to calculate the CRC
+	 *
+	 * 0xE6 <address-4-bytes-LE> <size-4-bytes-LE>
+	 *
+	 * The answer is sent when the serial device replies.
+	 */
+	send_serial_byte(MSG_CRC32);
+	send_serial_dword(addr);
+	send_serial_dword(amnt);
+
+	/* The target sees our int3s. */
+	crc_fix = sw_bp_crc_fix(addr, amnt);
+	return (0);
+}
+
+/**
+ * @brief Handles the range step from GDB: the target
+ * keeps single-stepping while EIP is inside the range
+ * [@p start, @p end), and only then, stops.
+ *
+ * @param start Range start physical address.
+ * @param end Range end physical address (exclusive).
+ */
+static void handle_gdb_range_step(uint32_t start, uint32_t end)
+{
+	/* Without range stepping, a single-step is enough. */
+	if (!(target_caps & CAP_RANGE_STEP) || start >= end)
+	{
+		handle_gdb_single_step();
+		return;
+	}
+
+	/*
+	 * Range step command:
+	 * 0xC6 <start-4-bytes-LE> <end-4-bytes-LE>
+	 */
+	send_serial_byte(MSG_RANGE_STEP);
+	send_serial_dword(start);
+	send_serial_dword(end);
+	have_x86_regs = 0;
+	invalidate_memory();
+}
+
+/**
+ * @brief Handles the 'vCont' commands from GDB.
+ *
+ * Since there is a single thread, only the first action
+ * is considered, and signals are ignored. The supported
+ * actions are: continue (c/C), step (s/S) and, if the
+ * target supports it, range step (r).
+ *
+ * @param buff Buffer to be parsed.
+ * @param len Buffer length.
+ *
+ * @return Returns 0 if the command is valid, -1 otherwise.
+ */
+static int handle_gdb_vcont(const char *buff, size_t len)
+{
+	uint32_t start, end;
+	const char *ptr;
+
+	if (is_gdb_cmd(buff, len, "vCont?"))
+	{
+		if (target_caps & CAP_RANGE_STEP)
+			send_gdb_cmd("vCont;c;C;s;S;r", 15);
+		else
+			send_gdb_cmd("vCont;c;C;s;S", 13);
+		return (0);
+	}
+
+	if (!is_gdb_cmd(buff, len, "vCont;") || len < 7)
+	{
+		send_gdb_unsupported_msg();
+		return (-1);
+	}
+
+	ptr  = buff + 6;
+	len -= 6;
+
+	switch (*ptr) {
+	case 'c':
+	case 'C':
+		handle_gdb_continue();
+		break;
+	case 's':
+	case 'S':
+		handle_gdb_single_step();
+		break;
+	case 'r':
+		ptr++;
+		len--;
+		start = read_int(ptr, &len, &ptr, 16);
+		expect_char(',', ptr, len);
+		end = read_int(ptr, &len, &ptr, 16);
+		handle_gdb_range_step(start, end);
+		break;
+	default:
+		send_gdb_error();
+		return (-1);
+	}
+
+	return (0);
+}
+
+/**
+ * @brief Sends the text @p msg to be shown in the GDB
+ * console, as an 'O' packet.
+ *
+ * @param msg Message to be shown.
+ */
+static void send_gdb_console(const char *msg)
+{
+	char reply[256];
+	size_t len;
+
+	len = MIN(strlen(msg), (sizeof(reply) - 1) / 2);
+	reply[0] = 'O';
+	memcpy(reply + 1, encode_hex(msg, len), len * 2);
+	send_gdb_cmd(reply, len * 2 + 1);
+}
+
+/**
+ * @brief Closes the trace file while exiting.
+ */
+static void trace_close(void) {
+	fclose(trace_file);
+}
+
+/**
+ * @brief Handles the 'monitor trace' command from GDB.
+ *
+ * Usage: monitor trace on|flags addr [size] | off
+ *
+ * 'on' traces the CS:IP of each executed instruction,
+ * 'flags' also saves the FLAGS, and 'off' stops the trace.
+ * The trace buffer (target memory, overwritten) is @p addr
+ * (physical), with @p size bytes, and the trace goes to the
+ * trace file.
+ *
+ * @param cmd Monitor command, already decoded.
+ *
+ * @return Returns 0 if the command is valid, -1 otherwise.
+ */
+static int handle_gdb_monitor_trace(const char *cmd)
+{
+	uint32_t addr, size;
+	char mode[8];
+	int flags;
+	int entry;
+	int args;
+
+	addr = 0;
+	size = TRACE_DEFAULT_SIZE;
+
+	args = sscanf(cmd, "trace %7s %x %x", mode, &addr, &size);
+	if (args < 1)
+		goto usage;
+
+	if (!strcmp(mode, "on"))
+		flags = TRACE_ON;
+	else if (!strcmp(mode, "flags"))
+		flags = TRACE_ON|TRACE_FLAGS;
+	else if (!strcmp(mode, "off"))
+		flags = 0;
+	else
+		goto usage;
+
+	/* The buffer address is mandatory. */
+	if (flags && args < 2)
+		goto usage;
+
+	if (!(target_caps & CAP_TRACE))
+	{
+		send_gdb_console("Trace not supported by the target\n");
+		send_gdb_error();
+		return (-1);
+	}
+
+	/* The buffer should hold whole entries only. */
+	entry = (flags & TRACE_FLAGS) ? 6 : 4;
+	size -= size % entry;
+
+	if (flags && (size < (uint32_t)entry || size > TRACE_MAX_SIZE ||
+		addr > TRACE_MEM_LIMIT - size))
+	{
+		send_gdb_console("Invalid trace buffer\n");
+		send_gdb_error();
+		return (-1);
+	}
+
+	if (!trace_file)
+	{
+		if (!(trace_file = fopen(trace_path, "w")))
+		{
+			send_gdb_console("Unable to open the trace file\n");
+			send_gdb_error();
+			return (-1);
+		}
+		atexit(trace_close);
+	}
+
+	/*
+	 * Trace command:
+	 * 0xC5 <addr-4-bytes-LE> <size-2-bytes-LE> <flags-1-byte>
+	 *
+	 * The target replies with an OK.
+	 */
+	send_serial_byte(MSG_TRACE);
+	send_serial_dword(addr);
+	send_serial_word(size);
+	send_serial_byte(flags);
+	return (0);
+
+usage:
+	send_gdb_console("Usage: monitor trace on|flags addr [size] "
+		"| off\n");
+	send_gdb_error();
+	return (-1);
+}
+
+/**
+ * @brief Handles the 'monitor stats' command from GDB.
+ *
+ * Usage: monitor stats [reset]
+ *
+ * Shows the stats of the commands (see stats_print()),
+ * or clears them.
+ *
+ * @param cmd Monitor command, already decoded.
+ *
+ * @return Returns 0 if the command is valid, -1 otherwise.
+ */
+static int handle_gdb_monitor_stats(const char *cmd)
+{
+	char arg[8];
+
+	if (sscanf(cmd, "stats %7s", arg) == 1)
+	{
+		if (strcmp(arg, "reset"))
+		{
+			send_gdb_console("Usage: monitor stats [reset]\n");
+			send_gdb_error();
+			return (-1);
+		}
+		stats_reset();
+	}
+	else
+		stats_print(send_gdb_console);
+
+	send_gdb_ok();
+	return (0);
+}
+
+/**
+ * @brief Handles the 'monitor' (qRcmd) commands from GDB.
+ *
+ * Currently supported commands:
+ * - trace: instruction trace, see handle_gdb_monitor_trace().
+ * - stats: command stats, see handle_gdb_monitor_stats().
+ *
+ * @param buff Buffer to be parsed.
+ * @param len Buffer length.
+ *
+ * @return Returns 0 if the command is valid, -1 otherwise.
+ */
+static int handle_gdb_monitor(const char *buff, size_t len)
+{
+	const char *dec;
+	char cmd[128];
+
+	buff += sizeof("qRcmd,") - 1;
+	len  -= sizeof("qRcmd,") - 1;
+	len   = MIN(len / 2, sizeof(cmd) - 1);
+
+	dec = decode_hex(buff, len);
+	if (!dec)
+	{
+		send_gdb_error();
+		return (-1);
+	}
+
+	memcpy(cmd, dec, len);
+	cmd[len] = '\0';
+
+	if (is_gdb_cmd(cmd, len, "trace"))
+		return (handle_gdb_monitor_trace(cmd));
+
+	if (is_gdb_cmd(cmd, len, "stats"))
+		return (handle_gdb_monitor_stats(cmd));
+
+	send_gdb_unsupported_msg();
+	return (-1);
+}
+
+/**
+ * @brief Handles the general query (q) commands from GDB.
+ *
+ * Currently supported queries:
+ * - qSupported: tell GDB our max packet size and
+ *   that we support the no-ack mode.
+ * - qSearch:memory: search memory on the target.
+ * - qCRC: CRC32 of a memory range.
+ * - qRcmd: monitor commands.
+ *
+ * @param buff Buffer to be parsed.
+ * @param len Buffer length.
+ *
+ * @return Returns 0 if the command is valid, -1 otherwise.
+ */
+static int handle_gdb_query(char *buff, size_t len)
+{
+	char reply[128];
+	size_t i;
+
+	if (is_gdb_cmd(buff, len, "qSupported"))
+	{
+		/* Check if GDB knows the 'swbreak'/'hwbreak' stop reasons. */
+		for (i = 0; i + 8 <= len; i++)
+		{
+			if (!memcmp(buff + i, "swbreak+", 8))
+				gdb_swbreak = 1;
+			else if (!memcmp(buff + i, "hwbreak+", 8))
+				gdb_hwbreak = 1;
+		}
+
+		snprintf(reply, sizeof reply,
+			"PacketSize=%x;QStartNoAckMode+%s%s%s", GDB_PACKET_SIZE,
+			(target_caps & CAP_COND) ? ";ConditionalBreakpoints+" : "",
+			(target_caps & CAP_SW_BP) ? ";swbreak+" : "",
+			(target_caps & CAP_HW_BP) ? ";hwbreak+" : "");
+		send_gdb_cmd(reply, strlen(reply));
+		return (0);
+	}
+
+	if (is_gdb_cmd(buff, len, "qSearch:memory:"))
+		return (handle_gdb_search_memory(buff, len));
+
+	if (is_gdb_cmd(buff, len, "qCRC:"))
+		return (handle_gdb_crc(buff, len));
+
+	if (is_gdb_cmd(buff, len, "qRcmd,"))
+		return (handle_gdb_monitor(buff, len));
+
+	send_gdb_unsupported_msg();
+	return (-1);
+}
+
+/**
+ * @brief Handles the general set (Q) commands from GDB.
+ *
+ * Currently supported commands:
+ * - QStartNoAckMode: stop acking the packets from now on.
+ *
+ * @param buff Buffer to be parsed.
+ * @param len Buffer length.
+ *
+ * @return Returns 0 if the command is valid, -1 otherwise.
+ */
+static int handle_gdb_set(const char *buff, size_t len)
+{
+	if (is_gdb_cmd(buff, len, "QStartNoAckMode"))
+	{
+		/* This one still needs to be ack'ed. */
+		send_gdb_ok();
+		gdb_no_ack = 1;
+		return (0);
+	}
+
+	send_gdb_unsupported_msg();
+	return (-1);
+}
+
+/*
+ * Keeps all the variables for the GDB state machine here
+ */
+struct gdb_handle
+{
+	int    state;
+	int    csum;
+	size_t cmd_idx;
+	size_t cmd_size;
+	char   buff[4096];
+	char   csum_read[3];
+	char   *cmd_buff;
+} gdb_handle = {
+	.state = GDB_STATE_START
+};
+
+/**
+ * @brief Generic handler for all GDB commands/packets.
+ *
+ * This routine handles all messages and dispatches each
+ * of them for the appropriated handler, if any. If not
+ * supported, a not-supported packet is sent to GDB.
+ *
+ * @param gh GDB state machine data.
+ *
+ * @return Always 0.
+ */
+static int handle_gdb_cmd(struct gdb_handle *gh)
+{
+	int csum_chk;
+
+	csum_chk = (int) simple_read_int(gh->csum_read, 2, 16);
+	if (!gdb_no_ack && csum_chk != gh->csum)
+	{
+		send_gdb_nack();
+		errw("Checksum for message: %s (%d) doesn't match: %d!\n",
+			gh->cmd_buff, csum_chk, gh->csum);
+	}
+
+	/* Ack received message. */
+	send_gdb_ack();
+	stats_cmd_start(gh->cmd_buff[0], gh->cmd_idx);
+
+	/*
+	 * Handle single-char messages.
+	 *
+	 * From GDB docs:
+	 * > At a minimum, a stub is required to support the ‘?’
+	 *   command to tell GDB the reason for halting, ‘g’ and
+	 *   ‘G’ commands for register access, and the ‘m’ and
+	 *   ‘M’ commands for memory access.
+	 *
+	 * > Stubs that only control single-threaded targets can
+	 *   implement run control with the ‘c’ (continue)
+	 *   command, and if the target architecture supports
+	 *   hardware- assisted single-stepping, the ‘s’ (step)
+	 *   command.
+	 *
+	 * > ... All other commands are optional.
+	 */
+	switch (gh->cmd_buff[0]) {
+	/* Read registers. */
+	case 'g':
+		handle_gdb_read_registers();
+		break;
+	/* Read memory. */
+	case 'm':
+		handle_gdb_read_memory(gh->cmd_buff,
+			gh->cmd_idx);
+		break;
+	/* Memory write hex. */
+	case 'M':
+		handle_gdb_write_memory_hex(gh->cmd_buff,
+			gh->cmd_idx);
+		break;
+	/* Memory write binary. */
+	case 'X':
+		handle_gdb_write_memory_bin(gh->cmd_buff, gh->cmd_idx);
+		break;
+	/* Halt reason. */
+	case '?':
+		handle_gdb_halt_reason();
+		break;
+	/* Single-step. */
+	case 's':
+		handle_gdb_single_step();
+		break;
+	/* Continue. */
+	case 'c':
+		handle_gdb_continue();
+		break;
+	/* vCont. */
+	case 'v':
+		handle_gdb_vcont(gh->cmd_buff, gh->cmd_idx);
+		break;
+	/* Insert breakpoint. */
+	case 'Z':
+		handle_gdb_add_breakpoint(gh->cmd_buff,
+			gh->cmd_idx);
+		break;
+	/* Remove breakpoint. */
+	case 'z':
+		handle_gdb_remove_breakpoint(gh->cmd_buff,
+			gh->cmd_idx);
+		break;
+	/* Write register. */
+	case 'P':
+		handle_gdb_write_register(gh->cmd_buff,
+			gh->cmd_idx);
+		break;
+	/* General query. */
+	case 'q':
+		handle_gdb_query(gh->cmd_buff, gh->cmd_idx);
+		break;
+	/* General set. */
+	case 'Q':
+		handle_gdb_set(gh->cmd_buff, gh->cmd_idx);
+		break;
+	/* Not-supported messages. */
+	default:
+		send_gdb_unsupported_msg();
+		break;
+	}
+
+	return (0);
+}
+
+/* ------------------------------------------------------------------*
+ * GDB handling state machine                                        *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Handle the start of state for a GDB command.
+ *
+ * If any non-valid start of command is received, the char
+ * is silently ignored.
+ *
+ * @param gh GDB state machine data.
+ * @param curr_byte Current byte read.
+ */
+static void handle_gdb_state_start(struct gdb_handle *gh,
+	uint8_t curr_byte)
+{
+	/*
+	 * If Ctrl+C.
+	 *
+	 * Ctrl+C/break is a special command that doesn't need
+	 * to be ack'ed nor anything
+	 */
+	if (curr_byte == 3)
+	{
+		send_serial_ctrlc();
+		return;
+	}
+
+	/* Skip any char before a start of command. */
+	if (curr_byte != '$')
+		return;
+
+	gh->state   = GDB_STATE_CMD;
+	gh->csum    = 0;
+	gh->cmd_idx = 0;
+}
+
+/**
+ * @brief Handle the receipt of the first checksum digit.
+ *
+ * @param gh GDB state machine data.
+ * @param curr_byte Current byte read.
+ */
+static inline void handle_gdb_state_csum_d1(struct gdb_handle *gh,
+	uint8_t curr_byte)
+{
+	gh->csum_read[0] = curr_byte;
+	gh->state = GDB_STATE_CSUM_D2;
+}
+
+/**
+ * @brief Handle the receipt of the last checksum digit.
+ *
+ * This also marks the end of the command, so the command
+ * in this stage is completely received and ready to be
+ * parsed.
+ *
+ * @param gh GDB state machine data.
+ * @param curr_byte Current byte read.
+ */
+static inline void handle_gdb_state_csum_d2(struct gdb_handle *gh,
+	uint8_t curr_byte)
+{
+	gh->csum_read[1] = curr_byte;
+	gh->state        = GDB_STATE_START;
+	gh->csum        &= 0xFF;
+
+	/* Handles the command. */
+	handle_gdb_cmd(gh);
+
+	LOG_CMD_REC("Command: (%s), csum: %x, csum_read: %s\n",
+		gh->cmd_buff, gh->csum, gh->csum_read);
+}
+
+/**
+ * @brief Handle the command data.
+ *
+ * While already received a command, this routine saves its
+ * content until the marker of end-of-command (#). The command
+ * buffer grows as needed, since GDB is free to send packets
+ * as big as the advertised packet size.
+ *
+ * @param gh GDB state machine data.
+ * @param curr_byte Current byte read.
+ */
+static inline void handle_gdb_state_cmd(struct gdb_handle *gh,
+	uint8_t curr_byte)
+{
+	char *tmp;
+
+	/* Grow the buffer if needed (keeping room for the NUL). */
+	if (gh->cmd_idx + 1 >= gh->cmd_size)
+	{
+		tmp = realloc(gh->cmd_buff, MAX(gh->cmd_size * 2, 512));
+		if (!tmp)
+			errx("Unable to grow command buffer (%zu bytes)!\n",
+				gh->cmd_size);
+		gh->cmd_buff  = tmp;
+		gh->cmd_size  = MAX(gh->cmd_size * 2, 512);
+	}
+
+	if (curr_byte == '#')
+	{
+		gh->cmd_buff[gh->cmd_idx] = '\0';
+		gh->state = GDB_STATE_CSUM_D1;
+		return;
+	}
+	gh->csum += curr_byte;
+	gh->cmd_buff[gh->cmd_idx++] = curr_byte;
+}
+
+/**
+ * @brief For each byte received, calls the appropriate
+ * handler, accordingly with the byte and the current
+ * state.
+ *
+ * @param hfd GDB socket handler.
+ */
+void handle_gdb_msg(struct handler_fd *hfd)
+{
+	int i;
+	ssize_t ret;
+	uint8_t curr_byte;
+
+	gdb_fd = hfd->fd;
+
+	ret = recv(gdb_fd, gdb_handle.buff, sizeof gdb_handle.buff, 0);
+	if (ret <= 0)
+		errx("GDB closed!\n");
+
+	capture_data(gdb_fd, CAPTURE_IN, gdb_handle.buff, ret);
+
+	for (i = 0; i < ret; i++)
+	{
+		curr_byte = gdb_handle.buff[i] & 0xFF;
+
+		switch (gdb_handle.state) {
+		/* Decide which state to go. */
+		case GDB_STATE_START:
+			handle_gdb_state_start(&gdb_handle, curr_byte);
+			break;
+		/* First digit checksum. */
+		case GDB_STATE_CSUM_D1:
+			handle_gdb_state_csum_d1(&gdb_handle, curr_byte);
+			break;
+		/* Second digit checsum. */
+		case GDB_STATE_CSUM_D2:
+			handle_gdb_state_csum_d2(&gdb_handle, curr_byte);
+			break;
+		/* Inside a command. */
+		case GDB_STATE_CMD:
+			handle_gdb_state_cmd(&gdb_handle, curr_byte);
+			break;
+		}
+	}
+
+	serial_flush();
 }
 
-/*
- * Keeps all the variables for the GDB state machine here
- */
-struct gdb_handle
-{
-	int  state;
-	int  csum;
-	int  cmd_idx;
-	char buff[32];
-	char csum_read[3];
-	char cmd_buff[512];
-} gdb_handle = {
-	.state = GDB_STATE_START
-};
+/* ------------------------------------------------------------------*
+ * Serial handlers                                                   *
+ * ------------------------------------------------------------------*/
 
 /**
- * @brief Generic handler for all GDB commands/packets.
+ * @brief Handles a read memory.
  *
- * This routine handles all messages and dispatches each
- * of them for the appropriated handler, if any. If not
- * supported, a not-supported packet is sent to GDB.
+ * In this point the serial device had already read the
+ * memory and sent to the bridge. The memory is (almost)
+ * ready to be sent to GDB.
  *
- * @param gh GDB state machine data.
+ * *Almost because while in interrupt-based mode, the
+ * contents of the memory will change in order to keep
+ * the CPU cool (hlt+jmp hlt). Due to that, if the
+ * memory read overlaps the overwritten instructions,
+ * we need to patch with the original instructions.
+ *
+ * The (patched) memory is then saved into the cache and
+ * streamed to GDB from there, if part of its request.
  *
  * @return Always 0.
  */
-static int handle_gdb_cmd(struct gdb_handle *gh)
+static int handle_serial_receive_read_memory(void)
 {
-	int csum_chk;
+#ifndef UART_POLLING
+	int i, j, k, count;
+	uint32_t break_eip;
+	int sindex, eindex;
+	uint32_t start_addr, end_addr;
 
-	csum_chk = (int) simple_read_int(gh->csum_read, 2, 16);
-	if (csum_chk != gh->csum)
-		errw("Checksum for message: %s (%d) doesn't match: %d!\n",
-			gh->cmd_buff, csum_chk, gh->csum);
+	/* We need to check if the retrieved memory
+	 * belongs do instruction or data.
+	 *
+	 * If instruction, given the base address
+	 * check if there is a need to patch
+	 * with our saved insns or not.
+	 *
+	 * If data, nothing need to be done.
+	 */
+	break_eip  = x86_regs.r.eip;
+	start_addr = last_dump_phys_addr;
+	end_addr   = start_addr + last_dump_amnt - 1;
 
-	/* Ack received message. */
-	send_gdb_ack();
+	/*
+	 * Check if our break-point EIP is inside the range
+	 * of the dumped memory.
+	 */
+	if ((start_addr < break_eip && end_addr < break_eip)
+		|| start_addr > break_eip + 3)
+	{
+		goto no_patch;
+	}
+
+	/* Calculate indexes and patch it. */
+	if (start_addr < break_eip)
+	{
+		i = break_eip - start_addr;
+		j = 0;
+		count = MIN(end_addr - break_eip + 1, 4);
+	}
+	else
+	{
+		i = 0;
+		j = start_addr - break_eip;
+		count = MIN(break_eip + 3, end_addr) - start_addr + 1;
+	}
+
+	/* Patch. */
+	for (k = 0; k < count; k++, i++, j++)
+		dump_buffer[i] = x86_stop_data.d.saved_insns[j];
+
+no_patch:
+#endif /* !UART_POLLING. */
+
+	/* And our int3s. */
+	sw_bp_patch_read(last_dump_phys_addr, dump_buffer, last_dump_amnt);
 
 	/*
-	 * Handle single-char messages.
-	 *
-	 * From GDB docs:
-	 * > At a minimum, a stub is required to support the ‘?’
-	 *   command to tell GDB the reason for halting, ‘g’ and
-	 *   ‘G’ commands for register access, and the ‘m’ and
-	 *   ‘M’ commands for memory access.
-	 *
-	 * > Stubs that only control single-threaded targets can
-	 *   implement run control with the ‘c’ (continue)
-	 *   command, and if the target architecture supports
-	 *   hardware- assisted single-stepping, the ‘s’ (step)
-	 *   command.
+	 * Data that got outdated while in-flight is dropped,
+	 * and bytes already in the cache are kept, as they
+	 * might have been written after this was requested.
+	 */
+	if (!read_fetch.stale[read_fetch.head])
+		cache_merge(last_dump_phys_addr, dump_buffer, last_dump_amnt);
+
+	read_fetch.head = (read_fetch.head + 1) % READ_PIPELINE;
+	read_fetch.count--;
+
+	/* Keep the pipeline full and send what we have to GDB. */
+	read_fetch_issue();
+	gdb_read_continue();
+	gdb_search_continue();
+	return (0);
+}
+
+/**
+ * @brief Handles the data received when the machine stops.
+ *
+ * Whenever the debugger stops, when machine sends to us
+ * multiple data, including all of its registers. This
+ * function takes all these registers and saves them
+ * into the cache, as well as send the appropriate
+ * messages to GDB to signalize that we're stopped.
+ *
+ * @param x86_rm Real mode x86 registers.
+ * @param expedited If the stop data also has the memory
+ *                  at CS:IP and SS:SP.
+ */
+static void handle_serial_single_step_stop(struct srm_x86_regs *x86_rm,
+	int expedited)
+{
+	uint8_t mem[EXPEDITE_SIZE];
+
+	/* The target was running, whatever we have is outdated. */
+	invalidate_memory();
+
+	x86_regs.r.eax = x86_rm->eax;
+	x86_regs.r.ecx = x86_rm->ecx;
+	x86_regs.r.edx = x86_rm->edx;
+	x86_regs.r.ebx = x86_rm->ebx;
+
+	/*
+	 * We need to disconsider the first 8 16-bit
+	 * registers already pushed in the stack.
 	 *
-	 * > ... All other commands are optional.
+	 * Also, we have to convert our ESP/EBP pointers
+	 * to physical addresses...
 	 */
-	switch (gh->cmd_buff[0]) {
-	/* Read registers. */
-	case 'g':
-		handle_gdb_read_registers();
-		break;
-	/* Read memory. */
-	case 'm':
-		handle_gdb_read_memory(gh->cmd_buff,
-			sizeof gh->cmd_buff);
-		break;
-	/* Memory write hex. */
-	case 'M':
-		handle_gdb_write_memory_hex(gh->cmd_buff,
-			sizeof gh->cmd_buff);
-		break;
-	/* Halt reason. */
-	case '?':
-		handle_gdb_halt_reason();
-		break;
-	/* Single-step. */
-	case 's':
-		handle_gdb_single_step();
-		break;
-	/* Continue. */
-	case 'c':
-		handle_gdb_continue();
-		break;
-	/* Insert breakpoint. */
-	case 'Z':
-		handle_gdb_add_breakpoint(gh->cmd_buff,
-			sizeof gh->cmd_buff);
-		break;
-	/* Remove breakpoint. */
-	case 'z':
-		handle_gdb_remove_breakpoint(gh->cmd_buff,
-			sizeof gh->cmd_buff);
-		break;
-	/* Write register. */
-	case 'P':
-		handle_gdb_write_register(gh->cmd_buff,
-			sizeof gh->cmd_buff);
-		break;
-	/* Not-supported messages. */
-	default:
-		send_gdb_unsupported_msg();
-		break;
+	x86_regs.r.esp = TO_PHYS(x86_rm->ss, x86_rm->esp + (2*8));
+	x86_regs.r.ebp = TO_PHYS(x86_rm->ss, x86_rm->ebp);
+
+	x86_regs.r.esi = x86_rm->esi;
+	x86_regs.r.edi = x86_rm->edi;
+
+	/*
+	 * Fix EIP in order to tell GDB correctly
+	 */
+	x86_regs.r.eip = TO_PHYS(x86_rm->cs, x86_rm->eip);
+
+	x86_regs.r.eflags = x86_rm->eflags;
+	x86_regs.r.cs = x86_rm->cs;
+	x86_regs.r.ss = x86_rm->ss;
+	x86_regs.r.ds = x86_rm->ds;
+	x86_regs.r.es = x86_rm->es;
+	x86_regs.r.fs = x86_rm->fs;
+	x86_regs.r.gs = x86_rm->gs;
+	have_x86_regs = 1;
+
+	/*
+	 * Expedited stops also bring the memory around EIP and
+	 * ESP, which is what GDB reads first. Skip if the window
+	 * wraps around the segment, since it would not be
+	 * contiguous.
+	 */
+	if (expedited)
+	{
+		if (x86_rm->eip + EXPEDITE_SIZE <= 0x10000)
+		{
+			memcpy(mem, x86_stop_data.d.code, EXPEDITE_SIZE);
+			sw_bp_patch_read(x86_regs.r.eip, mem, EXPEDITE_SIZE);
+			cache_fill(x86_regs.r.eip, mem, EXPEDITE_SIZE);
+		}
+		if (x86_rm->esp + (2*8) + EXPEDITE_SIZE <= 0x10000)
+		{
+			memcpy(mem, x86_stop_data.d.stack, EXPEDITE_SIZE);
+			sw_bp_patch_read(x86_regs.r.esp, mem, EXPEDITE_SIZE);
+			cache_fill(x86_regs.r.esp, mem, EXPEDITE_SIZE);
+		}
+	}
+
+	/* Negotiate the target capabilities at the first stop. */
+	if (!hello_sent)
+	{
+		send_serial_byte(MSG_HELLO);
+		send_serial_word(BRIDGE_CAPS);
+		hello_sent = 1;
+	}
+
+	if (gdb_fd <= 0)
+	{
+		if (link_ready)
+			printf("Single-stepped, you can now connect GDB!\n");
 	}
 
-	return (0);
-}
+	/*
+	 * If there is a valid connection already,
+	 * tell GDB that we're already stopped.
+	 */
+	else
+		send_gdb_halt_reason();
+
+
+#ifdef DUMP_REGS
+	printf("eax: 0x%x\n", x86_regs.r.eax);
+	printf("ebx: 0x%x\n", x86_regs.r.ebx);
+	printf("ecx: 0x%x\n", x86_regs.r.ecx);
+	printf("edx: 0x%x\n", x86_regs.r.edx);
+	printf("esi: 0x%x\n", x86_regs.r.esi);
+	printf("edi: 0x%x\n", x86_regs.r.edi);
+	printf("ebp: 0x%x\n", x86_regs.r.ebp);
+	printf("esp: 0x%x\n", x86_regs.r.esp);
+	printf("eip: 0x%x\n", x86_regs.r.eip);
+	printf("eflags: 0x%x\n", x86_regs.r.eflags);
+	printf("cs: 0x%x\n", x86_regs.r.cs);
+	printf("ds: 0x%x\n", x86_regs.r.ds);
+	printf("es: 0x%x\n", x86_regs.r.es);
+	printf("ss: 0x%x\n", x86_regs.r.ss);
+	printf("fs: 0x%x\n", x86_regs.r.fs);
+	printf("gs: 0x%x\n", x86_regs.r.gs);
+#endif
+}
+
+/* ------------------------------------------------------------------*
+ * Serial handling state machine                                     *
+ * ------------------------------------------------------------------*/
+
+/* Serial receive buffer, handled entirely on each read. */
+#define SERIAL_RX_SIZE 0x10000
+
+/* Serial state machine data. */
+struct serial_handle
+{
+	int  state;
+	int  buff_idx;
+	int  expedited;
+	int  rle_count;
+	int  rle_run;
+	char csum_read[3];
+	char cmd_buff[64];
+
+	/* Delta stops: where each byte goes in x86_stop_data. */
+	uint8_t delta_map[sizeof(union x86_stop_data)];
+	int     delta_len;
+
+	/* Trace data: entry size and bytes left. */
+	int trace_entry;
+	int trace_left;
+
+	/* Received bytes. */
+	uint8_t rx[SERIAL_RX_SIZE];
+} serial_handle = {
+	.state = SERIAL_STATE_START
+};
 
-/* ------------------------------------------------------------------*
- * GDB handling state machine                                        *
- * ------------------------------------------------------------------*/
 
 /**
- * @brief Handle the start of state for a GDB command.
+ * @brief Handle the start of state for a serial command.
  *
  * If any non-valid start of command is received, the char
  * is silently ignored.
  *
- * @param gh GDB state machine data.
+ * Valid start states are: stop, read-memory or ok
+ *
+ * @param sh Serial state machine data.
  * @param curr_byte Current byte read.
+ *
+ * @note The messages sent from serial, are, in fact,
+ * responses from earlier GDB messages, so thats why
+ * number of possible responses are small: most of the
+ * commands only an 'OK' is required.
  */
-static void handle_gdb_state_start(struct gdb_handle *gh,
+static void handle_serial_state_start(struct serial_handle *sh,
 	uint8_t curr_byte)
 {
-	/*
-	 * If Ctrl+C.
-	 *
-	 * Ctrl+C/break is a special command that doesn't need
-	 * to be ack'ed nor anything
-	 */
-	if (curr_byte == 3)
+	if (curr_byte == MSG_SINGLE_STEP ||
+		curr_byte == MSG_STOP_EXPEDITED)
 	{
-		send_serial_ctrlc();
-		return;
+		sh->state     = MSG_SINGLE_STEP;
+		sh->buff_idx  = 0;
+		sh->expedited = (curr_byte == MSG_STOP_EXPEDITED);
+		memset(&x86_stop_data, 0, sizeof(union x86_stop_data));
+	}
+	else if (curr_byte == MSG_STOP_DELTA ||
+		curr_byte == MSG_STOP_DELTA_EXP)
+	{
+		sh->state     = MSG_STOP_DELTA;
+		sh->buff_idx  = 0;
+		sh->expedited = (curr_byte == MSG_STOP_DELTA_EXP);
+	}
+	else if (curr_byte == MSG_READ_MEM ||
+		curr_byte == MSG_READ_MEM_RLE)
+	{
+		if (!read_fetch.count)
+			errx("Unexpected memory from serial!\n");
+
+		sh->state     = curr_byte;
+		sh->buff_idx  = 0;
+		sh->rle_count = 0;
+		last_dump_phys_addr = read_fetch.addr[read_fetch.head];
+		last_dump_amnt      = read_fetch.amnt[read_fetch.head];
+	}
+	else if (curr_byte == MSG_HELLO ||
+		curr_byte == MSG_SEARCH_MEM ||
+		curr_byte == MSG_CRC32 ||
+		curr_byte == MSG_SW_BP)
+	{
+		sh->state    = curr_byte;
+		sh->buff_idx = 0;
+	}
+	else if (curr_byte == MSG_TRACE_DATA)
+	{
+		sh->state       = curr_byte;
+		sh->buff_idx    = 0;
+		sh->trace_entry = 0;
+	}
+	else if (curr_byte == MSG_OK)
+	{
+		if (serial_ok_skip)
+			serial_ok_skip--;
+		else
+			send_gdb_ok();
 	}
-
-	/* Skip any char before a start of command. */
-	if (curr_byte != '$')
-		return;
-
-	gh->state   = GDB_STATE_CMD;
-	memset(gh->cmd_buff, 0, sizeof gh->cmd_buff);
-	gh->csum    = 0;
-	gh->cmd_idx = 0;
 }
 
 /**
- * @brief Handle the receipt of the first checksum digit.
+ * @brief Handle the machine stop data and reason.
  *
- * @param gh GDB state machine data.
- * @param curr_byte Current byte read.
+ * This function grabs the stop data and calls the appropriate
+ * handler.
+ *
+ * @param sh Serial state machine data.
+ * @param buff Bytes received.
+ * @param len Amount of bytes, at least 1.
+ *
+ * @return Amount of bytes used.
  */
-static inline void handle_gdb_state_csum_d1(struct gdb_handle *gh,
-	uint8_t curr_byte)
+static size_t handle_serial_state_ss(struct serial_handle *sh,
+	const uint8_t *buff, size_t len)
 {
-	gh->csum_read[0] = curr_byte;
-	gh->state = GDB_STATE_CSUM_D2;
+	size_t x86_size = sizeof(union x86_stop_data);
+	size_t end, amnt;
+
+	/* Non-expedited stops do not have the code/stack bytes. */
+	end = x86_size;
+	if (!sh->expedited &&
+		(size_t)sh->buff_idx < offsetof(struct d, code))
+	{
+		end = offsetof(struct d, code);
+	}
+
+	/* Save stopped data. */
+	amnt = MIN(len, end - sh->buff_idx);
+	memcpy(x86_stop_data.data + sh->buff_idx, buff, amnt);
+	sh->buff_idx += amnt;
+
+	if (!sh->expedited &&
+		(size_t)sh->buff_idx == offsetof(struct d, code))
+	{
+		sh->buff_idx += 2 * EXPEDITE_SIZE;
+	}
+
+	/* Check if ended. */
+	if ((size_t)sh->buff_idx == x86_size)
+	{
+		sh->state = SERIAL_STATE_START;
+		handle_serial_single_step_stop(&x86_stop_data.d.x86_regs,
+			sh->expedited);
+	}
+	return (amnt);
 }
 
 /**
- * @brief Handle the receipt of the last checksum digit.
- *
- * This also marks the end of the command, so the command
- * in this stage is completely received and ready to be
- * parsed.
+ * @brief Adds a field of x86_stop_data to the list of
+ * fields expected in a delta stop.
  *
- * @param gh GDB state machine data.
- * @param curr_byte Current byte read.
+ * @param sh Serial state machine data.
+ * @param off Field offset in x86_stop_data.
+ * @param len Field length.
  */
-static inline void handle_gdb_state_csum_d2(struct gdb_handle *gh,
-	uint8_t curr_byte)
+static void delta_map_add(struct serial_handle *sh, size_t off,
+	size_t len)
 {
-	gh->csum_read[1] = curr_byte;
-	gh->state        = GDB_STATE_START;
-	gh->csum        &= 0xFF;
-
-	/* Handles the command. */
-	handle_gdb_cmd(gh);
-
-	LOG_CMD_REC("Command: (%s), csum: %x, csum_read: %s\n",
-		gh->cmd_buff, gh->csum, gh->csum_read);
+	while (len--)
+		sh->delta_map[sh->delta_len++] = off++;
 }
 
 /**
- * @brief Handle the command data.
+ * @brief Handle the machine stop data, when sent as
+ * a delta stop.
  *
- * While already received a command, this routine saves its
- * content until the marker of end-of-command (#).
+ * Instead of all the registers, the delta stop only has
+ * the ones that changed since the previous stop, as told
+ * by a change mask. Since x86_stop_data still holds the
+ * previous registers, only the changed ones are replaced.
  *
- * @param gh GDB state machine data.
- * @param curr_byte Current byte read.
+ * The message is: change mask (2 bytes), stop reason,
+ * stop address (if not a normal stop), changed registers,
+ * and then, the same as the other stop formats.
+ *
+ * @param sh Serial state machine data.
+ * @param buff Bytes received.
+ * @param len Amount of bytes, at least 1.
+ *
+ * @return Amount of bytes used.
  */
-static inline void handle_gdb_state_cmd(struct gdb_handle *gh,
-	uint8_t curr_byte)
+static size_t handle_serial_state_ss_delta(struct serial_handle *sh,
+	const uint8_t *buff, size_t len)
 {
-	if (curr_byte == '#')
+	struct d *d = &x86_stop_data.d;
+	size_t amnt = 1;
+	uint16_t mask;
+	int i;
+
+	/* Header: change mask + stop reason. */
+	if (sh->buff_idx < 3)
 	{
-		gh->state = GDB_STATE_CSUM_D1;
-		return;
+		sh->cmd_buff[sh->buff_idx++] = *buff;
+		if (sh->buff_idx < 3)
+			return (amnt);
+
+		mask  = (uint8_t)sh->cmd_buff[0];
+		mask |= (uint8_t)sh->cmd_buff[1] << 8;
+		d->stop_reason = sh->cmd_buff[2];
+		d->stop_addr   = 0;
+
+		/* Build the list of what comes next. */
+		sh->delta_len = 0;
+		if (d->stop_reason != STOP_REASON_NORMAL)
+			delta_map_add(sh, offsetof(struct d, stop_addr), 4);
+
+		for (i = 0; i < 16; i++)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+			if (i < 8)
+				delta_map_add(sh, i * 4, 4);
+			else
+				delta_map_add(sh, 32 + (i - 8) * 2, 2);
+		}
+
+		if (sh->expedited)
+			delta_map_add(sh, offsetof(struct d, code), 2*EXPEDITE_SIZE);
+#ifndef UART_POLLING
+		delta_map_add(sh, offsetof(struct d, saved_insns), 4);
+#endif
 	}
-	gh->csum += curr_byte;
 
-	/* Emit a warning if command exceeds buffer size. */
-	if ((size_t)gh->cmd_idx > sizeof gh->cmd_buff - 2)
-		errx("Command exceeds buffer size (%zu): %s\n",
-			sizeof gh->cmd_buff, gh->cmd_buff);
+	/* Fields. */
+	else
+	{
+		i    = sh->buff_idx - 3;
+		amnt = MIN(len, (size_t)(sh->delta_len - i));
+		sh->buff_idx += amnt;
+		while (i < sh->buff_idx - 3)
+			x86_stop_data.data[sh->delta_map[i++]] = *buff++;
+	}
 
-	gh->cmd_buff[gh->cmd_idx++] = curr_byte;
+	/* Check if ended. */
+	if (sh->buff_idx - 3 == sh->delta_len)
+	{
+		sh->state = SERIAL_STATE_START;
+		handle_serial_single_step_stop(&d->x86_regs, sh->expedited);
+	}
+	return (amnt);
 }
 
 /**
- * @brief For each byte received, calls the appropriate
- * handler, accordingly with the byte and the current
- * state.
+ * @brief Handles the debugger response to an earlier
+ * GDB read memory command.
  *
- * @param hfd Socket handler (not used).
+ * @param sh Serial state data.
+ * @param buff Bytes received.
+ * @param len Amount of bytes, at least 1.
+ *
+ * @return Amount of bytes used.
+ *
+ * @note The data length is already saved when GDB
+ * asks to read.
  */
-void handle_gdb_msg(struct handler_fd *hfd)
+static size_t handle_serial_state_read_mem_cmd(struct serial_handle *sh,
+	const uint8_t *buff, size_t len)
 {
-	((void)hfd);
-
-	int i;
-	ssize_t ret;
-	uint8_t curr_byte;
+	size_t amnt;
 
-	ret = recv(gdb_fd, gdb_handle.buff, sizeof gdb_handle.buff, 0);
-	if (ret <= 0)
-		errx("GDB closed!\n");
+	amnt = MIN(len, (size_t)(last_dump_amnt - sh->buff_idx));
+	memcpy(dump_buffer + sh->buff_idx, buff, amnt);
+	sh->buff_idx += amnt;
 
-	for (i = 0; i < ret; i++)
+	if (sh->buff_idx == last_dump_amnt)
 	{
-		curr_byte = gdb_handle.buff[i] & 0xFF;
-
-		switch (gdb_handle.state) {
-		/* Decide which state to go. */
-		case GDB_STATE_START:
-			handle_gdb_state_start(&gdb_handle, curr_byte);
-			break;
-		/* First digit checksum. */
-		case GDB_STATE_CSUM_D1:
-			handle_gdb_state_csum_d1(&gdb_handle, curr_byte);
-			break;
-		/* Second digit checsum. */
-		case GDB_STATE_CSUM_D2:
-			handle_gdb_state_csum_d2(&gdb_handle, curr_byte);
-			break;
-		/* Inside a command. */
-		case GDB_STATE_CMD:
-			handle_gdb_state_cmd(&gdb_handle, curr_byte);
-			break;
-		}
+		sh->state = SERIAL_STATE_START;
+		handle_serial_receive_read_memory();
 	}
+	return (amnt);
 }
 
-/* ------------------------------------------------------------------*
- * Serial handlers                                                   *
- * ------------------------------------------------------------------*/
 
 /**
- * @brief Handles a read memory.
+ * @brief Handles the debugger response to an earlier
+ * GDB read memory command, RLE-compressed.
  *
- * In this point the serial device had already read the
- * memory and sent to the bridge. The memory is (almost)
- * ready to be sent to GDB.
+ * @param sh Serial state data.
+ * @param buff Bytes received.
+ * @param len Amount of bytes, at least 1.
  *
- * *Almost because while in interrupt-based mode, the
- * contents of the memory will change in order to keep
- * the CPU cool (hlt+jmp hlt). Due to that, if the
- * memory read overlaps the overwritten instructions,
- * we need to patch with the original instructions.
+ * @return Amount of bytes used.
  *
- * @return Always 0.
+ * @note See rle_encode() for the format.
  */
-static int handle_serial_receive_read_memory(void)
+static size_t handle_serial_state_read_mem_rle(struct serial_handle *sh,
+	const uint8_t *buff, size_t len)
 {
-	char *memory;
+	size_t used = 1;
+	int amnt;
 
-#ifndef UART_POLLING
-	int i, j, k, count;
-	uint32_t break_eip;
-	int sindex, eindex;
-	uint32_t start_addr, end_addr;
+	/* Control byte. */
+	if (!sh->rle_count)
+	{
+		if (*buff < RLE_MAX_LIT)
+		{
+			sh->rle_count = *buff + 1;
+			sh->rle_run   = 0;
+		}
+		else
+		{
+			sh->rle_count = *buff - 0x80 + RLE_MIN_RUN;
+			sh->rle_run   = 1;
+		}
+		return (used);
+	}
 
-	/* We need to check if the retrieved memory
-	 * belongs do instruction or data.
-	 *
-	 * If instruction, given the base address
-	 * check if there is a need to patch
-	 * with our saved insns or not.
-	 *
-	 * If data, nothing need to be done.
-	 */
-	break_eip  = x86_regs.r.eip;
-	start_addr = last_dump_phys_addr;
-	end_addr   = start_addr + last_dump_amnt - 1;
+	/* Repeated or literal bytes. */
+	amnt = MIN(sh->rle_count, last_dump_amnt - sh->buff_idx);
+	if (sh->rle_run)
+	{
+		memset(dump_buffer + sh->buff_idx, *buff, amnt);
+		sh->rle_count = 0;
+	}
+	else
+	{
+		amnt = MIN((size_t)amnt, len);
+		memcpy(dump_buffer + sh->buff_idx, buff, amnt);
+		sh->rle_count -= amnt;
+		used = amnt;
+	}
+	sh->buff_idx += amnt;
 
-	/*
-	 * Check if our break-point EIP is inside the range
-	 * of the dumped memory.
-	 */
-	if ((start_addr < break_eip && end_addr < break_eip)
-		|| start_addr > break_eip + 3)
+	if (sh->buff_idx == last_dump_amnt)
 	{
-		goto no_patch;
+		sh->state = SERIAL_STATE_START;
+		handle_serial_receive_read_memory();
 	}
+	return (used);
+}
 
-	/* Calculate indexes and patch it. */
-	if (start_addr < break_eip)
+/**
+ * @brief Negotiates the fastest serial speed that both the
+ * target and this system support, up to serial_baud.
+ *
+ * This is done synchronously, see serial_link_setup().
+ */
+static void negotiate_serial_baud(void)
+{
+	static const int rates[] = {921600, 460800, 230400};
+	uint8_t reply[2];
+	size_t i;
+
+	for (i = 0; i < sizeof rates / sizeof rates[0]; i++)
 	{
-		i = break_eip - start_addr;
-		j = 0;
-		count = MIN(end_addr - break_eip + 1, 4);
+		if (rates[i] > serial_baud || !has_serial_speed(rates[i]))
+			continue;
+
+		/*
+		 * Baud command:
+		 * 0xBF <speed-4-bytes-LE>
+		 *
+		 * Replied with 0xBF and 1 if the target is switching
+		 * to it, 0 if its UART clock does not allow it.
+		 */
+		send_serial_byte(MSG_BAUD);
+		send_serial_dword(rates[i]);
+
+		if (read_timeout(serial_fd, reply, 2, BAUD_REPLY_MS) != 2 ||
+			reply[0] != MSG_BAUD)
+		{
+			errx("Unexpected reply while negotiating the speed!\n");
+		}
+
+		if (!reply[1])
+			continue;
+
+		/* Check if the new speed works. */
+		if (set_serial_speed(serial_fd, rates[i]) == 0)
+		{
+			send_serial_byte(BAUD_PROBE);
+			if (read_timeout(serial_fd, reply, 1, BAUD_PROBE_MS) == 1 &&
+				reply[0] == BAUD_PROBE_ACK)
+			{
+				printf("Serial speed: %d bps\n", rates[i]);
+				return;
+			}
+		}
+
+		/* It does not, wait for the target to go back too. */
+		usleep(BAUD_REVERT_MS * 1000);
+		if (set_serial_speed(serial_fd, SERIAL_DEFAULT_BAUD) < 0)
+			errx("Unable to restore the serial speed!\n");
 	}
-	else
+}
+
+/**
+ * @brief Switches both sides to the framed mode.
+ *
+ * Like the speed, this is done synchronously (see
+ * serial_link_setup()), and the reply is not framed yet.
+ */
+static void negotiate_serial_framing(void)
+{
+	uint8_t reply;
+
+	send_serial_byte(MSG_FRAMED);
+	if (read_timeout(serial_fd, &reply, 1, FRAME_REPLY_MS) != 1 ||
+		reply != MSG_FRAMED)
 	{
-		i = 0;
-		j = start_addr - break_eip;
-		count = MIN(break_eip + 3, end_addr) - start_addr + 1;
+		errx("Unexpected reply while enabling the framed mode!\n");
 	}
 
-	/* Patch. */
-	for (k = 0; k < count; k++, i++, j++)
-		dump_buffer[i] = x86_stop_data.d.saved_insns[j];
+	memset(&frame, 0, sizeof frame);
+	frame.on = 1;
+	printf("Framed mode enabled\n");
+}
 
-no_patch:
-#endif /* !UART_POLLING. */
+/**
+ * @brief Negotiates the serial speed and framing, once
+ * the hello is replied and everything read is handled.
+ *
+ * The negotiations read their replies synchronously,
+ * which is only safe because nothing else is in flight:
+ * the hello is sent at the first stop, and GDB is only
+ * allowed to connect after this.
+ */
+static void serial_link_setup(void)
+{
+	link_pending = 0;
 
-	memory = encode_hex((char*)dump_buffer, last_dump_amnt);
-	free(dump_buffer);
+	if ((target_caps & CAP_BAUD) && serial_baud > SERIAL_DEFAULT_BAUD)
+		negotiate_serial_baud();
 
-	/* Send memory to GDB. */
-	send_gdb_cmd(memory, last_dump_amnt * 2);
-	return (0);
+	if (frame_wanted)
+	{
+		if (target_caps & CAP_FRAMED)
+			negotiate_serial_framing();
+		else
+			printf("Target does not support the framed mode!\n");
+	}
+
+	link_ready = 1;
+	printf("Single-stepped, you can now connect GDB!\n");
 }
 
 /**
- * @brief Handles the data received when the machine stops.
- *
- * Whenever the debugger stops, when machine sends to us
- * multiple data, including all of its registers. This
- * function takes all these registers and saves them
- * into the cache, as well as send the appropriate
- * messages to GDB to signalize that we're stopped.
+ * @brief Handles the target capabilities, sent as a
+ * response of our hello.
  *
- * @param x86_rm Real mode x86 registers.
+ * @param sh Serial state data.
+ * @param curr_byte Current byte read.
  */
-static void handle_serial_single_step_stop(struct srm_x86_regs *x86_rm)
+static void handle_serial_state_hello(struct serial_handle *sh,
+	uint8_t curr_byte)
 {
-	x86_regs.r.eax = x86_rm->eax;
-	x86_regs.r.ecx = x86_rm->ecx;
-	x86_regs.r.edx = x86_rm->edx;
-	x86_regs.r.ebx = x86_rm->ebx;
-
-	/*
-	 * We need to disconsider the first 8 16-bit
-	 * registers already pushed in the stack.
-	 *
-	 * Also, we have to convert our ESP/EBP pointers
-	 * to physical addresses...
-	 */
-	x86_regs.r.esp = TO_PHYS(x86_rm->ss, x86_rm->esp + (2*8));
-	x86_regs.r.ebp = TO_PHYS(x86_rm->ss, x86_rm->ebp);
+	sh->cmd_buff[sh->buff_idx++] = curr_byte;
+	if (sh->buff_idx < 2)
+		return;
 
-	x86_regs.r.esi = x86_rm->esi;
-	x86_regs.r.edi = x86_rm->edi;
+	target_caps  = (uint8_t)sh->cmd_buff[0];
+	target_caps |= (uint8_t)sh->cmd_buff[1] << 8;
+	sh->state    = SERIAL_STATE_START;
 
-	/*
-	 * Fix EIP in order to tell GDB correctly
-	 */
-	x86_regs.r.eip = TO_PHYS(x86_rm->cs, x86_rm->eip);
+	LOG_CMD_REC("Target capabilities: %04x\n", target_caps);
+	target_caps &= BRIDGE_CAPS;
+	link_pending  = 1;
+}
 
-	x86_regs.r.eflags = x86_rm->eflags;
-	x86_regs.r.cs = x86_rm->cs;
-	x86_regs.r.ss = x86_rm->ss;
-	x86_regs.r.ds = x86_rm->ds;
-	x86_regs.r.es = x86_rm->es;
-	x86_regs.r.fs = x86_rm->fs;
-	x86_regs.r.gs = x86_rm->gs;
-	have_x86_regs = 1;
+/**
+ * @brief Handles the result of an earlier memory search,
+ * and forward it to GDB.
+ *
+ * The result is 1 byte (whether found or not), followed
+ * by the 4-byte match address.
+ *
+ * @param sh Serial state data.
+ * @param curr_byte Current byte read.
+ */
+static void handle_serial_state_search_mem(struct serial_handle *sh,
+	uint8_t curr_byte)
+{
+	union minibuf addr;
+	char reply[16];
 
-	if (gdb_fd <= 0)
-		printf("Single-stepped, you can now connect GDB!\n");
+	sh->cmd_buff[sh->buff_idx++] = curr_byte;
+	if (sh->buff_idx < 5)
+		return;
 
-	/*
-	 * If there is a valid connection already,
-	 * tell GDB that we're already stopped.
-	 */
-	else
-		send_gdb_halt_reason();
+	sh->state = SERIAL_STATE_START;
 
+	if (!sh->cmd_buff[0])
+	{
+		send_gdb_cmd("0", 1);
+		return;
+	}
 
-#ifdef DUMP_REGS
-	printf("eax: 0x%x\n", x86_regs.r.eax);
-	printf("ebx: 0x%x\n", x86_regs.r.ebx);
-	printf("ecx: 0x%x\n", x86_regs.r.ecx);
-	printf("edx: 0x%x\n", x86_regs.r.edx);
-	printf("esi: 0x%x\n", x86_regs.r.esi);
-	printf("edi: 0x%x\n", x86_regs.r.edi);
-	printf("ebp: 0x%x\n", x86_regs.r.ebp);
-	printf("esp: 0x%x\n", x86_regs.r.esp);
-	printf("eip: 0x%x\n", x86_regs.r.eip);
-	printf("eflags: 0x%x\n", x86_regs.r.eflags);
-	printf("cs: 0x%x\n", x86_regs.r.cs);
-	printf("ds: 0x%x\n", x86_regs.r.ds);
-	printf("es: 0x%x\n", x86_regs.r.es);
-	printf("ss: 0x%x\n", x86_regs.r.ss);
-	printf("fs: 0x%x\n", x86_regs.r.fs);
-	printf("gs: 0x%x\n", x86_regs.r.gs);
-#endif
+	memcpy(addr.b8, sh->cmd_buff + 1, 4);
+	snprintf(reply, sizeof reply, "1,%x", addr.b32);
+	send_gdb_cmd(reply, strlen(reply));
 }
 
-/* ------------------------------------------------------------------*
- * Serial handling state machine                                     *
- * ------------------------------------------------------------------*/
-
-/* Serial state machine data. */
-struct serial_handle
+/**
+ * @brief Handles the CRC32 calculated by the serial
+ * device, and forward it to GDB.
+ *
+ * @param sh Serial state data.
+ * @param curr_byte Current byte read.
+ */
+static void handle_serial_state_crc32(struct serial_handle *sh,
+	uint8_t curr_byte)
 {
-	int  state;
-	int  buff_idx;
-	char buff[64];
-	char csum_read[3];
-	char cmd_buff[64];
-} serial_handle = {
-	.state = SERIAL_STATE_START
-};
+	union minibuf crc;
+	char reply[16];
+
+	sh->cmd_buff[sh->buff_idx++] = curr_byte;
+	if (sh->buff_idx < 4)
+		return;
+
+	sh->state = SERIAL_STATE_START;
 
+	memcpy(crc.b8, sh->cmd_buff, 4);
+	snprintf(reply, sizeof reply, "C%08x", crc.b32 ^ crc_fix);
+	send_gdb_cmd(reply, strlen(reply));
+}
 
 /**
- * @brief Handle the start of state for a serial command.
+ * @brief Handles the reply of the swap byte command: the
+ * old byte (2-bytes) and what was read back after the
+ * write.
  *
- * If any non-valid start of command is received, the char
- * is silently ignored.
- *
- * Valid start states are: stop, read-memory or ok
+ * If the int3 could not be written, the code is not in RAM
+ * and the hardware breakpoint is used instead.
  *
- * @param sh Serial state machine data.
+ * @param sh Serial state data.
  * @param curr_byte Current byte read.
- *
- * @note The messages sent from serial, are, in fact,
- * responses from earlier GDB messages, so thats why
- * number of possible responses are small: most of the
- * commands only an 'OK' is required.
  */
-static void handle_serial_state_start(struct serial_handle *sh,
+static void handle_serial_state_sw_bp(struct serial_handle *sh,
 	uint8_t curr_byte)
 {
-	if (curr_byte == SERIAL_STATE_SS)
+	uint32_t addr;
+	uint8_t old, readback;
+	int i;
+
+	sh->cmd_buff[sh->buff_idx++] = curr_byte;
+	if (sh->buff_idx < 2)
+		return;
+
+	sh->state = SERIAL_STATE_START;
+
+	/*
+	 * Temporary swap, sent after the pending breakpoint reply,
+	 * if any, as GDB waits for it before the next command.
+	 */
+	if (sw_bp_swaps)
 	{
-		sh->state    = SERIAL_STATE_SS;
-		sh->buff_idx = 0;
-		memset(&x86_stop_data, 0, sizeof(union x86_stop_data));
+		sw_bp_swaps--;
+		return;
 	}
-	else if (curr_byte == SERIAL_STATE_READ_MEM_CMD)
+
+	old       = sh->cmd_buff[0];
+	readback  = sh->cmd_buff[1];
+	addr      = sw_bp_pending.addr;
+
+	if (sw_bp_pending.insert)
 	{
-		sh->state    = SERIAL_STATE_READ_MEM_CMD;
-		sh->buff_idx = 0;
+		/* ROM. */
+		if (readback != INT3_OPC)
+		{
+			insert_hw_breakpoint(addr, NULL, 0);
+			return;
+		}
+
+		sw_bps[sw_bp_count].addr = addr;
+		sw_bps[sw_bp_count].orig = old;
+		sw_bp_count++;
 	}
-	else if (curr_byte == SERIAL_MSG_OK)
+	else if ((i = sw_bp_find(addr)) >= 0)
+		sw_bps[i] = sw_bps[--sw_bp_count];
+
+#ifndef UART_POLLING
+	/*
+	 * The target swapped the byte in its saved instructions,
+	 * so do the same here, as they are the ones GDB sees.
+	 */
+	if (addr - x86_regs.r.eip < 4)
+		x86_stop_data.d.saved_insns[addr - x86_regs.r.eip] = readback;
+#endif
+
+	if (!sw_bp_pending.quiet)
 		send_gdb_ok();
 }
 
 /**
- * @brief Handle the machine stop data and reason.
+ * @brief Handles the trace data sent by the serial device,
+ * and writes it to the trace file, one entry per line:
+ * CS:IP, optionally followed by the FLAGS.
  *
- * This function grabs the stop data and calls the appropriate
- * handler.
+ * The data is: flags (1-byte), length (2-bytes LE) and
+ * then, the entries.
  *
- * @param sh Serial state machine data.
- * @param Current byte read.
+ * @param sh Serial state data.
+ * @param buff Bytes received.
+ * @param len Amount of bytes, at least 1.
+ *
+ * @return Amount of bytes used.
  */
-static void handle_serial_state_ss(struct serial_handle *sh,
-	uint8_t curr_byte)
+static size_t handle_serial_state_trace_data(struct serial_handle *sh,
+	const uint8_t *buff, size_t len)
 {
-	size_t x86_size = sizeof(union x86_stop_data);
+	size_t amnt = 1;
+	uint8_t *e;
 
-	/* Save stopped data. */
-	if ((size_t)sh->buff_idx < x86_size)
-		x86_stop_data.data[sh->buff_idx++] = curr_byte;
+	/* Header. */
+	if (!sh->trace_entry)
+	{
+		sh->cmd_buff[sh->buff_idx++] = *buff;
+		if (sh->buff_idx < 3)
+			return (amnt);
+
+		e = (uint8_t *)sh->cmd_buff;
+		sh->trace_entry = (e[0] & TRACE_FLAGS) ? 6 : 4;
+		sh->trace_left  = e[1] | (e[2] << 8);
+		sh->buff_idx    = 0;
+		if (!sh->trace_left)
+			sh->state = SERIAL_STATE_START;
+		return (amnt);
+	}
 
-	/* Check if ended. */
-	if ((size_t)sh->buff_idx == x86_size)
+	/* Up to the end of the entry. */
+	amnt = MIN(len, (size_t)(sh->trace_entry - sh->buff_idx));
+	amnt = MIN(amnt, (size_t)sh->trace_left);
+	memcpy(sh->cmd_buff + sh->buff_idx, buff, amnt);
+	sh->buff_idx   += amnt;
+	sh->trace_left -= amnt;
+
+	if (sh->buff_idx == sh->trace_entry)
 	{
+		e = (uint8_t *)sh->cmd_buff;
+		sh->buff_idx = 0;
+
+		if (trace_file && sh->trace_entry == 6)
+			fprintf(trace_file, "%04x:%04x %04x\n",
+				e[2] | (e[3] << 8), e[0] | (e[1] << 8),
+				e[4] | (e[5] << 8));
+		else if (trace_file)
+			fprintf(trace_file, "%04x:%04x\n",
+				e[2] | (e[3] << 8), e[0] | (e[1] << 8));
+	}
+
+	if (sh->trace_left <= 0)
+	{
+		if (trace_file)
+			fflush(trace_file);
 		sh->state = SERIAL_STATE_START;
-		handle_serial_single_step_stop(&x86_stop_data.d.x86_regs);
 	}
+	return (amnt);
 }
 
 /**
- * @brief Handles the debugger response to an earlier
- * GDB read memory command.
+ * @brief Handles the received bytes, accordingly with the
+ * current state.
  *
- * @param sh Serial state data.
- * @param curr_byte Current byte read.
+ * Payload states (stops, memory and trace) take as many
+ * bytes as they need at once, the others, one at a time.
  *
- * @note The data length is already saved when GDB
- * asks to read.
+ * @param buff Bytes received.
+ * @param len Amount of bytes.
  */
-static void handle_serial_state_read_mem_cmd(struct serial_handle *sh,
-	uint8_t curr_byte)
+static void handle_serial_bytes(const uint8_t *buff, size_t len)
 {
-	dump_buffer[sh->buff_idx++] = curr_byte;
-	if (sh->buff_idx == last_dump_amnt)
+	struct serial_handle *sh = &serial_handle;
+	size_t used;
+
+	while (len)
 	{
-		sh->state = SERIAL_STATE_START;
-		handle_serial_receive_read_memory();
+		used = 1;
+
+		switch (sh->state) {
+		/* Check which state should go, if any. */
+		case SERIAL_STATE_START:
+			handle_serial_state_start(sh, *buff);
+			break;
+		/*
+		 * PC has stopped and have dumped the regs + sav mem
+		 * So this state saves the regs + the saved instructions
+		 */
+		case MSG_SINGLE_STEP:
+			used = handle_serial_state_ss(sh, buff, len);
+			break;
+		/* Same as above, but only with what has changed. */
+		case MSG_STOP_DELTA:
+			used = handle_serial_state_ss_delta(sh, buff, len);
+			break;
+		/* PC has answered with the memory. */
+		case MSG_READ_MEM:
+			used = handle_serial_state_read_mem_cmd(sh, buff, len);
+			break;
+		/* PC has answered with the memory, compressed. */
+		case MSG_READ_MEM_RLE:
+			used = handle_serial_state_read_mem_rle(sh, buff, len);
+			break;
+		/* PC has answered with its capabilities. */
+		case MSG_HELLO:
+			handle_serial_state_hello(sh, *buff);
+			break;
+		/* PC has answered with the search result. */
+		case MSG_SEARCH_MEM:
+			handle_serial_state_search_mem(sh, *buff);
+			break;
+		/* PC has answered with the CRC32. */
+		case MSG_CRC32:
+			handle_serial_state_crc32(sh, *buff);
+			break;
+		/* PC has answered with the swapped byte. */
+		case MSG_SW_BP:
+			handle_serial_state_sw_bp(sh, *buff);
+			break;
+		/* PC has sent the instruction trace. */
+		case MSG_TRACE_DATA:
+			used = handle_serial_state_trace_data(sh, buff, len);
+			break;
+		}
+
+		buff += used;
+		len  -= used;
 	}
 }
 
+/**
+ * @brief Framed mode: sends the frames written so far
+ * and handles the data received meanwhile, until there
+ * is nothing left of both.
+ */
+static void serial_flush(void)
+{
+	static uint8_t buff[FRAME_PENDING];
+	size_t len;
+
+	/* Already here, (indirectly) from the loop below. */
+	if (!frame.on || frame.flushing)
+		return;
+
+	frame.flushing = 1;
+	while (frame.tx_len || frame.pending_len)
+	{
+		if (frame.tx_len)
+			frame_send();
+
+		len = frame.pending_len;
+		memcpy(buff, frame.pending, len);
+		frame.pending_len = 0;
+		handle_serial_bytes(buff, len);
+	}
+	frame.flushing = 0;
+}
 
 /**
- * @brief For each byte received, calls the appropriate
- * handler, accordingly with the byte and the current
- * state.
+ * @brief Reads what the serial device has sent and
+ * handles all of it (see handle_serial_bytes()).
  *
  * @param hfd Socket handler (not used).
  */
 void handle_serial_msg(struct handler_fd *hfd)
 {
-	int i;
+	struct serial_handle *sh = &serial_handle;
 	ssize_t ret;
-	uint8_t curr_byte;
 
 	serial_fd = hfd->fd;
 
-	ret = read(serial_fd, serial_handle.buff,
-		sizeof serial_handle.buff);
-
+	ret = read(serial_fd, sh->rx, sizeof sh->rx);
 	if (ret <= 0)
 		errx("Serial closed!\n");
 
-	/* For each received byte. */
-	for (i = 0; i < ret; i++)
-	{
-		curr_byte = serial_handle.buff[i] & 0xFF;
+	capture_data(serial_fd, CAPTURE_IN, sh->rx, ret);
+	stats_serial_in(ret);
 
-		switch (serial_handle.state) {
-		/* Check which state should go, if any. */
-		case SERIAL_STATE_START:
-			handle_serial_state_start(&serial_handle, curr_byte);
-			break;
-		/*
-		 * PC has stopped and have dumped the regs + sav mem
-		 * So this state saves the regs + the saved instructions
-		 */
-		case SERIAL_STATE_SS:
-			handle_serial_state_ss(&serial_handle, curr_byte);
-			break;
-		/* PC has answered with the memory. */
-		case SERIAL_STATE_READ_MEM_CMD:
-			handle_serial_state_read_mem_cmd(&serial_handle,
-				curr_byte);
-			break;
-		}
-	}
+	if (!frame.on)
+		handle_serial_bytes(sh->rx, ret);
+	else
+		frame_rx(sh->rx, ret);
+
+	if (link_pending && sh->state == SERIAL_STATE_START)
+		serial_link_setup();
+
+	serial_flush();
 }
 
 /* ------------------------------------------------------------------*
  * Accept/initialization routines                                    *
  * ------------------------------------------------------------------*/
 
+/**
+ * @brief Sets the file the instruction trace is written to.
+ *
+ * @param path Trace file path.
+ */
+void set_trace_path(const char *path)
+{
+	trace_path = path;
+}
+
+/**
+ * @brief Sets the max serial speed to be negotiated with
+ * the target, 0 (or SERIAL_DEFAULT_BAUD) disables it.
+ *
+ * @param baud Speed, in bps.
+ */
+void set_serial_baud(int baud)
+{
+	serial_baud = baud;
+}
+
+/**
+ * @brief Enables (or not) the framed mode, if supported
+ * by the target.
+ *
+ * @param enable 1 to enable, 0 otherwise.
+ */
+void set_serial_framed(int enable)
+{
+	frame_wanted = enable;
+}
+
 /**
  * @brief Handles the accept() when the GDB client attempts
  * to connect.
@@ -1278,7 +4497,7 @@ void handle_accept_gdb(struct handler_fd *hfd)
 	struct handler_fd h;
 	int fd;
 
-	if (!have_x86_regs)
+	if (!have_x86_regs || !link_ready)
 		errx("GDB must be connected after breakpoint!\n");
 
 	fd = accept(hfd->fd, NULL, NULL);
@@ -1286,6 +4505,9 @@ void handle_accept_gdb(struct handler_fd *hfd)
 		errx("Failed to accept connection, aborting...\n");
 
 	printf("GDB connected!\n");
+	set_tcp_nodelay(fd);
+	capture_set_fd(CAPTURE_GDB, fd);
+	set_stats_dump();
 
 	h.fd = fd;
 	h.handler = handle_gdb_msg;
@@ -1312,6 +4534,8 @@ void handle_accept_serial(struct handler_fd *hfd)
 		errx("Failed to accept connection, aborting...\n");
 
 	printf("Serial connected, please wait...\n");
+	set_tcp_nodelay(fd);
+	capture_set_fd(CAPTURE_SERIAL, fd);
 
 	h.fd = fd;
 	h.handler = handle_serial_msg;
@@ -31,5 +31,9 @@
 	extern char *encode_hex(const char *data, size_t len);
 	extern void handle_accept_gdb(struct handler_fd *hfd);
 	extern void handle_accept_serial(struct handler_fd *hfd);
+	extern void set_trace_path(const char *path);
+	extern void set_serial_baud(int baud);
+	extern void set_serial_framed(int enable);
+	extern void set_stats_dump(void);
 
 #endif /* GDH_H */
@@ -25,6 +25,7 @@
 #include "util.h"
 #include "net.h"
 #include "gdb.h"
+#include "capture.h"
 #include <getopt.h>
 #include <string.h>
 
@@ -40,11 +41,18 @@ struct args
 	int  serial_port;
 	int  gdb_port;
 	char *device;
+	char *trace_path;
+	int  baud;
+	int  framed;
+	char *capture_path;
+	char *replay_path;
+	int  replay_max_speed;
 } args = {
 	.mode = MODE_SERIAL,
 	.serial_port = 2345,
 	.gdb_port = 1234,
 	.device = NULL,
+	.baud = 921600,
 };
 
 /**
@@ -56,7 +64,7 @@ struct args
 void parse_args(int argc, char **argv)
 {
 	int c; /* Current arg. */
-	while ((c = getopt(argc, argv, "hsd:p:g:")) != -1)
+	while ((c = getopt(argc, argv, "hsd:p:g:t:b:fc:r:x")) != -1)
 	{
 		switch (c) {
 		case 'h':
@@ -76,6 +84,25 @@ void parse_args(int argc, char **argv)
 			args.gdb_port = simple_read_int(
 				optarg, strlen(optarg), 10);
 			break;
+		case 't':
+			args.trace_path = strdup(optarg);
+			break;
+		case 'b':
+			args.baud = simple_read_int(
+				optarg, strlen(optarg), 10);
+			break;
+		case 'f':
+			args.framed = 1;
+			break;
+		case 'c':
+			args.capture_path = strdup(optarg);
+			break;
+		case 'r':
+			args.replay_path = strdup(optarg);
+			break;
+		case 'x':
+			args.replay_max_speed = 1;
+			break;
 		default:
 			usage(argv[0]);
 			break;
@@ -118,6 +145,14 @@ void usage(const char *prgname)
 		"            (does not work if -s is enabled)\n"
 		"  -p <port> Serial port (as socket), default: 2345\n"
 		"  -g <port> GDB port, default: 1234\n"
+		"  -t <path> Instruction trace file, default: trace.txt\n"
+		"            (see 'monitor trace')\n"
+		"  -b <bps>  Max serial speed to negotiate, default: 921600\n"
+		"            (115200 disables it, does not work with -s)\n"
+		"  -f Framed mode: CRC and retransmission on the serial link\n"
+		"  -c <path> Capture the serial and GDB traffic into a file\n"
+		"  -r <path> Replay a capture, instead of using the target/GDB\n"
+		"  -x Replay as fast as possible, not with the original timing\n"
 		"  -h This help\n\n"
 		"If no options are passed the default behavior is:\n"
 		"  %s -d /dev/ttyUSB0 -g 1234\n\n"
@@ -128,18 +163,68 @@ void usage(const char *prgname)
 	exit(EXIT_FAILURE);
 }
 
+/**
+ * @brief Runs the bridge with the data from a capture,
+ * see replay_start().
+ */
+void replay(void)
+{
+	struct handler_fd hfds[2] = {0};
+	struct capture_config cfg;
+	int fds[2];
+
+	replay_start(args.replay_path, args.replay_max_speed, &cfg, fds);
+	set_serial_baud(cfg.baud);
+	set_serial_framed(cfg.framed);
+	set_stats_dump();
+
+	if (args.capture_path)
+	{
+		capture_open(args.capture_path, &cfg);
+		capture_set_fd(CAPTURE_SERIAL, fds[CAPTURE_SERIAL]);
+		capture_set_fd(CAPTURE_GDB, fds[CAPTURE_GDB]);
+	}
+
+	hfds[0].fd      = fds[CAPTURE_SERIAL];
+	hfds[0].handler = handle_serial_msg;
+	hfds[1].fd      = fds[CAPTURE_GDB];
+	hfds[1].handler = handle_gdb_msg;
+	handle_fds(2, hfds);
+}
+
 /* Main =). */
 int main(int argc, char **argv)
 {
 	struct handler_fd hfds[2] = {0};
+	struct capture_config cfg;
 	int ser_sv_fd, gdb_sv_fd;
 
 	parse_args(argc, argv);
 
+	if (args.trace_path)
+		set_trace_path(args.trace_path);
+
+	if (args.replay_path)
+	{
+		replay();
+		return (0);
+	}
+
+	set_serial_framed(args.framed);
+
+	if (args.capture_path)
+	{
+		cfg.baud   = args.mode == MODE_SERIAL ? args.baud : 0;
+		cfg.framed = args.framed;
+		capture_open(args.capture_path, &cfg);
+	}
+
 	/* Setup serial. */
 	if (args.mode == MODE_SERIAL)
 	{
 		setup_serial(&ser_sv_fd, args.device);
+		set_serial_baud(args.baud);
+		capture_set_fd(CAPTURE_SERIAL, ser_sv_fd);
 		hfds[0].handler = handle_serial_msg;
 	}
 	else
@@ -0,0 +1,1615 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Mock target: a host program that speaks the same serial
+ * protocol as dbg.asm (see constants.inc), so that the bridge
+ * can be run end to end (in socket mode, -s) without real
+ * hardware or a VM.
+ *
+ * The machine is 1 MB (+ HMA) of memory, optionally loaded from
+ * an image file, and a tiny simulated CPU: every instruction is
+ * 1 byte long and only increments EAX and writes it to
+ * DATA_ADDR. The code loops inside LOOP_SIZE bytes from the
+ * initial CS:IP, so breakpoints placed there are hit, as well
+ * as watchpoints on DATA_ADDR. An int3 (0xCC) in memory stops
+ * the execution like the int3 handler of dbg.asm.
+ *
+ * The serial link speed can be simulated (-b), so that the
+ * bridge sees roughly the same throughput and latency of a
+ * real UART.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "ax.h"
+#include "net.h"
+#include "protocol.h"
+#include "util.h"
+
+/* Capabilities of the mock: all of them. */
+#define CAPS_SUPPORTED  0x0FFF
+
+/* Mock-only timings and opcodes. */
+#define NOP_OPC         0x90
+#define BAUD_PROBE_MS   500
+#define UART_CLOCK      1843200
+#define FRAME_TIMEOUT_MS 200
+
+/* Memory: 1 MB plus the HMA, and the ROM (not writable). */
+#define IMAGE_SIZE  0x100000
+#define MEM_SIZE    0x110000
+#define ROM_START   0xF0000
+
+/* Simulated CPU. */
+#define START_CS    0x0000
+#define START_IP    0x7C00
+#define START_SP    0x7000
+#define LOOP_SIZE   64
+#define DATA_ADDR   0x500
+#define RUN_BATCH   1024
+
+/* Buffers. */
+#define RAW_SIZE    0x10000
+#define OUT_SIZE    0x20000
+#define RXQ_SIZE    0x10000
+
+/* Registers, in push_regs order (see constants.inc). */
+enum regs
+{
+	REG_EDI, REG_ESI, REG_EBP, REG_ESP, REG_EBX, REG_EDX, REG_ECX,
+	REG_EAX, REG_GS, REG_FS, REG_ES, REG_DS, REG_SS, REG_EIP, REG_CS,
+	REG_EFLAGS, REG_COUNT
+};
+
+/* Execution mode. */
+enum run_mode
+{
+	RUN_STOPPED,
+	RUN_CONTINUE,
+	RUN_RANGE
+};
+
+/* Options. */
+static uint16_t port     = 2345;
+static const char *image = NULL;
+static uint16_t caps     = CAPS_SUPPORTED;
+static uint32_t baud     = 0;
+
+/* Machine state. */
+static uint8_t  mem[MEM_SIZE];
+static uint32_t regs[REG_COUNT];
+static uint32_t prev_regs[REG_COUNT];
+static uint16_t features;
+static int      delta_full = 1;
+
+/* Stop reason and address of the next stop message. */
+static uint8_t  stop_reason = STOP_REASON_NORMAL;
+static uint32_t stop_addr;
+
+/* Execution. */
+static enum run_mode run_mode;
+static int run_first;
+static uint32_t range_start, range_end;
+
+/* DR0-DR3. */
+static struct hw_slot
+{
+	int used;
+	uint8_t  ctl;
+	uint32_t addr;
+} hw_slots[4];
+
+/* Condition of DR0 (MSG_COND). */
+static uint8_t cond_code[COND_MAX_CODE];
+static size_t  cond_len;
+
+/* Instruction trace, kept in the target memory, like dbg.asm. */
+static uint32_t trace_addr;
+static uint16_t trace_size;
+static uint32_t trace_pos;
+static uint8_t  trace_on;
+static uint8_t  trace_first;
+
+/* Link and its simulated speed. */
+static int link_fd = -1;
+static uint64_t byte_ns;
+static uint64_t tx_clock, rx_clock;
+
+/* Raw bytes received. */
+static uint8_t  raw_buff[RAW_SIZE];
+static size_t   raw_pos, raw_len;
+static uint64_t raw_last; /* When the last bytes came.        */
+static size_t   raw_old;  /* Bytes before FRAME_GAP_MS quiet. */
+
+/* Output, sent at once (or as frames). */
+static uint8_t out_buff[OUT_SIZE];
+static size_t  out_len;
+
+/* Framed mode. */
+static struct frame_state
+{
+	int on;
+	uint8_t tx_seq;
+	uint8_t rx_seq;
+	int acked;
+	int naked;
+	uint8_t rxq[RXQ_SIZE];
+	size_t  rxq_pos, rxq_len;
+} frame;
+
+/* Stats. */
+static struct mock_stats
+{
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t stops;
+	uint64_t retransmits;
+	uint64_t bad_frames;
+} stats;
+
+/* Little-endian helpers. */
+static inline uint16_t get16(const uint8_t *p) {
+	return (p[0] | p[1] << 8);
+}
+static inline uint32_t get32(const uint8_t *p) {
+	return (get16(p) | (uint32_t)get16(p + 2) << 16);
+}
+static inline uint8_t *put16(uint8_t *p, uint16_t v) {
+	p[0] = v; p[1] = v >> 8;
+	return (p + 2);
+}
+static inline uint8_t *put32(uint8_t *p, uint32_t v) {
+	put16(p, v);
+	return (put16(p + 2, v >> 16));
+}
+
+/**
+ * @brief Returns the current monotonic time, in ns.
+ */
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+/* ------------------------------------------------------------------*
+ * Link                                                              *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Simulates the time taken by @p len bytes on the
+ * serial line whose clock is @p clock, i.e: waits until
+ * the line would be done with them.
+ *
+ * @param clock When the line is free again (ns).
+ * @param len Amount of bytes.
+ */
+static void link_delay(uint64_t *clock, size_t len)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	if (!byte_ns)
+		return;
+
+	now = time_ns();
+	if (*clock < now)
+		*clock = now;
+
+	*clock    += len * byte_ns;
+	ts.tv_sec  = *clock / 1000000000ull;
+	ts.tv_nsec = *clock % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/**
+ * @brief Sets the simulated speed of the link.
+ *
+ * @param bps Speed, in bits per second, 0 means as
+ *            fast as possible.
+ */
+static void link_set_speed(uint32_t bps)
+{
+	/* 8N1: 10 bits per byte. */
+	byte_ns = bps ? 10000000000ull / bps : 0;
+}
+
+/**
+ * @brief Writes @p len bytes from @p buf to the link,
+ * as slow as the simulated speed.
+ *
+ * @param buf Buffer to be sent.
+ * @param len Buffer length.
+ */
+static void link_write(const void *buf, size_t len)
+{
+	link_delay(&tx_clock, len);
+	if (send_all(link_fd, buf, len) < 0)
+		errx("Unable to write to the bridge: %s\n", strerror(errno));
+	stats.tx_bytes += len;
+}
+
+/**
+ * @brief Reads whatever is available from the link into
+ * the raw buffer, waiting up to @p timeout_ms for it.
+ *
+ * Exits if the bridge disconnects.
+ *
+ * @param timeout_ms Timeout, -1 waits forever.
+ *
+ * @return Returns the amount of bytes read.
+ */
+static size_t link_fill(int timeout_ms)
+{
+	struct pollfd pfd;
+	ssize_t r;
+
+	if (raw_pos)
+	{
+		memmove(raw_buff, raw_buff + raw_pos, raw_len - raw_pos);
+		raw_len -= raw_pos;
+		raw_old -= MIN(raw_old, raw_pos);
+		raw_pos  = 0;
+	}
+
+	if (raw_len == RAW_SIZE)
+		return (0);
+
+	pfd.fd     = link_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+		return (0);
+
+	r = read(link_fd, raw_buff + raw_len, RAW_SIZE - raw_len);
+	if (r < 0)
+	{
+		if (errno == EINTR || errno == EAGAIN)
+			return (0);
+		errx("Unable to read from the bridge: %s\n", strerror(errno));
+	}
+	if (r == 0)
+	{
+		printf("Bridge disconnected: rx=%" PRIu64 " tx=%" PRIu64
+			" stops=%" PRIu64 " retransmits=%" PRIu64 " bad_frames=%"
+			PRIu64 "\n", stats.rx_bytes, stats.tx_bytes, stats.stops,
+			stats.retransmits, stats.bad_frames);
+		exit(0);
+	}
+
+	raw_old = 0;
+	if (time_ns() - raw_last > FRAME_GAP_MS * 1000000ull)
+		raw_old = raw_len;
+
+	link_delay(&rx_clock, r);
+	raw_last = time_ns();
+	stats.rx_bytes += r;
+	raw_len += r;
+	return (r);
+}
+
+/* ------------------------------------------------------------------*
+ * Framed mode                                                       *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Sends the ack (or NAK, if @p seq has FRAME_NAK)
+ * of the frame @p seq.
+ *
+ * @param seq Frame sequence number.
+ */
+static void frame_send_ack(uint8_t seq)
+{
+	uint8_t fr[5];
+	uint16_t crc;
+
+	fr[0] = FRAME_SOF;
+	fr[1] = 0;
+	fr[2] = seq;
+	crc   = crc16_update(CRC16_INIT, fr + 1, 2);
+	put16(fr + 3, crc);
+	link_write(fr, sizeof fr);
+}
+
+/**
+ * @brief Handles a complete frame received.
+ *
+ * @param fr Frame, starting at its length.
+ * @param busy If a frame of ours is waiting for its ack.
+ */
+static void frame_rx(const uint8_t *fr, int busy)
+{
+	uint8_t len, seq;
+
+	len = fr[0];
+	seq = fr[1];
+
+	if (crc16_update(CRC16_INIT, fr, len + 2) != get16(fr + len + 2))
+	{
+		stats.bad_frames++;
+		frame_send_ack(frame.rx_seq | FRAME_NAK);
+		return;
+	}
+
+	/* Ack/NAK of ours. */
+	if (!len)
+	{
+		if (seq & FRAME_NAK)
+			frame.naked = 1;
+		else if (seq == frame.tx_seq)
+			frame.acked = 1;
+		return;
+	}
+
+	/* Repeated, its ack got lost. */
+	if (seq != frame.rx_seq)
+	{
+		if (((seq + 1) & FRAME_SEQ_MASK) == frame.rx_seq)
+			frame_send_ack(seq);
+		return;
+	}
+
+	/* The last one was not handled yet, the bridge sends it again. */
+	if ((busy && frame.rxq_len) || frame.rxq_len + len > RXQ_SIZE)
+		return;
+
+	if (frame.rxq_pos + frame.rxq_len + len > RXQ_SIZE)
+	{
+		memmove(frame.rxq, frame.rxq + frame.rxq_pos, frame.rxq_len);
+		frame.rxq_pos = 0;
+	}
+
+	memcpy(frame.rxq + frame.rxq_pos + frame.rxq_len, fr + 2, len);
+	frame.rxq_len += len;
+	frame.rx_seq   = (seq + 1) & FRAME_SEQ_MASK;
+	frame_send_ack(seq);
+}
+
+/**
+ * @brief Handles the complete frames in the raw buffer.
+ *
+ * A frame still incomplete when the link went quiet for
+ * FRAME_GAP_MS is dropped, as its length might have been
+ * corrupted, and the next SOF is looked for.
+ *
+ * @param busy If a frame of ours is waiting for its ack.
+ */
+static void frame_parse(int busy)
+{
+	size_t need;
+	uint8_t len;
+
+	while (raw_pos < raw_len)
+	{
+		/* Ctrl-C is the only thing out of frames. */
+		if (raw_buff[raw_pos] != FRAME_SOF)
+		{
+			if (raw_buff[raw_pos] == MSG_CTRLC &&
+				frame.rxq_pos + frame.rxq_len < RXQ_SIZE)
+			{
+				frame.rxq[frame.rxq_pos + frame.rxq_len++] = MSG_CTRLC;
+			}
+			raw_pos++;
+			continue;
+		}
+
+		need = 2;
+		if (raw_len - raw_pos >= 2)
+		{
+			len = raw_buff[raw_pos + 1];
+			if (len > FRAME_MAX)
+			{
+				raw_pos++;
+				continue;
+			}
+			need = len + 5;
+		}
+
+		if (raw_pos < raw_old && raw_pos + need > raw_old)
+		{
+			stats.bad_frames++;
+			raw_pos++;
+			continue;
+		}
+
+		if (raw_len - raw_pos < need)
+			break;
+
+		frame_rx(raw_buff + raw_pos + 1, busy);
+		raw_pos += need;
+
+		/*
+		 * As the debugger, stop at our ack: what comes
+		 * next is only read once we are done with the
+		 * frame we keep, so it is not dropped.
+		 */
+		if (busy && (frame.acked || frame.naked))
+			break;
+	}
+}
+
+/**
+ * @brief Handles the complete frames received, reading
+ * from the link (up to @p timeout_ms) if the ones left
+ * from the last time are not enough.
+ *
+ * @param timeout_ms Timeout, -1 waits forever.
+ * @param busy If a frame of ours is waiting for its ack.
+ */
+static void frame_pump(int timeout_ms, int busy)
+{
+	frame_parse(busy);
+	if (busy ? (frame.acked || frame.naked) : frame.rxq_len > 0)
+		return;
+
+	link_fill(timeout_ms);
+	frame_parse(busy);
+}
+
+/**
+ * @brief Sends @p len bytes from @p buf as frames, each
+ * one sent again until acked.
+ *
+ * @param buf Buffer to be sent.
+ * @param len Buffer length.
+ */
+static void frame_send(const uint8_t *buf, size_t len)
+{
+	uint8_t fr[FRAME_MAX + 5];
+	uint64_t deadline, now;
+	uint16_t crc;
+	size_t chunk;
+
+	while (len)
+	{
+		chunk = MIN(len, FRAME_MAX);
+		fr[0] = FRAME_SOF;
+		fr[1] = chunk;
+		fr[2] = frame.tx_seq;
+		memcpy(fr + 3, buf, chunk);
+		crc = crc16_update(CRC16_INIT, fr + 1, chunk + 2);
+		put16(fr + 3 + chunk, crc);
+
+		for (;;)
+		{
+			frame.acked = 0;
+			frame.naked = 0;
+			link_write(fr, chunk + 5);
+
+			deadline = time_ns() + FRAME_TIMEOUT_MS * 1000000ull;
+			while (!frame.acked && !frame.naked &&
+				(now = time_ns()) < deadline)
+			{
+				frame_pump((deadline - now + 999999) / 1000000, 1);
+			}
+
+			if (frame.acked)
+				break;
+			stats.retransmits++;
+		}
+
+		frame.tx_seq = (frame.tx_seq + 1) & FRAME_SEQ_MASK;
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+/* ------------------------------------------------------------------*
+ * Input/output                                                      *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Sends everything queued by out_put().
+ */
+static void out_flush(void)
+{
+	if (!out_len)
+		return;
+
+	if (frame.on)
+		frame_send(out_buff, out_len);
+	else
+		link_write(out_buff, out_len);
+	out_len = 0;
+}
+
+/**
+ * @brief Queues @p len bytes from @p buf to be sent.
+ *
+ * @param buf Buffer to be sent.
+ * @param len Buffer length.
+ */
+static void out_put(const void *buf, size_t len)
+{
+	if (out_len + len > OUT_SIZE)
+		out_flush();
+	memcpy(out_buff + out_len, buf, len);
+	out_len += len;
+}
+
+/**
+ * @brief Queues a single byte to be sent.
+ * @param b Byte to be sent.
+ */
+static void out_byte(uint8_t b) {
+	out_put(&b, 1);
+}
+
+/**
+ * @brief Checks if there is a byte from the bridge
+ * waiting, up to @p timeout_ms.
+ *
+ * @param timeout_ms Timeout, -1 waits forever.
+ *
+ * @return Returns 1 if so, 0 otherwise.
+ */
+static int in_wait(int timeout_ms)
+{
+	if (frame.on)
+	{
+		if (!frame.rxq_len)
+			frame_pump(timeout_ms, 0);
+		return (frame.rxq_len > 0);
+	}
+
+	if (raw_pos == raw_len)
+		link_fill(timeout_ms);
+	return (raw_pos < raw_len);
+}
+
+/**
+ * @brief Reads a single byte from the bridge, waiting
+ * for it if needed.
+ *
+ * @return Returns the byte read.
+ */
+static uint8_t in_byte(void)
+{
+	uint8_t b;
+
+	out_flush();
+	while (!in_wait(-1))
+		;
+
+	if (frame.on)
+	{
+		b = frame.rxq[frame.rxq_pos++];
+		if (!--frame.rxq_len)
+			frame.rxq_pos = 0;
+		return (b);
+	}
+	return (raw_buff[raw_pos++]);
+}
+
+/**
+ * @brief Reads @p len bytes from the bridge into @p buf.
+ *
+ * @param buf Destination buffer.
+ * @param len Amount of bytes.
+ */
+static void in_bytes(void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	while (len--)
+		*p++ = in_byte();
+}
+
+/* ------------------------------------------------------------------*
+ * Memory                                                            *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Reads @p len bytes at the physical address @p addr,
+ * the ones past the end of the memory read as 0xFF.
+ *
+ * @param addr Physical address.
+ * @param buf Destination buffer.
+ * @param len Amount of bytes.
+ */
+static void mem_read(uint32_t addr, void *buf, size_t len)
+{
+	size_t n = 0;
+
+	if (addr < MEM_SIZE)
+		n = MIN(len, MEM_SIZE - addr);
+
+	memcpy(buf, mem + addr, n);
+	memset((uint8_t *)buf + n, 0xFF, len - n);
+}
+
+/**
+ * @brief Writes @p len bytes at the physical address @p addr,
+ * the ones in ROM or past the end of the memory are lost.
+ *
+ * @param addr Physical address.
+ * @param buf Source buffer.
+ * @param len Amount of bytes.
+ */
+static void mem_write(uint32_t addr, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++, addr++)
+	{
+		if (addr >= MEM_SIZE)
+			break;
+		if (addr < ROM_START || addr >= IMAGE_SIZE)
+			mem[addr] = p[i];
+	}
+}
+
+/**
+ * @brief Reads the value of @p size bytes at @p addr.
+ *
+ * @param addr Physical address.
+ * @param size 1, 2 or 4.
+ *
+ * @return Returns the value read.
+ */
+static uint32_t mem_get(uint32_t addr, size_t size)
+{
+	uint8_t b[4];
+	mem_read(addr, b, size);
+	if (size == 1)
+		return (b[0]);
+	if (size == 2)
+		return (get16(b));
+	return (get32(b));
+}
+
+/**
+ * @brief Loads the memory image @p path, or fills the
+ * memory with a pseudo-random pattern if there is none.
+ *
+ * @param path Image path, may be NULL.
+ */
+static void mem_init(const char *path)
+{
+	uint32_t x, i;
+	ssize_t r;
+	size_t n;
+	int fd;
+
+	if (!path)
+	{
+		/* Any pattern would do, as long as it does not compress. */
+		for (i = 0, x = 0x12345678; i < MEM_SIZE; i++)
+		{
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			mem[i] = x;
+		}
+
+		/* Code without int3s. */
+		memset(mem + START_CS * 16 + START_IP, NOP_OPC, LOOP_SIZE);
+		return;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		errx("Unable to open %s: %s\n", path, strerror(errno));
+
+	for (n = 0; n < IMAGE_SIZE; n += r)
+	{
+		r = read(fd, mem + n, IMAGE_SIZE - n);
+		if (r < 0)
+			errx("Unable to read %s: %s\n", path, strerror(errno));
+		if (!r)
+			break;
+	}
+	close(fd);
+}
+
+/* ------------------------------------------------------------------*
+ * CPU                                                               *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Returns the physical address of CS:IP.
+ */
+static inline uint32_t cs_ip(void) {
+	return (regs[REG_CS] * 16 + regs[REG_EIP]);
+}
+
+/**
+ * @brief Returns the value of the register @p gdb_reg,
+ * as seen by GDB (and the conditions).
+ *
+ * @param gdb_reg GDB register number.
+ *
+ * @return Returns the register value.
+ */
+static uint32_t cond_reg(uint8_t gdb_reg)
+{
+	static const uint8_t gdb_to_regs[16] = {
+		REG_EAX, REG_ECX, REG_EDX, REG_EBX, REG_ESP, REG_EBP,
+		REG_ESI, REG_EDI, REG_EIP, REG_EFLAGS, REG_CS, REG_SS,
+		REG_DS,  REG_ES,  REG_FS,  REG_GS
+	};
+
+	switch (gdb_reg & 0xF)
+	{
+	case 4:
+		return (regs[REG_SS] * 16 + regs[REG_ESP] + 2*8);
+	case 5:
+		return (regs[REG_SS] * 16 + regs[REG_EBP]);
+	case 8:
+		return (cs_ip());
+	default:
+		return (regs[gdb_to_regs[gdb_reg & 0xF]]);
+	}
+}
+
+/**
+ * @brief Evaluates the condition of DR0, like cond_eval
+ * in dbg.asm.
+ *
+ * The bytecode is validated by the bridge, the stack index
+ * is 8-bit only so a bad one cannot go out of it.
+ *
+ * @return Returns 1 if a condition holds (or division by
+ * zero), 0 otherwise.
+ */
+static int cond_eval(void)
+{
+	uint32_t st[256];
+	uint32_t a, b, c;
+	uint8_t sp;
+	size_t pc;
+	uint8_t op;
+
+	sp = 0;
+	pc = 0;
+
+	while (pc < cond_len)
+	{
+		op = cond_code[pc++];
+		switch (op)
+		{
+		case COND_OP_DONE:
+			return (0);
+		case COND_OP_END:
+			if (st[--sp])
+				return (1);
+			sp = 0;
+			pc = get16(cond_code + pc);
+			continue;
+		case COND_OP_CONST:
+			st[sp++] = get32(cond_code + pc);
+			pc += 4;
+			continue;
+		case COND_OP_REG:
+			st[sp++] = cond_reg(cond_code[pc++]);
+			continue;
+		case COND_OP_REF8:
+			a = st[sp - 1], st[sp - 1] = mem_get(a, 1);
+			continue;
+		case COND_OP_REF16:
+			a = st[sp - 1], st[sp - 1] = mem_get(a, 2);
+			continue;
+		case COND_OP_REF32:
+			a = st[sp - 1], st[sp - 1] = mem_get(a, 4);
+			continue;
+		case COND_OP_IFGOTO:
+			if (st[--sp])
+				pc = get16(cond_code + pc);
+			else
+				pc += 2;
+			continue;
+		case COND_OP_GOTO:
+			pc = get16(cond_code + pc);
+			continue;
+		case COND_OP_PICK:
+			a = st[(uint8_t)(sp - 1 - cond_code[pc++])];
+			st[sp++] = a;
+			continue;
+		case COND_OP_POP:
+			sp--;
+			continue;
+		case COND_OP_SWAP:
+			a = st[sp - 1];
+			st[sp - 1] = st[(uint8_t)(sp - 2)];
+			st[(uint8_t)(sp - 2)] = a;
+			continue;
+		case COND_OP_ROT:
+			a = st[(uint8_t)(sp - 3)];
+			b = st[(uint8_t)(sp - 2)];
+			c = st[sp - 1];
+			st[(uint8_t)(sp - 3)] = c;
+			st[(uint8_t)(sp - 2)] = a;
+			st[sp - 1] = b;
+			continue;
+		}
+
+		/* Binary operations. */
+		b = st[--sp];
+		a = st[--sp];
+
+		switch (op)
+		{
+		case COND_OP_ADD:  a += b; break;
+		case COND_OP_SUB:  a -= b; break;
+		case COND_OP_MUL:  a *= b; break;
+		case COND_OP_LSH:  a <<= (b & 31); break;
+		case COND_OP_RSHS: a = (int32_t)a >> (b & 31); break;
+		case COND_OP_RSHU: a >>= (b & 31); break;
+		case COND_OP_AND:  a &= b; break;
+		case COND_OP_OR:   a |= b; break;
+		case COND_OP_XOR:  a ^= b; break;
+		case COND_OP_EQ:   a = (a == b); break;
+		case COND_OP_LTS:  a = ((int32_t)a < (int32_t)b); break;
+		case COND_OP_LTU:  a = (a < b); break;
+		case COND_OP_DIVS:
+		case COND_OP_DIVU:
+		case COND_OP_REMS:
+		case COND_OP_REMU:
+			if (!b)
+				return (1);
+			if (op == COND_OP_DIVU)
+				a /= b;
+			else if (op == COND_OP_REMU)
+				a %= b;
+			else if (b == 0xFFFFFFFF) /* Avoid INT_MIN / -1. */
+				a = (op == COND_OP_DIVS) ? -a : 0;
+			else if (op == COND_OP_DIVS)
+				a = (int32_t)a / (int32_t)b;
+			else
+				a = (int32_t)a % (int32_t)b;
+			break;
+		default:
+			return (1);
+		}
+		st[sp++] = a;
+	}
+	return (0);
+}
+
+/**
+ * @brief Sends the trace buffer contents, if any, and
+ * empties it.
+ */
+static void trace_drain(void)
+{
+	uint8_t hdr[4];
+
+	if (!trace_pos)
+		return;
+
+	hdr[0] = MSG_TRACE_DATA;
+	hdr[1] = trace_on;
+	put16(hdr + 2, trace_pos);
+	out_put(hdr, 4);
+
+	if (out_len + trace_pos > OUT_SIZE)
+		out_flush();
+	mem_read(trace_addr, out_buff + out_len, trace_pos);
+	out_len  += trace_pos;
+	trace_pos = 0;
+}
+
+/**
+ * @brief Saves the CS:IP (and FLAGS) of the instruction
+ * to be executed in the trace buffer.
+ */
+static void trace_record(void)
+{
+	uint8_t entry[6], *p;
+
+	p = put16(entry, regs[REG_EIP]);
+	p = put16(p, regs[REG_CS]);
+	if (trace_on & TRACE_FLAGS)
+		p = put16(p, regs[REG_EFLAGS]);
+
+	mem_write(trace_addr + trace_pos, entry, p - entry);
+	trace_pos += p - entry;
+	if (trace_pos >= trace_size)
+		trace_drain();
+}
+
+/**
+ * @brief Returns the enabled slots whose R/W is @p rw
+ * and that cover [@p addr, @p addr + @p len).
+ *
+ * @param rw_mask R/W values accepted (bit N for R/W N).
+ * @param addr Physical address.
+ * @param len Access length.
+ *
+ * @return Returns the slots matched, as in DR6.
+ */
+static uint8_t hw_bp_match(uint8_t rw_mask, uint32_t addr, uint32_t len)
+{
+	static const uint8_t lens[4] = {1, 2, 8, 4};
+	struct hw_slot *s;
+	uint8_t hits;
+	int i;
+
+	for (i = 0, hits = 0; i < 4; i++)
+	{
+		s = &hw_slots[i];
+		if (!s->used || !(rw_mask & (1 << (s->ctl & 3))))
+			continue;
+		if (addr < s->addr + lens[(s->ctl >> 2) & 3] && s->addr < addr + len)
+			hits |= 1 << i;
+	}
+	return (hits);
+}
+
+/**
+ * @brief Sets the stop reason for the slots @p hits.
+ *
+ * Like dbg.asm, if CAP_HW_BP was not negotiated, only DR2
+ * (the legacy watchpoint) has a reason of its own.
+ *
+ * @param hits Slots that fired, as in DR6.
+ */
+static void set_hw_stop(uint8_t hits)
+{
+	int slot;
+
+	if (features & CAP_HW_BP)
+	{
+		slot        = __builtin_ctz(hits);
+		stop_reason = STOP_REASON_DR0 + slot;
+		stop_addr   = hw_slots[slot].addr;
+	}
+	else if (hits & 4)
+	{
+		stop_reason = STOP_REASON_WATCHPOINT;
+		stop_addr   = hw_slots[2].addr;
+	}
+}
+
+/**
+ * @brief Executes a single instruction.
+ *
+ * @param first If this is the first instruction after
+ *              resuming, whose insn breakpoints are
+ *              ignored (like EFLAGS.RF).
+ *
+ * @return Returns 1 if the execution should stop (the stop
+ * reason is set), 0 otherwise.
+ */
+static int cpu_step(int first)
+{
+	uint8_t hits, b, data[4];
+	uint32_t phys, ip;
+
+	phys = cs_ip();
+
+	/* First insn since the trace was enabled. */
+	if (first && trace_first)
+	{
+		trace_first = 0;
+		trace_record();
+	}
+
+	if (!first)
+	{
+		hits = hw_bp_match(1 << 0, phys, 1);
+		if ((hits & 1) && cond_len && !cond_eval())
+			hits &= ~1;
+		if (hits)
+		{
+			set_hw_stop(hits);
+			return (1);
+		}
+	}
+
+	/* int3: the handler steps IP back to it. */
+	mem_read(phys, &b, 1);
+	if (b == INT3_OPC)
+		return (1);
+
+	/* The insn: EAX++ and [DATA_ADDR] = EAX, in a loop. */
+	ip = (regs[REG_EIP] + 1) & 0xFFFF;
+	if (regs[REG_CS] == START_CS && ip == START_IP + LOOP_SIZE)
+		ip = START_IP;
+
+	regs[REG_EIP] = ip;
+	regs[REG_EAX]++;
+	put32(data, regs[REG_EAX]);
+	mem_write(DATA_ADDR, data, 4);
+
+	if (trace_on)
+		trace_record();
+
+	hits = hw_bp_match((1 << 1) | (1 << 3), DATA_ADDR, 4);
+	if (hits)
+	{
+		set_hw_stop(hits);
+		return (1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Checks if anything could stop the execution,
+ * otherwise there is no point in simulating it until the
+ * bridge sends something.
+ *
+ * @return Returns 1 if so, 0 otherwise.
+ */
+static int cpu_can_stop(void)
+{
+	uint32_t loop;
+	int i;
+
+	if (run_mode == RUN_RANGE || trace_on)
+		return (1);
+
+	for (i = 0; i < 4; i++)
+		if (hw_slots[i].used)
+			return (1);
+
+	loop = START_CS * 16 + START_IP;
+	if (cs_ip() - loop >= LOOP_SIZE)
+		return (1);
+
+	return (memchr(mem + loop, INT3_OPC, LOOP_SIZE) != NULL);
+}
+
+/* ------------------------------------------------------------------*
+ * Messages                                                          *
+ * ------------------------------------------------------------------*/
+
+/**
+ * @brief Queues the register @p reg.
+ *
+ * @param p Destination.
+ * @param reg Register (push_regs order).
+ *
+ * @return Returns the end of the register in @p p.
+ */
+static uint8_t *put_reg(uint8_t *p, int reg)
+{
+	if (reg < REG_GS)
+		return (put32(p, regs[reg]));
+	return (put16(p, regs[reg]));
+}
+
+/**
+ * @brief Sends the stop message, in the format negotiated
+ * by MSG_HELLO.
+ */
+static void send_stop(void)
+{
+	uint8_t msg[128], *p;
+	uint16_t mask;
+	uint32_t sp;
+	int exp, r;
+
+	trace_drain();
+
+	exp = (features & CAP_EXPEDITE) != 0;
+	p   = msg + 1;
+
+	if (features & CAP_DELTA_STOP)
+	{
+		msg[0] = exp ? MSG_STOP_DELTA_EXP : MSG_STOP_DELTA;
+		for (r = 0, mask = 0; r < REG_COUNT; r++)
+			if (delta_full || regs[r] != prev_regs[r])
+				mask |= 1 << r;
+
+		p    = put16(p, mask);
+		*p++ = stop_reason;
+		if (stop_reason != STOP_REASON_NORMAL)
+			p = put32(p, stop_addr);
+
+		for (r = 0; r < REG_COUNT; r++)
+			if (mask & (1 << r))
+				p = put_reg(p, r);
+
+		memcpy(prev_regs, regs, sizeof regs);
+		delta_full = 0;
+	}
+	else
+	{
+		msg[0] = exp ? MSG_STOP_EXPEDITED : MSG_SINGLE_STEP;
+		for (r = 0; r < REG_COUNT; r++)
+			p = put_reg(p, r);
+		*p++ = stop_reason;
+		p    = put32(p, stop_addr);
+	}
+
+	if (exp)
+	{
+		sp = regs[REG_SS] * 16 + ((regs[REG_ESP] + 2*8) & 0xFFFF);
+		mem_read(cs_ip(), p, EXPEDITE_SIZE);
+		mem_read(sp, p + EXPEDITE_SIZE, EXPEDITE_SIZE);
+		p += 2 * EXPEDITE_SIZE;
+	}
+
+#ifndef UART_POLLING
+	/* Saved instructions. */
+	mem_read(cs_ip(), p, 4);
+	p += 4;
+#endif
+
+	out_put(msg, p - msg);
+	stop_reason = STOP_REASON_NORMAL;
+	stop_addr   = 0;
+	stats.stops++;
+}
+
+/**
+ * @brief Runs the CPU, until something stops it or
+ * RUN_BATCH instructions, so that the bridge can be
+ * heard.
+ */
+static void cpu_run(void)
+{
+	uint32_t phys;
+	int i;
+
+	for (i = 0; i < RUN_BATCH; i++)
+	{
+		if (!cpu_step(run_first))
+		{
+			run_first = 0;
+			if (run_mode != RUN_RANGE)
+				continue;
+
+			phys = cs_ip();
+			if (phys >= range_start && phys < range_end)
+				continue;
+		}
+
+		run_mode = RUN_STOPPED;
+		send_stop();
+		return;
+	}
+}
+
+/**
+ * @brief Handles MSG_BAUD: the speed is accepted if the
+ * UART clock allows it, and only kept if the probe
+ * arrives at it.
+ */
+static void handle_baud(void)
+{
+	uint32_t old_baud;
+	uint8_t b[4];
+	uint32_t rate;
+	int ok;
+
+	in_bytes(b, 4);
+	rate = get32(b);
+	ok   = rate && (UART_CLOCK / 16) % rate == 0;
+
+	out_byte(MSG_BAUD);
+	out_byte(ok);
+	out_flush();
+	if (!ok)
+		return;
+
+	old_baud = baud;
+	if (baud)
+		link_set_speed(rate);
+
+	if (in_wait(BAUD_PROBE_MS) && in_byte() == BAUD_PROBE)
+	{
+		out_byte(BAUD_PROBE_ACK);
+		baud = baud ? rate : 0;
+		return;
+	}
+	link_set_speed(old_baud);
+}
+
+/**
+ * @brief Handles MSG_WRITE_MEM_RLE: decompresses the data
+ * as it arrives, and writes it.
+ *
+ * @param addr Physical address.
+ * @param len Amount of bytes, uncompressed.
+ */
+static void handle_write_rle(uint32_t addr, size_t len)
+{
+	uint8_t buff[RLE_MAX_LIT > RLE_MAX_RUN ? RLE_MAX_LIT : RLE_MAX_RUN];
+	uint8_t tok;
+	size_t n;
+
+	while (len)
+	{
+		tok = in_byte();
+		if (tok < 0x80)
+		{
+			n = tok + 1;
+			in_bytes(buff, n);
+		}
+		else
+		{
+			n = tok - 0x80 + RLE_MIN_RUN;
+			memset(buff, in_byte(), n);
+		}
+
+		n = MIN(n, len);
+		mem_write(addr, buff, n);
+		addr += n;
+		len  -= n;
+	}
+}
+
+/**
+ * @brief Handles MSG_SEARCH_MEM: the first match entirely
+ * inside the range.
+ */
+static void handle_search(void)
+{
+	uint8_t pat[255], b[9], reply[6];
+	uint32_t addr, len, i, end;
+	uint8_t plen;
+	int found;
+
+	in_bytes(b, 9);
+	addr = get32(b);
+	len  = get32(b + 4);
+	plen = b[8];
+	in_bytes(pat, plen);
+
+	found = 0;
+	end   = (uint32_t)MIN((uint64_t)addr + len, MEM_SIZE);
+	for (i = addr; plen && plen <= SEARCH_MAX_PAT && i + plen <= end; i++)
+	{
+		if (mem[i] == pat[0] && !memcmp(mem + i, pat, plen))
+		{
+			found = 1;
+			break;
+		}
+	}
+
+	reply[0] = MSG_SEARCH_MEM;
+	reply[1] = found;
+	put32(reply + 2, found ? i : 0);
+	out_put(reply, sizeof reply);
+}
+
+/**
+ * @brief Handles MSG_CRC32, the same CRC32 of qCRC.
+ */
+static void handle_crc32(void)
+{
+	uint8_t b[8], chunk[4096];
+	uint32_t addr, len, crc;
+	size_t n;
+
+	in_bytes(b, 8);
+	addr = get32(b);
+	len  = get32(b + 4);
+
+	for (crc = CRC32_INIT; len; addr += n, len -= n)
+	{
+		n = MIN(len, sizeof chunk);
+		mem_read(addr, chunk, n);
+		crc = crc32_update(crc, chunk, n);
+	}
+
+	out_byte(MSG_CRC32);
+	put32(b, crc);
+	out_put(b, 4);
+}
+
+/**
+ * @brief Handles a message from the bridge.
+ *
+ * @param msg Message (first byte).
+ */
+static void handle_msg(uint8_t msg)
+{
+	static uint8_t tmp_buff[0x10000];
+	uint8_t b[16], *data;
+	uint32_t addr;
+	size_t len;
+
+	switch (msg)
+	{
+	case MSG_READ_MEM:
+	case MSG_READ_MEM_RLE:
+		in_bytes(b, 6);
+		addr = get32(b);
+		len  = get16(b + 4);
+
+		if (out_len + len + 1 > OUT_SIZE)
+			out_flush();
+		out_buff[out_len++] = msg;
+
+		if (msg == MSG_READ_MEM)
+		{
+			mem_read(addr, out_buff + out_len, len);
+			out_len += len;
+			break;
+		}
+
+		mem_read(addr, tmp_buff, len);
+		data = (uint8_t *)rle_encode((const char *)tmp_buff, len, &len);
+		out_put(data, len);
+		break;
+
+	case MSG_WRITE_MEM:
+	case MSG_WRITE_MEM_RLE:
+		in_bytes(b, 6);
+		addr = get32(b);
+		len  = get16(b + 4);
+
+		if (msg == MSG_WRITE_MEM_RLE)
+			handle_write_rle(addr, len);
+		else
+		{
+			in_bytes(tmp_buff, len);
+			mem_write(addr, tmp_buff, len);
+		}
+		out_byte(MSG_OK);
+		break;
+
+	case MSG_SINGLE_STEP:
+		cpu_step(1);
+		run_mode = RUN_STOPPED;
+		send_stop();
+		break;
+
+	case MSG_CONTINUE:
+		run_mode  = RUN_CONTINUE;
+		run_first = 1;
+		break;
+
+	case MSG_RANGE_STEP:
+		in_bytes(b, 8);
+		range_start = get32(b);
+		range_end   = get32(b + 4);
+		run_mode    = RUN_RANGE;
+		run_first   = 1;
+		break;
+
+	case MSG_CTRLC:
+		run_mode = RUN_STOPPED;
+		send_stop();
+		break;
+
+	case MSG_REG_WRITE:
+		in_bytes(b, 5);
+		if (b[0] < REG_COUNT)
+			regs[b[0]] = b[0] < REG_GS ? get32(b + 1) : get16(b + 1);
+		out_byte(MSG_OK);
+		break;
+
+	case MSG_HELLO:
+		in_bytes(b, 2);
+		features   = get16(b) & caps;
+		delta_full = 1;
+		out_byte(MSG_HELLO);
+		put16(b, caps);
+		out_put(b, 2);
+		break;
+
+	case MSG_SEARCH_MEM:
+		handle_search();
+		break;
+
+	case MSG_CRC32:
+		handle_crc32();
+		break;
+
+	case MSG_TRACE:
+		in_bytes(b, 7);
+		trace_drain();
+		trace_addr = get32(b);
+		trace_size = get16(b + 4);
+		trace_on   = b[6];
+		trace_first = trace_on;
+		out_byte(MSG_OK);
+		break;
+
+	case MSG_COND:
+		cond_len = in_byte();
+		in_bytes(cond_code, MIN(cond_len, COND_MAX_CODE));
+		for (len = COND_MAX_CODE; len < cond_len; len++)
+			in_byte();
+		cond_len = MIN(cond_len, COND_MAX_CODE);
+		out_byte(MSG_OK);
+		break;
+
+	case MSG_SW_BP:
+		in_bytes(b, 5);
+		addr = get32(b);
+		b[6] = mem_get(addr, 1);
+		mem_write(addr, b + 4, 1);
+		b[7] = mem_get(addr, 1);
+		out_byte(MSG_SW_BP);
+		out_put(b + 6, 2);
+		break;
+
+	case MSG_ADD_SW_BREAK:
+		in_bytes(b, 4);
+		hw_slots[0].used = 1;
+		hw_slots[0].ctl  = 0;
+		hw_slots[0].addr = get32(b);
+		out_byte(MSG_OK);
+		break;
+
+	case MSG_ADD_HW_WATCH:
+		in_bytes(b, 5);
+		hw_slots[2].used = 1;
+		hw_slots[2].ctl  = (b[0] & 3) | (3 << 2);
+		hw_slots[2].addr = get32(b + 1);
+		out_byte(MSG_OK);
+		break;
+
+	case MSG_ADD_HW_BP:
+		in_bytes(b, 6);
+		hw_slots[b[0] & 3].used = 1;
+		hw_slots[b[0] & 3].ctl  = b[1];
+		hw_slots[b[0] & 3].addr = get32(b + 2);
+		out_byte(MSG_OK);
+		break;
+
+	case MSG_REM_SW_BREAK:
+	case MSG_REM_HW_WATCH:
+	case MSG_REM_HW_BP:
+		if (msg == MSG_REM_HW_BP)
+			b[0] = in_byte();
+		else
+			b[0] = (msg == MSG_REM_SW_BREAK) ? 0 : 2;
+		hw_slots[b[0] & 3].used = 0;
+		out_byte(MSG_OK);
+		break;
+
+	case MSG_BAUD:
+		handle_baud();
+		break;
+
+	case MSG_FRAMED:
+		out_byte(MSG_FRAMED);
+		out_flush();
+		memset(&frame, 0, sizeof frame);
+		frame.on = 1;
+		break;
+
+	default:
+		fprintf(stderr, "Unknown message: %02x\n", msg);
+		break;
+	}
+}
+
+/**
+ * @brief Connects to the bridge (as a VM serial port
+ * would) at 127.0.0.1:@p p.
+ *
+ * @param p Bridge serial port.
+ */
+static void link_connect(uint16_t p)
+{
+	struct sockaddr_in addr;
+
+	link_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (link_fd < 0)
+		errx("Unable to create a socket!\n");
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons(p);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (connect(link_fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+		errx("Unable to connect to the bridge (port %d): %s\n",
+			p, strerror(errno));
+
+	set_tcp_nodelay(link_fd);
+}
+
+/**
+ * @brief Show program usage.
+ * @param prgname Program name.
+ */
+static void usage(const char *prgname)
+{
+	fprintf(stderr, "Usage: %s [options]\n", prgname);
+	fprintf(stderr,
+		"Options:\n"
+		"  -p <port>  Bridge serial port (bridge -s), default: 2345\n"
+		"  -m <path>  Memory image (up to 1 MB), default: random\n"
+		"  -b <bps>   Simulated serial speed, default: 0 (unlimited)\n"
+		"  -c <caps>  Capabilities (hex), default: %x\n"
+		"  -h This help\n\n"
+		"The simulated code loops in %d bytes at %04x:%04x, and\n"
+		"each instruction increments EAX and writes it to %05x.\n",
+		CAPS_SUPPORTED, LOOP_SIZE, START_CS, START_IP, DATA_ADDR);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Parse command-line arguments.
+ *
+ * @param argc Argument count.
+ * @param argv Argument list.
+ */
+static void parse_args(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "hp:m:b:c:")) != -1)
+	{
+		switch (c)
+		{
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'm':
+			image = optarg;
+			break;
+		case 'b':
+			baud = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			caps = strtoul(optarg, NULL, 16) & CAPS_SUPPORTED;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+}
+
+/* Main =). */
+int main(int argc, char **argv)
+{
+	parse_args(argc, argv);
+	mem_init(image);
+	link_set_speed(baud);
+
+	regs[REG_CS]     = START_CS;
+	regs[REG_EIP]    = START_IP;
+	regs[REG_SS]     = 0;
+	regs[REG_ESP]    = START_SP - 2*8;
+	regs[REG_EFLAGS] = 0x202;
+
+	link_connect(port);
+	printf("Connected to the bridge, caps: %04x\n", caps);
+
+	/* Like dbg.asm, the first thing is a single-step stop. */
+	send_stop();
+
+	for (;;)
+	{
+		out_flush();
+		if (run_mode != RUN_STOPPED && cpu_can_stop() && !in_wait(0))
+		{
+			cpu_run();
+			continue;
+		}
+		handle_msg(in_byte());
+	}
+	return (0);
+}
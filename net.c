@@ -30,8 +30,10 @@
 #include <unistd.h>
 #include <termios.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 
+#include "capture.h"
 #include "net.h"
 #include "util.h"
 
@@ -42,7 +44,7 @@
  * like: B9600.
  *
  * Any changes here should also be reflected on
- * 'constants.inc' too.
+ * 'constants.inc' and SERIAL_DEFAULT_BAUD too.
  */
 #define BAUD_RATE B115200
 
@@ -56,6 +58,22 @@ static struct handler_fd hfds[MAX_FDS];
 static int serial_fd;
 static struct termios savetty;
 
+/*
+ * Output buffers: what is sent to each fd is buffered
+ * and only written when the buffer is full, before
+ * waiting for a reply, and at the end of each event
+ * loop iteration (see flush_fds()).
+ */
+#define OUT_BUFF_SIZE 0x10000
+static struct out_buff
+{
+	int     used;
+	int     fd;
+	size_t  len;
+	uint8_t buff[OUT_BUFF_SIZE];
+} out_buffs[MAX_FDS];
+static struct net_stats stats;
+
 /**
  * @brief Write @p len bytes from @p buf to @p conn.
  *
@@ -83,14 +101,158 @@ ssize_t send_all(
 	while (len)
 	{
 		ret = write(conn, p, len);
+		stats.writes++;
 		if (ret == -1)
 			return (-1);
+		capture_data(conn, CAPTURE_OUT, p, ret);
 		p += ret;
 		len -= ret;
 	}
 	return (0);
 }
 
+/**
+ * @brief Finds the output buffer of @p conn, or gets
+ * a free one for it.
+ *
+ * @param conn Target file descriptor.
+ *
+ * @return Returns the output buffer, or NULL if there
+ * is none left.
+ */
+static struct out_buff *get_out_buff(int conn)
+{
+	int i;
+
+	for (i = 0; i < MAX_FDS; i++)
+		if (out_buffs[i].used && out_buffs[i].fd == conn)
+			return (&out_buffs[i]);
+
+	for (i = 0; i < MAX_FDS; i++)
+	{
+		if (!out_buffs[i].used)
+		{
+			out_buffs[i].used = 1;
+			out_buffs[i].fd   = conn;
+			out_buffs[i].len = 0;
+			return (&out_buffs[i]);
+		}
+	}
+	return (NULL);
+}
+
+/**
+ * @brief Writes everything buffered for @p ob.
+ *
+ * @param ob Output buffer.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int flush_out_buff(struct out_buff *ob)
+{
+	size_t len;
+
+	len     = ob->len;
+	ob->len = 0;
+
+	if (!len)
+		return (0);
+	return (send_all(ob->fd, ob->buff, len));
+}
+
+/**
+ * @brief Buffers @p len bytes from @p buf to be sent
+ * to @p conn later, with fewer write(2) calls, see
+ * flush_fd() and flush_fds().
+ *
+ * @param conn Target file descriptor.
+ * @param buf Buffer to be sent.
+ * @param len Amount of bytes to be sent.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+ssize_t send_buffered(
+	int conn, const void *buf, size_t len)
+{
+	struct out_buff *ob;
+	const char *p;
+	size_t amnt;
+
+	if (conn < 0)
+		return (-1);
+
+	stats.sends++;
+
+	ob = get_out_buff(conn);
+	if (!ob)
+		return (send_all(conn, buf, len));
+
+	for (p = buf; len; len -= amnt, p += amnt)
+	{
+		if (ob->len == OUT_BUFF_SIZE && flush_out_buff(ob) < 0)
+			return (-1);
+
+		amnt = MIN(len, OUT_BUFF_SIZE - ob->len);
+		memcpy(ob->buff + ob->len, p, amnt);
+		ob->len += amnt;
+	}
+	return (0);
+}
+
+/**
+ * @brief Writes everything buffered for @p conn.
+ *
+ * @param conn Target file descriptor.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int flush_fd(int conn)
+{
+	int i;
+
+	for (i = 0; i < MAX_FDS; i++)
+		if (out_buffs[i].used && out_buffs[i].fd == conn)
+			return (flush_out_buff(&out_buffs[i]));
+	return (0);
+}
+
+/**
+ * @brief Writes everything buffered, for all fds.
+ */
+void flush_fds(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_FDS; i++)
+		if (out_buffs[i].used && out_buffs[i].len)
+			if (flush_out_buff(&out_buffs[i]) < 0)
+				errx("Unable to write to fd %d!\n", out_buffs[i].fd);
+}
+
+/**
+ * @brief Gets the amount of sends and write(2) calls
+ * made so far.
+ *
+ * @param st Returned stats.
+ */
+void get_net_stats(struct net_stats *st)
+{
+	*st = stats;
+}
+
+/**
+ * @brief Disables Nagle's algorithm on the TCP socket
+ * @p fd, so that small replies are not delayed.
+ *
+ * @param fd Socket fd.
+ */
+void set_tcp_nodelay(int fd)
+{
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+		(const char *)&one, sizeof(one));
+}
+
 /**
  * @brief Configure a TCP server to listen to the
  * specified port @p port.
@@ -166,6 +328,162 @@ void setup_serial(int *sfd, const char *sdev)
 	atexit(restore_tty);
 }
 
+/**
+ * @brief Converts a speed in bps to its termios value.
+ *
+ * @param baud Speed, in bps.
+ *
+ * @return Returns the termios speed, or 0 (B0) if not
+ * supported.
+ */
+static speed_t baud_to_speed(int baud)
+{
+	switch (baud) {
+	case 115200: return (B115200);
+#ifdef B230400
+	case 230400: return (B230400);
+#endif
+#ifdef B460800
+	case 460800: return (B460800);
+#endif
+#ifdef B921600
+	case 921600: return (B921600);
+#endif
+	default:     return (B0);
+	}
+}
+
+/**
+ * @brief Checks if the serial speed @p baud is supported
+ * by this system.
+ *
+ * @param baud Speed, in bps.
+ *
+ * @return Returns 1 if supported, 0 otherwise.
+ */
+int has_serial_speed(int baud)
+{
+	return (baud_to_speed(baud) != B0);
+}
+
+/**
+ * @brief Changes the speed of the serial device @p fd
+ * to @p baud, after everything already written goes
+ * out. Whatever was received and not read yet is
+ * discarded.
+ *
+ * @param fd Serial device fd.
+ * @param baud Speed, in bps.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int set_serial_speed(int fd, int baud)
+{
+	struct termios tty;
+	speed_t speed;
+
+	speed = baud_to_speed(baud);
+	if (speed == B0)
+		return (-1);
+
+	flush_fd(fd);
+
+	/* Nothing to change if not a tty, like on replays. */
+	if (!isatty(fd))
+		return (0);
+
+	tcdrain(fd);
+	if (tcgetattr(fd, &tty) < 0)
+		return (-1);
+
+	cfsetospeed(&tty, speed);
+	cfsetispeed(&tty, speed);
+
+	if (tcsetattr(fd, TCSANOW, &tty) < 0)
+		return (-1);
+
+	tcflush(fd, TCIFLUSH);
+	return (0);
+}
+
+/**
+ * @brief Reads @p len bytes from @p fd into @p buf,
+ * waiting at most @p timeout_ms milliseconds for each
+ * of them.
+ *
+ * @param fd Source file descriptor.
+ * @param buf Destination buffer.
+ * @param len Amount of bytes to be read.
+ * @param timeout_ms Timeout, in milliseconds.
+ *
+ * @return Returns the amount of bytes read, which is less
+ * than @p len on timeout, or -1 if error.
+ */
+ssize_t read_timeout(int fd, void *buf, size_t len, int timeout_ms)
+{
+	struct pollfd p;
+	size_t total;
+	ssize_t ret;
+
+	p.fd     = fd;
+	p.events = POLLIN;
+
+	/* The reply depends on what is still buffered. */
+	if (flush_fd(fd) < 0)
+		return (-1);
+
+	for (total = 0; total < len; total += ret)
+	{
+		ret = poll(&p, 1, timeout_ms);
+		if (ret < 0)
+			return (-1);
+		if (!ret)
+			break;
+
+		ret = read(fd, (char *)buf + total, len - total);
+		if (ret <= 0)
+			return (-1);
+		capture_data(fd, CAPTURE_IN, (char *)buf + total, ret);
+	}
+	return (total);
+}
+
+/**
+ * @brief Waits at most @p timeout_ms milliseconds for
+ * @p fd to have something, and reads what is there, up
+ * to @p len bytes.
+ *
+ * @param fd Source file descriptor.
+ * @param buf Destination buffer.
+ * @param len Buffer size.
+ * @param timeout_ms Timeout, in milliseconds.
+ *
+ * @return Returns the amount of bytes read, 0 on timeout,
+ * or -1 if error.
+ */
+ssize_t read_some(int fd, void *buf, size_t len, int timeout_ms)
+{
+	struct pollfd p;
+	ssize_t ret;
+
+	p.fd     = fd;
+	p.events = POLLIN;
+
+	if (flush_fd(fd) < 0)
+		return (-1);
+
+	ret = poll(&p, 1, timeout_ms);
+	if (ret <= 0)
+		return (ret);
+
+	ret = read(fd, buf, len);
+	if (ret <= 0)
+		return (-1);
+
+	capture_data(fd, CAPTURE_IN, buf, ret);
+	return (ret);
+}
+
 /**
  * @brief Check for errors on a given pollfd @p p.
  *
@@ -286,5 +604,7 @@ void handle_fds(int n, struct handler_fd *hfd_list)
 		for (i = 0; i < nfds; i++)
 			if (pfds[i].revents & POLLIN)
 				hfds[i].handler(&hfds[i]);
+
+		flush_fds();
 	}
 }
@@ -25,16 +25,41 @@
 #ifndef NET_H
 #define NET_H
 
+	/*
+	 * Initial serial speed (bps), should be the same as
+	 * UART_BAUD in 'constants.inc'.
+	 */
+	#define SERIAL_DEFAULT_BAUD 115200
+
 	struct handler_fd
 	{
 		int fd;
 		void (*handler)(struct handler_fd *fd);
 	};
 
+	/* Output stats (see send_buffered()). */
+	struct net_stats
+	{
+		uint64_t sends;  /* Sends requested.     */
+		uint64_t writes; /* write(2) calls made. */
+	};
+
 	extern ssize_t send_all(
 		int conn, const void *buf, size_t len);
+	extern ssize_t send_buffered(
+		int conn, const void *buf, size_t len);
+	extern int flush_fd(int conn);
+	extern void flush_fds(void);
+	extern void get_net_stats(struct net_stats *st);
+	extern void set_tcp_nodelay(int fd);
 	extern void setup_server(int *srv_fd, uint16_t port);
 	extern void setup_serial(int *sfd, const char *sdev);
+	extern int has_serial_speed(int baud);
+	extern int set_serial_speed(int fd, int baud);
+	extern ssize_t read_timeout(int fd, void *buf, size_t len,
+		int timeout_ms);
+	extern ssize_t read_some(int fd, void *buf, size_t len,
+		int timeout_ms);
 	extern void change_handled_fd(int fd_old,
 		struct handler_fd *new_hfd);
 	extern void handle_fds(int nfds, struct handler_fd *hfds);
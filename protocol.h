@@ -0,0 +1,107 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Davidson Francis <davidsondfgl@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+	/*
+	 * Serial protocol between the bridge and the target, shared
+	 * by gdb.c, bench.c and mock_target.c, and kept in sync with
+	 * constants.inc, where each message is described.
+	 */
+
+	/* Serial messages. */
+	#define MSG_ADD_SW_BREAK     0xA8
+	#define MSG_REM_SW_BREAK     0xB8
+	#define MSG_ADD_HW_WATCH     0xB7
+	#define MSG_REM_HW_WATCH     0xC7
+	#define MSG_SINGLE_STEP      0xC8
+	#define MSG_READ_MEM         0xD8
+	#define MSG_CONTINUE         0xE8
+	#define MSG_WRITE_MEM        0xF8
+	#define MSG_CTRLC            0x03
+	#define MSG_OK               0x04
+	#define MSG_REG_WRITE        0xA7
+	#define MSG_HELLO            0x97
+	#define MSG_READ_MEM_RLE     0xD7
+	#define MSG_WRITE_MEM_RLE    0xF7
+	#define MSG_STOP_EXPEDITED   0xC9
+	#define MSG_STOP_DELTA       0xCA
+	#define MSG_STOP_DELTA_EXP   0xCB
+	#define MSG_SEARCH_MEM       0xE7
+	#define MSG_CRC32            0xE6
+	#define MSG_RANGE_STEP       0xC6
+	#define MSG_TRACE            0xC5
+	#define MSG_TRACE_DATA       0xC4
+	#define MSG_COND             0xC3
+	#define MSG_SW_BP            0xC2
+	#define MSG_ADD_HW_BP        0xC1
+	#define MSG_REM_HW_BP        0xC0
+	#define MSG_BAUD             0xBF
+	#define MSG_FRAMED           0xBE
+
+	/* Capabilities (sent as reply of MSG_HELLO). */
+	#define CAP_RLE              (1 << 0)
+	#define CAP_EXPEDITE         (1 << 1)
+	#define CAP_SEARCH           (1 << 2)
+	#define CAP_CRC32            (1 << 3)
+	#define CAP_DELTA_STOP       (1 << 4)
+	#define CAP_RANGE_STEP       (1 << 5)
+	#define CAP_TRACE            (1 << 6)
+	#define CAP_COND             (1 << 7)
+	#define CAP_SW_BP            (1 << 8)
+	#define CAP_HW_BP            (1 << 9)
+	#define CAP_BAUD             (1 << 10)
+	#define CAP_FRAMED           (1 << 11)
+
+	/* Stop reasons. */
+	#define STOP_REASON_NORMAL      10
+	#define STOP_REASON_WATCHPOINT  20
+	#define STOP_REASON_DR0         30 /* DRn fired: STOP_REASON_DR0+n. */
+
+	/* Bytes at CS:IP and SS:SP in the expedited stops. */
+	#define EXPEDITE_SIZE 16
+
+	/* Longest pattern the target is able to search for. */
+	#define SEARCH_MAX_PAT 32
+
+	/* Trace flags (MSG_TRACE/MSG_TRACE_DATA). */
+	#define TRACE_ON    0x01
+	#define TRACE_FLAGS 0x02
+
+	/* Speed negotiation probe (MSG_BAUD), at the new speed. */
+	#define BAUD_PROBE     0x5A
+	#define BAUD_PROBE_ACK 0xA5
+
+	/* Framed mode (MSG_FRAMED). */
+	#define FRAME_SOF      0x7E
+	#define FRAME_MAX      128
+	#define FRAME_NAK      0x80
+	#define FRAME_SEQ_MASK 0x7F
+	#define FRAME_GAP_MS   100 /* Silence that drops a frame. */
+
+	/* int3 opcode, see MSG_SW_BP. */
+	#define INT3_OPC 0xCC
+
+#endif /* PROTOCOL_H */
@@ -24,6 +24,13 @@
 
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* SIMD hex codecs, selected at runtime (see hex_codecs_init()). */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HEX_SIMD
+#include <immintrin.h>
+#endif
 
 #include "util.h"
 
@@ -34,23 +41,29 @@
 static char  *gbuffer      = NULL;
 static size_t gbuffer_size = 0;
 
+/* Same as above, but for RLE-compressed data. */
+static char  *rbuffer      = NULL;
+static size_t rbuffer_size = 0;
+
 /**
- * @brief Increase the global buffer size to a new value
+ * @brief Increase a given buffer size to a new value
  * if needed.
  *
+ * @param buff Buffer to be increased.
+ * @param size Current buffer size, updated if changed.
  * @param new_size New buffer size.
  */
-static void increase_buffer(size_t new_size)
+static void increase_buffer(char **buff, size_t *size, size_t new_size)
 {
 	char *tmp;
 
-	if (gbuffer_size < new_size)
+	if (*size < new_size)
 	{
-		tmp = realloc(gbuffer, new_size);
+		tmp = realloc(*buff, new_size);
 		if (!tmp)
 			errx("Unable to allocate %zu bytes!\n", new_size);
-		gbuffer = tmp;
-		gbuffer_size = new_size;
+		*buff = tmp;
+		*size = new_size;
 	}
 }
 
@@ -75,20 +88,329 @@ static inline char to_digit(int nibble)
  *
  * @param ch Char nibble to be converted.
  *
- * @return Returns the converted value.
+ * @return Returns the converted value, or -1 if
+ * not a hex digit.
  */
 static inline int to_value(int ch)
 {
-	int c = tolower(ch);
-
-	if (c >= '0' && c <= '9')
-		return (c - '0');
-	else if (c >= 'a' && c <= 'f')
-		return (0xA + c - 'a');
+	if (ch >= '0' && ch <= '9')
+		return (ch - '0');
+	else if (ch >= 'a' && ch <= 'f')
+		return (0xA + ch - 'a');
+	else if (ch >= 'A' && ch <= 'F')
+		return (0xA + ch - 'A');
 	else
 		return (-1);
 }
 
+/**
+ * @brief Encodes @p len bytes from @p in into @p out,
+ * one nibble at a time.
+ *
+ * This is the reference for the SIMD versions below, and
+ * handles what they leave.
+ *
+ * @param out Output buffer (2 * @p len).
+ * @param in Input buffer.
+ * @param len Input length.
+ */
+static void encode_hex_scalar(char *out, const uint8_t *in, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+	{
+		*out++ = to_digit((in[i] >> 4) & 0xF);
+		*out++ = to_digit((in[i]     ) & 0xF);
+	}
+}
+
+/**
+ * @brief Decodes @p len bytes from the 2 * @p len hex
+ * digits in @p in into @p out.
+ *
+ * @param out Output buffer.
+ * @param in Input buffer (2 * @p len).
+ * @param len Output length.
+ *
+ * @return Returns 0 if success, -1 if @p in has something
+ * that is not a hex digit.
+ */
+static int decode_hex_scalar(uint8_t *out, const char *in, size_t len)
+{
+	int hi, lo;
+	size_t i;
+
+	for (i = 0; i < len; i++, in += 2)
+	{
+		hi = to_value(in[0]);
+		lo = to_value(in[1]);
+		if (hi < 0 || lo < 0)
+			return (-1);
+		*out++ = (hi << 4) | lo;
+	}
+	return (0);
+}
+
+#ifdef HEX_SIMD
+/**
+ * @brief Encodes 16 bytes at a time: each nibble is the
+ * index of its digit in a table, which pshufb looks up
+ * for all of them at once.
+ *
+ * @param out Output buffer (2 * @p len).
+ * @param in Input buffer.
+ * @param len Input length.
+ *
+ * @return Returns the amount of bytes encoded, a multiple
+ * of 16.
+ */
+__attribute__((target("ssse3")))
+static size_t encode_hex_ssse3(char *out, const uint8_t *in, size_t len)
+{
+	__m128i v, hi, lo;
+	size_t i;
+
+	const __m128i digits = _mm_setr_epi8(
+		'0','1','2','3','4','5','6','7',
+		'8','9','a','b','c','d','e','f');
+	const __m128i mask = _mm_set1_epi8(0x0F);
+
+	for (i = 0; i + 16 <= len; i += 16, out += 32)
+	{
+		v  = _mm_loadu_si128((const __m128i *)(in + i));
+		hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		lo = _mm_and_si128(v, mask);
+		hi = _mm_shuffle_epi8(digits, hi);
+		lo = _mm_shuffle_epi8(digits, lo);
+		_mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+	return (i);
+}
+
+/**
+ * @brief Same as encode_hex_ssse3(), but 32 bytes at a
+ * time.
+ *
+ * @param out Output buffer (2 * @p len).
+ * @param in Input buffer.
+ * @param len Input length.
+ *
+ * @return Returns the amount of bytes encoded, a multiple
+ * of 32.
+ */
+__attribute__((target("avx2")))
+static size_t encode_hex_avx2(char *out, const uint8_t *in, size_t len)
+{
+	__m256i v, hi, lo, a, b;
+	size_t i;
+
+	const __m256i digits = _mm256_setr_epi8(
+		'0','1','2','3','4','5','6','7',
+		'8','9','a','b','c','d','e','f',
+		'0','1','2','3','4','5','6','7',
+		'8','9','a','b','c','d','e','f');
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+
+	for (i = 0; i + 32 <= len; i += 32, out += 64)
+	{
+		v  = _mm256_loadu_si256((const __m256i *)(in + i));
+		hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+		lo = _mm256_and_si256(v, mask);
+		hi = _mm256_shuffle_epi8(digits, hi);
+		lo = _mm256_shuffle_epi8(digits, lo);
+
+		/* Unpacks work per 128-bit lane, so put them in order. */
+		a = _mm256_unpacklo_epi8(hi, lo);
+		b = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i *)out,
+			_mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *)(out + 32),
+			_mm256_permute2x128_si256(a, b, 0x31));
+	}
+	return (i);
+}
+
+/* Constants used to decode, in each byte. */
+struct hex_k128
+{
+	__m128i zero, lower, a, nine, five, ten;
+};
+
+/**
+ * @brief Converts 16 hex digits to their values, and tells
+ * if all of them are valid.
+ *
+ * @param v Hex digits.
+ * @param k Constants.
+ * @param valid Returned mask: 0xFFFF if all valid.
+ *
+ * @return Returns the values.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i hex_values_ssse3(__m128i v,
+	const struct hex_k128 *k, int *valid)
+{
+	__m128i d, l, is_d, is_l;
+
+	/* '0'-'9' -> 0-9, 'a'-'f'/'A'-'F' -> 0-5, others above. */
+	d = _mm_sub_epi8(v, k->zero);
+	l = _mm_sub_epi8(_mm_or_si128(v, k->lower), k->a);
+
+	is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, k->nine), d);
+	is_l = _mm_cmpeq_epi8(_mm_min_epu8(l, k->five), l);
+
+	*valid = _mm_movemask_epi8(_mm_or_si128(is_d, is_l));
+	return (_mm_or_si128(_mm_and_si128(is_d, d),
+		_mm_and_si128(is_l, _mm_add_epi8(l, k->ten))));
+}
+
+/**
+ * @brief Decodes 16 bytes (32 hex digits) at a time, until
+ * the end or something that is not a hex digit.
+ *
+ * @param out Output buffer.
+ * @param in Input buffer (2 * @p len).
+ * @param len Output length.
+ *
+ * @return Returns the amount of bytes decoded, a multiple
+ * of 16.
+ */
+__attribute__((target("ssse3")))
+static size_t decode_hex_ssse3(uint8_t *out, const char *in, size_t len)
+{
+	const __m128i weights = _mm_set1_epi16(0x0110);
+	const struct hex_k128 k = {
+		_mm_set1_epi8('0'), _mm_set1_epi8(0x20), _mm_set1_epi8('a'),
+		_mm_set1_epi8(9), _mm_set1_epi8(5), _mm_set1_epi8(10)
+	};
+	__m128i v0, v1;
+	int valid0, valid1;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16, in += 32)
+	{
+		v0 = hex_values_ssse3(
+			_mm_loadu_si128((const __m128i *)in), &k, &valid0);
+		v1 = hex_values_ssse3(
+			_mm_loadu_si128((const __m128i *)(in + 16)), &k, &valid1);
+		if ((valid0 & valid1) != 0xFFFF)
+			break;
+
+		/* (hi * 16) + lo, for each pair of digits. */
+		v0 = _mm_maddubs_epi16(v0, weights);
+		v1 = _mm_maddubs_epi16(v1, weights);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(v0, v1));
+	}
+	return (i);
+}
+
+/* Same as hex_k128, for AVX2. */
+struct hex_k256
+{
+	__m256i zero, lower, a, nine, five, ten;
+};
+
+/**
+ * @brief Same as hex_values_ssse3(), but for 32 hex
+ * digits.
+ *
+ * @param v Hex digits.
+ * @param k Constants.
+ * @param valid Returned mask: -1 if all valid.
+ *
+ * @return Returns the values.
+ */
+__attribute__((target("avx2")))
+static inline __m256i hex_values_avx2(__m256i v,
+	const struct hex_k256 *k, int *valid)
+{
+	__m256i d, l, is_d, is_l;
+
+	d = _mm256_sub_epi8(v, k->zero);
+	l = _mm256_sub_epi8(_mm256_or_si256(v, k->lower), k->a);
+
+	is_d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, k->nine), d);
+	is_l = _mm256_cmpeq_epi8(_mm256_min_epu8(l, k->five), l);
+
+	*valid = _mm256_movemask_epi8(_mm256_or_si256(is_d, is_l));
+	return (_mm256_or_si256(_mm256_and_si256(is_d, d),
+		_mm256_and_si256(is_l, _mm256_add_epi8(l, k->ten))));
+}
+
+/**
+ * @brief Same as decode_hex_ssse3(), but 32 bytes at a
+ * time.
+ *
+ * @param out Output buffer.
+ * @param in Input buffer (2 * @p len).
+ * @param len Output length.
+ *
+ * @return Returns the amount of bytes decoded, a multiple
+ * of 32.
+ */
+__attribute__((target("avx2")))
+static size_t decode_hex_avx2(uint8_t *out, const char *in, size_t len)
+{
+	const __m256i weights = _mm256_set1_epi16(0x0110);
+	const struct hex_k256 k = {
+		_mm256_set1_epi8('0'), _mm256_set1_epi8(0x20),
+		_mm256_set1_epi8('a'), _mm256_set1_epi8(9),
+		_mm256_set1_epi8(5), _mm256_set1_epi8(10)
+	};
+	__m256i v0, v1;
+	int valid0, valid1;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32, in += 64)
+	{
+		v0 = hex_values_avx2(
+			_mm256_loadu_si256((const __m256i *)in), &k, &valid0);
+		v1 = hex_values_avx2(
+			_mm256_loadu_si256((const __m256i *)(in + 32)), &k, &valid1);
+		if ((valid0 & valid1) != -1)
+			break;
+
+		v0 = _mm256_maddubs_epi16(v0, weights);
+		v1 = _mm256_maddubs_epi16(v1, weights);
+
+		/* Packs work per 128-bit lane, so put them in order. */
+		_mm256_storeu_si256((__m256i *)(out + i),
+			_mm256_permute4x64_epi64(_mm256_packus_epi16(v0, v1), 0xD8));
+	}
+	return (i);
+}
+#endif /* HEX_SIMD */
+
+/* Hex codecs for the bulk of the data, if any. */
+static int hex_codecs_ready;
+static size_t (*encode_hex_bulk)(char *out, const uint8_t *in,
+	size_t len);
+static size_t (*decode_hex_bulk)(uint8_t *out, const char *in,
+	size_t len);
+
+/**
+ * @brief Selects the fastest hex codecs this CPU supports.
+ */
+static void hex_codecs_init(void)
+{
+	hex_codecs_ready = 1;
+
+#ifdef HEX_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		encode_hex_bulk = encode_hex_avx2;
+		decode_hex_bulk = decode_hex_avx2;
+	}
+	else if (__builtin_cpu_supports("ssse3"))
+	{
+		encode_hex_bulk = encode_hex_ssse3;
+		decode_hex_bulk = decode_hex_ssse3;
+	}
+#endif
+}
+
 /**
  * @brief Encodes a binary data inside @p data to its
  * representative form in ascii hex value.
@@ -104,17 +426,17 @@ static inline int to_value(int ch)
  */
 char *encode_hex(const char *data, size_t len)
 {
-	char *tmp;
-	size_t i;
+	const uint8_t *in = (const uint8_t *)data;
+	size_t done = 0;
 
-	increase_buffer(len * 2);
+	increase_buffer(&gbuffer, &gbuffer_size, len * 2);
 
-	for (i = 0, tmp = gbuffer; i < len; i++)
-	{
-		*tmp++ = to_digit((data[i] >> 4) & 0xF);
-		*tmp++ = to_digit((data[i]     ) & 0xF);
-	}
+	if (!hex_codecs_ready)
+		hex_codecs_init();
+	if (encode_hex_bulk)
+		done = encode_hex_bulk(gbuffer, in, len);
 
+	encode_hex_scalar(gbuffer + done * 2, in + done, len - done);
 	return (gbuffer);
 }
 
@@ -124,26 +446,165 @@ char *encode_hex(const char *data, size_t len)
  * form.
  *
  * @param data Input buffer to be decoded to binary.
- * @param len Input buffer length.
+ * @param len Output length, i.e., half of the input
+ * buffer length.
  *
  * @return Returns the buffer containing the binary
- * representation of the data.
+ * representation of the data, or NULL if @p data has
+ * something that is not a hex digit.
  */
 char *decode_hex(const char *data, size_t len)
 {
-	char *ptr;
+	uint8_t *out;
+	size_t done = 0;
+
+	/* At least 1 byte, as NULL means invalid. */
+	increase_buffer(&gbuffer, &gbuffer_size, MAX(len, 1));
+	out = (uint8_t *)gbuffer;
+
+	if (!hex_codecs_ready)
+		hex_codecs_init();
+	if (decode_hex_bulk)
+		done = decode_hex_bulk(out, data, len);
+
+	if (decode_hex_scalar(out + done, data + done * 2, len - done) < 0)
+		return (NULL);
+
+	return (gbuffer);
+}
+
+/**
+ * @brief Length of the run of equal bytes at @p data.
+ *
+ * @param data Input buffer.
+ * @param len Input buffer length (non-zero).
+ *
+ * @return Returns the run length, limited to RLE_MAX_RUN.
+ */
+static inline size_t rle_run_len(const uint8_t *data, size_t len)
+{
 	size_t i;
+	len = MIN(len, RLE_MAX_RUN);
+	for (i = 1; i < len && data[i] == data[0]; i++);
+	return (i);
+}
 
-	increase_buffer(len);
+/**
+ * @brief RLE-compresses the buffer @p data.
+ *
+ * The compressed data is a sequence of control bytes 'c':
+ * - c <  0x80: followed by c+1 literal bytes.
+ * - c >= 0x80: followed by a single byte, that repeats
+ *   (c - 0x80 + RLE_MIN_RUN) times.
+ *
+ * This is the very same format understood by dbg.asm
+ * (see 'RLE' in constants.inc).
+ *
+ * @param data Data to be compressed.
+ * @param len Length of @p data.
+ * @param out_len Compressed data length.
+ *
+ * @return Returns a buffer containing the compressed data.
+ */
+char *rle_encode(const char *data, size_t len, size_t *out_len)
+{
+	const uint8_t *in;
+	size_t i, lit, run;
+	uint8_t *out;
+
+	increase_buffer(&rbuffer, &rbuffer_size,
+		len + len / RLE_MAX_LIT + 1);
 
-	for (i = 0, ptr = gbuffer; i < len * 2; i += 2, ptr++)
+	in  = (const uint8_t *)data;
+	out = (uint8_t *)rbuffer;
+
+	for (i = 0; i < len; )
 	{
-		*ptr =  to_value(data[i]);
-		*ptr <<= 4;
-		*ptr |= to_value(data[i+1]);
+		run = rle_run_len(in + i, len - i);
+		if (run >= RLE_MIN_RUN)
+		{
+			*out++ = 0x80 + run - RLE_MIN_RUN;
+			*out++ = in[i];
+			i += run;
+			continue;
+		}
+
+		/* Literal bytes, until the next run. */
+		lit = 0;
+		do {
+			lit++;
+		} while (i + lit < len && lit < RLE_MAX_LIT &&
+			rle_run_len(in + i + lit, len - i - lit) < RLE_MIN_RUN);
+
+		*out++ = lit - 1;
+		memcpy(out, in + i, lit);
+		out += lit;
+		i   += lit;
 	}
 
-	return (gbuffer);
+	*out_len = out - (uint8_t *)rbuffer;
+	return (rbuffer);
+}
+
+/**
+ * @brief Updates the CRC32 @p crc with the buffer @p data.
+ *
+ * This is the CRC32 used by GDB (qCRC): polynomial
+ * 0x04C11DB7, MSB first, and no final XOR. The initial
+ * value should be CRC32_INIT.
+ *
+ * It is calculated one nibble at a time, exactly like
+ * dbg.asm does.
+ *
+ * @param crc Current CRC32.
+ * @param data Input buffer.
+ * @param len Input buffer length.
+ *
+ * @return Returns the updated CRC32.
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	static const uint32_t crc32_table[16] = {
+		0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9,
+		0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+		0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61,
+		0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD
+	};
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		crc = (crc << 4) ^ crc32_table[(crc >> 28) ^ (data[i] >> 4)];
+		crc = (crc << 4) ^ crc32_table[(crc >> 28) ^ (data[i] & 0xF)];
+	}
+	return (crc);
+}
+
+/**
+ * @brief Updates the CRC-16 @p crc with the buffer @p data.
+ *
+ * This is the CRC-16/CCITT used by the framed mode:
+ * polynomial 0x1021, MSB first, and no final XOR. The
+ * initial value should be CRC16_INIT.
+ *
+ * @param crc Current CRC-16.
+ * @param data Input buffer.
+ * @param len Input buffer length.
+ *
+ * @return Returns the updated CRC-16.
+ */
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len)
+{
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++)
+	{
+		crc ^= data[i] << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return (crc);
 }
 
 /**
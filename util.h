@@ -66,26 +66,38 @@
 	#define send_serial_byte(b) \
 		do { \
 			uint8_t byte = (b); \
-			send_all(serial_fd, &byte, 1); \
+			send_serial(&byte, 1); \
 		} while(0)
 
 	/* Send a word (16-bit) to the serial device. */
 	#define send_serial_word(w) \
 		do { \
 			uint16_t word = (w); \
-			send_all(serial_fd, &word, 2); \
+			send_serial(&word, 2); \
 		} while(0)
 
 	/* Send a double word (32-bit) to the serial device. */
 	#define send_serial_dword(dw) \
 		do { \
 			uint32_t dword = (dw); \
-			send_all(serial_fd, &dword, 4); \
+			send_serial(&dword, 4); \
 		} while(0)
 
 	/* Math macros. */
 	#define ABS(N) (((N)<0)?(-(N)):(N))
 	#define MIN(x, y) ((x) < (y) ? (x) : (y))
+	#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+	/* RLE (see rle_encode()). */
+	#define RLE_MAX_LIT 128
+	#define RLE_MIN_RUN 3
+	#define RLE_MAX_RUN (0x7F + RLE_MIN_RUN)
+
+	/* CRC32 (see crc32_update()). */
+	#define CRC32_INIT 0xFFFFFFFF
+
+	/* CRC-16 (see crc16_update()). */
+	#define CRC16_INIT 0xFFFF
 
 	/* Error and log macros. */
 	#define errx(...) \
@@ -111,6 +123,12 @@
 
 	extern char *encode_hex(const char *data, size_t len);
 	extern char *decode_hex(const char *data, size_t len);
+	extern char *rle_encode(const char *data, size_t len,
+		size_t *out_len);
+	extern uint32_t crc32_update(uint32_t crc, const uint8_t *data,
+		size_t len);
+	extern uint16_t crc16_update(uint16_t crc, const uint8_t *data,
+		size_t len);
 	extern uint32_t read_int(const char *buff, size_t *len,
 		const char **endptr, int base);
 	extern uint32_t simple_read_int(const char *buf, size_t len,